@@ -0,0 +1,554 @@
+// ==========================================================================
+// Rendering benchmark
+//
+// Traces a fixed set of scenes, the ones of Scenes/ and larger ones
+// generated here from fixed seeds, from fixed cameras at fixed resolutions
+// with the CPU ray tracer, and writes what it measured as JSON so that runs
+// can be compared over time:
+//
+//     make bench && ./bench -o results.json
+//
+// For every case it reports the time to load the scene, the time until the
+// first pixel is known (reading, building the trees and the first tile of
+// the first frame), statistics of the frame times after warm-up frames, rays
+// per second and the share of each kind of ray in them, the peak resident
+// memory of the case and a hash of the image, which changes whenever the
+// picture does.
+// ==========================================================================
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "glm/glm.hpp"
+#include "raytracer.h"
+#include "scenefile.h"
+#include "simd.h"
+#include "triangles.h"
+
+using namespace std;
+using namespace glm;
+
+// frames traced before the timed ones, and timed frames, unless given
+#define BENCH_WARMUP 1
+#define BENCH_REPETITIONS 5
+
+// --------------------------------------------------------------------------
+// Generated scenes
+
+struct BenchScene
+{
+	vector<object> objects;
+	vector<Mesh> meshes;
+	vector<float> lights;
+	vector<float> lightIntensities;
+};
+
+// uniform in [a, b); mt19937 is specified bit for bit, unlike the standard
+// distributions, so the scenes are the same on every platform
+static float uniform(mt19937 *random, float a, float b)
+{
+	return a + (b - a)*(float)((*random)()/4294967296.0);
+}
+
+static void addLight(BenchScene *scene, vec3 position, float intensity)
+{
+	for (int a = 0; a < 3; a++)
+		scene->lights.push_back(position[a]);
+	scene->lightIntensities.push_back(intensity);
+}
+
+static object makeObject(int type, vec4 color, float reflectance)
+{
+	object o;
+	o.type = type;
+	o.x = o.y = o.z = vec3(0);
+	o.color = color;
+	o.specularity = vec4(1);
+	o.shininess = 16;
+	o.reflectance = reflectance;
+	o.refraction = 1.3f;
+	return o;
+}
+
+static void addFloor(BenchScene *scene, float height)
+{
+	object floor = makeObject(PLANE_TYPE, vec4(0.8f, 0.8f, 0.8f, 0), 0);
+	floor.x = vec3(0, 1, 0);
+	floor.y = vec3(0, height, 0);
+	scene->objects.push_back(floor);
+}
+
+// count small random triangles in a box in front of the camera, every 50th
+// object a sphere instead and every 10th sphere glass
+static void makeSoup(BenchScene *scene, int count)
+{
+	mt19937 random(1);
+	addLight(scene, vec3(0, 4, -2), 1);
+	addLight(scene, vec3(3, 2, 0), 0.5f);
+	for (int i = 0; i < count; i++)
+	{
+		vec3 centre(uniform(&random, -5, 5), uniform(&random, -3, 3), uniform(&random, -20, -6));
+		vec4 color(uniform(&random, 0, 1), uniform(&random, 0, 1), uniform(&random, 0, 1), 0);
+		if (i%50 == 0)
+		{
+			if (i%500 == 0)
+				color[3] = 0.6f;
+			object sphere = makeObject(SPHERE_TYPE, color, 0.2f);
+			sphere.x = centre;
+			sphere.y = vec3(uniform(&random, 0.05f, 0.3f), 0, 0);
+			scene->objects.push_back(sphere);
+			continue;
+		}
+		object triangle = makeObject(TRIANGLE_TYPE, color, 0.2f);
+		vec3 *corners[3] = { &triangle.x, &triangle.y, &triangle.z };
+		for (int c = 0; c < 3; c++)
+			*corners[c] = centre + vec3(uniform(&random, -0.3f, 0.3f), uniform(&random, -0.3f, 0.3f),
+										uniform(&random, -0.3f, 0.3f));
+		scene->objects.push_back(triangle);
+	}
+	addFloor(scene, -3);
+}
+
+// a rolling height field of cells x cells squares over [-size, size]^2
+// around the origin, two triangles per square
+static Mesh makeTerrain(int cells, float size, float roughness, unsigned int seed)
+{
+	mt19937 random(seed);
+	Mesh mesh;
+	mesh.color = vec4(0.45f, 0.6f, 0.3f, 0);
+	mesh.material.spec = vec4(1);
+	mesh.material.phong = 8;
+	mesh.material.reflectance = 0;
+	mesh.material.refraction = 1;
+	mesh.material.transparency = 0;
+
+	for (int j = 0; j <= cells; j++)
+		for (int i = 0; i <= cells; i++)
+		{
+			float x = (2.f*i/cells - 1)*size, z = (2.f*j/cells - 1)*size;
+			float y = roughness*(sin(x*0.7f/size*4)*cos(z*0.5f/size*4) + uniform(&random, -0.05f, 0.05f));
+			mesh.vertices.push_back(vec3(x, y, z));
+		}
+	for (int j = 0; j < cells; j++)
+		for (int i = 0; i < cells; i++)
+		{
+			unsigned int v = j*(cells + 1) + i, w = v + cells + 1;
+			unsigned int corners[6] = { v, w, v + 1, v + 1, w, w + 1 };
+			mesh.indices.insert(mesh.indices.end(), corners, corners + 6);
+		}
+	return mesh;
+}
+
+// one terrain mesh of half a million triangles seen from above, with a
+// mirror sphere on it
+static void makeTerrainScene(BenchScene *scene)
+{
+	addLight(scene, vec3(-4, 8, -6), 1);
+	Mesh terrain = makeTerrain(512, 10, 0.8f, 2);
+	for (size_t v = 0; v < terrain.vertices.size(); v++)
+		terrain.vertices[v] += vec3(0, -2, -15);
+	scene->meshes.push_back(terrain);
+
+	object sphere = makeObject(SPHERE_TYPE, vec4(0.9f, 0.9f, 0.9f, 0), 0.8f);
+	sphere.x = vec3(0, 0, -12);
+	sphere.y = vec3(1.5f, 0, 0);
+	scene->objects.push_back(sphere);
+}
+
+// 4096 instances of one small bumpy tile, turned and scaled at random, over
+// a floor
+static void makeInstanceScene(BenchScene *scene)
+{
+	mt19937 random(3);
+	addLight(scene, vec3(0, 10, -10), 1);
+	addLight(scene, vec3(-6, 3, 2), 0.4f);
+
+	Mesh rock = makeTerrain(16, 0.4f, 0.3f, 4);
+	rock.placed = false;
+	for (int j = 0; j < 64; j++)
+		for (int i = 0; i < 64; i++)
+		{
+			float angle = uniform(&random, 0, 6.2831853f), scale = uniform(&random, 0.5f, 1.5f);
+			float c = cos(angle)*scale, s = sin(angle)*scale;
+			vec3 place((i - 31.5f)*0.6f, -2 + uniform(&random, 0, 0.5f), -4 - j*0.6f);
+			rock.instances.push_back(mat4x3(vec3(c, 0, -s), vec3(0, scale, 0), vec3(s, 0, c), place));
+		}
+	scene->meshes.push_back(rock);
+	addFloor(scene, -2);
+}
+
+// --------------------------------------------------------------------------
+// Cases
+
+struct BenchCase
+{
+	const char *name;
+	const char *file;				// scene file, or null for a generated scene
+	void (*generate)(BenchScene *scene);
+	float ambientLight;
+	vec3 camera;
+	float phi;
+	int width;
+	int height;
+};
+
+static void makeSoup100k(BenchScene *scene)
+{
+	makeSoup(scene, 100000);
+}
+
+// the scenes of Scenes/ from the cameras and light levels the viewer starts
+// them with, then the generated ones
+static const BenchCase benchCases[] =
+{
+	{ "scene1", "Scenes/scene1.txt", 0, 1, vec3(0, 0, 0.14f), 0, 512, 512 },
+	{ "scene2", "Scenes/scene2.txt", 0, 3, vec3(0, 0, 0.14f), 0, 512, 512 },
+	{ "scene3", "Scenes/scene3.txt", 0, 3, vec3(0, 4, 14), 0, 512, 512 },
+	{ "soup-100k", 0, makeSoup100k, 1, vec3(0, 0, 0.14f), 0, 512, 512 },
+	{ "terrain-512k", 0, makeTerrainScene, 1, vec3(0, 4, 0), 0.35f, 512, 512 },
+	{ "instances-4096", 0, makeInstanceScene, 1, vec3(0, 1, 0), 0.3f, 512, 512 }
+};
+
+struct BenchOptions
+{
+	int warmup;
+	int repetitions;
+	string filter;				// only cases whose name contains it
+	string output;				// JSON file, standard output if empty
+	TraversalKernel kernel;
+	TraceSettings trace;
+
+	BenchOptions() : warmup(BENCH_WARMUP), repetitions(BENCH_REPETITIONS), kernel(KERNEL_AUTO)
+	{}
+};
+
+struct Statistics
+{
+	double min, median, mean, stddev, max;
+};
+
+struct BenchResult
+{
+	const BenchCase *bench;
+	bool loaded;
+	int objects;
+	long long triangles;			// of meshes, placed or instanced
+	double load;					// seconds to read the scene and build its trees
+	double firstPixel;				// seconds from the start to the first tile traced
+	vector<double> frames;			// seconds of every timed frame
+	Statistics frame;
+	RayCounts rays;					// per frame
+	long long peakMemory;			// bytes
+	unsigned long long imageHash;
+	TraversalKernel kernel;
+};
+
+// --------------------------------------------------------------------------
+// Measuring
+
+static double seconds(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static Statistics statistics(vector<double> samples)
+{
+	Statistics s = { 0, 0, 0, 0, 0 };
+	if (samples.empty())
+		return s;
+
+	sort(samples.begin(), samples.end());
+	int n = samples.size();
+	s.min = samples[0];
+	s.max = samples[n - 1];
+	s.median = n%2 ? samples[n/2] : (samples[n/2 - 1] + samples[n/2])/2;
+	for (int i = 0; i < n; i++)
+		s.mean += samples[i]/n;
+	for (int i = 0; i < n; i++)
+		s.stddev += (samples[i] - s.mean)*(samples[i] - s.mean);
+	s.stddev = n > 1 ? sqrt(s.stddev/(n - 1)) : 0;
+	return s;
+}
+
+// lets the peak resident set size start again from the current one, so that
+// every case reports its own peak; returns false where the kernel cannot
+static bool resetPeakMemory()
+{
+	ofstream clear("/proc/self/clear_refs");
+	return (clear << "5").flush().good();
+}
+
+// peak resident set size in bytes since the last reset, or since the start
+static long long peakMemory()
+{
+	ifstream status("/proc/self/status");
+	string line;
+	while (getline(status, line))
+		if (line.compare(0, 6, "VmHWM:") == 0)
+			return atoll(line.c_str() + 6)*1024;
+
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (long long)usage.ru_maxrss*1024;
+}
+
+// FNV-1a over the pixels
+static unsigned long long imageHash(const Framebuffer &frame)
+{
+	unsigned long long hash = 14695981039346656037ull;
+	for (size_t i = 0; i < frame.pixels.size(); i++)
+		hash = (hash ^ frame.pixels[i])*1099511628211ull;
+	return hash;
+}
+
+static bool loadCase(const BenchCase &bench, const BenchOptions &options, TraceScene *scene)
+{
+	BenchScene parsed;
+	if (bench.file)
+	{
+		if (!ReadScene(bench.file, &parsed.objects, &parsed.meshes, &parsed.lights, &parsed.lightIntensities))
+			return false;
+	}
+	else
+		bench.generate(&parsed);
+	return InitializeTraceScene(scene, parsed.objects, parsed.meshes, parsed.lights,
+								parsed.lightIntensities, bench.ambientLight, options.kernel);
+}
+
+static BenchResult runCase(const BenchCase &bench, const BenchOptions &options)
+{
+	BenchResult result;
+	result.bench = &bench;
+	result.loaded = false;
+	result.objects = 0;
+	result.triangles = 0;
+	result.load = result.firstPixel = 0;
+	result.frame = statistics(result.frames);
+	result.imageHash = 0;
+	result.kernel = options.kernel;
+
+	resetPeakMemory();
+	TraceCamera camera;
+	camera.position = bench.camera;
+	camera.phi = bench.phi;
+
+	auto start = chrono::steady_clock::now();
+	TraceScene scene;
+	if (!loadCase(bench, options, &scene))
+	{
+		result.peakMemory = peakMemory();
+		return result;
+	}
+	result.load = seconds(start);
+
+	result.loaded = true;
+	result.kernel = scene.kernel;
+	result.objects = scene.objects.size();
+	for (size_t m = 0; m < scene.meshes.size(); m++)
+	{
+		const Mesh &mesh = scene.meshes[m];
+		result.triangles += (long long)mesh.indices.size()/3*((mesh.placed ? 1 : 0) + mesh.instances.size());
+	}
+
+	Framebuffer frame;
+	frame.width = bench.width;
+	frame.height = bench.height;
+
+	// the first frame gives the first pixel, as its first finished tile, and
+	// counts the rays apart from the timed frames so that counting does not
+	// weigh on them; tracing is deterministic, so every frame casts the same
+	// rays
+	TraceSettings counted = options.trace;
+	counted.rays = &result.rays;
+	TileStats first;
+	TraceFrame(&scene, camera, &frame, counted, &first);
+	result.firstPixel = result.load + first.first;
+	result.imageHash = imageHash(frame);
+
+	for (int i = 0; i < options.warmup; i++)
+		TraceFrame(&scene, camera, &frame, options.trace);
+
+	for (int i = 0; i < options.repetitions; i++)
+	{
+		auto frameStart = chrono::steady_clock::now();
+		TraceFrame(&scene, camera, &frame, options.trace);
+		result.frames.push_back(seconds(frameStart));
+	}
+	result.frame = statistics(result.frames);
+	result.peakMemory = peakMemory();
+	return result;
+}
+
+// --------------------------------------------------------------------------
+// Reporting
+
+static double mraysPerSecond(long long rays, double seconds)
+{
+	return seconds > 0 ? rays/seconds/1e6 : 0;
+}
+
+static void writeStatistics(ostream &out, const Statistics &s)
+{
+	out << "{ \"min\": " << s.min << ", \"median\": " << s.median << ", \"mean\": " << s.mean
+		<< ", \"stddev\": " << s.stddev << ", \"max\": " << s.max << " }";
+}
+
+static void writeJSON(ostream &out, const vector<BenchResult> &results, const BenchOptions &options)
+{
+	time_t now = time(0);
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	int threads = options.trace.threads > 0 ? options.trace.threads
+		: (int)std::max(1u, thread::hardware_concurrency());
+
+	out << setprecision(6);
+	out << "{\n";
+	out << "  \"date\": \"" << date << "\",\n";
+	out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+	out << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n";
+	out << "  \"threads\": " << threads << ",\n";
+	out << "  \"packets\": " << (options.trace.packets ? "true" : "false") << ",\n";
+	out << "  \"max_bounces\": " << options.trace.maxBounces << ",\n";
+	out << "  \"triangle_kernel\": \"" << SimdLevelName(TriangleKernelLevel()) << "\",\n";
+	out << "  \"warmup\": " << options.warmup << ",\n";
+	out << "  \"repetitions\": " << options.repetitions << ",\n";
+	out << "  \"cases\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult &r = results[i];
+		const BenchCase &bench = *r.bench;
+		out << (i ? ",\n" : "\n") << "    {\n";
+		out << "      \"name\": \"" << bench.name << "\",\n";
+		out << "      \"scene\": \"" << (bench.file ? bench.file : "generated") << "\",\n";
+		out << "      \"width\": " << bench.width << ", \"height\": " << bench.height << ",\n";
+		out << "      \"loaded\": " << (r.loaded ? "true" : "false") << ",\n";
+		out << "      \"peak_rss_bytes\": " << r.peakMemory;
+		if (!r.loaded)
+		{
+			out << "\n    }";
+			continue;
+		}
+
+		double median = r.frame.median;
+		long long total = r.rays.camera + r.rays.shadow + r.rays.reflection + r.rays.refraction;
+		ostringstream hash;
+		hash << hex << setw(16) << setfill('0') << r.imageHash;
+
+		out << ",\n";
+		out << "      \"kernel\": \"" << TraversalKernelName(r.kernel) << "\",\n";
+		out << "      \"objects\": " << r.objects << ", \"mesh_triangles\": " << r.triangles << ",\n";
+		out << "      \"load_seconds\": " << r.load << ",\n";
+		out << "      \"time_to_first_pixel_seconds\": " << r.firstPixel << ",\n";
+		out << "      \"frame_seconds\": ";
+		writeStatistics(out, r.frame);
+		out << ",\n      \"frame_samples\": [";
+		for (size_t f = 0; f < r.frames.size(); f++)
+			out << (f ? ", " : " ") << r.frames[f];
+		out << " ],\n";
+		out << "      \"rays_per_frame\": { \"camera\": " << r.rays.camera << ", \"shadow\": " << r.rays.shadow
+			<< ", \"reflection\": " << r.rays.reflection << ", \"refraction\": " << r.rays.refraction
+			<< ", \"total\": " << total << " },\n";
+		out << "      \"mrays_per_second\": " << mraysPerSecond(total, median) << ",\n";
+		out << "      \"mrays_per_second_share\": { \"camera\": " << mraysPerSecond(r.rays.camera, median)
+			<< ", \"shadow\": " << mraysPerSecond(r.rays.shadow, median)
+			<< ", \"reflection\": " << mraysPerSecond(r.rays.reflection, median)
+			<< ", \"refraction\": " << mraysPerSecond(r.rays.refraction, median) << " },\n";
+		out << "      \"image_hash\": \"" << hash.str() << "\"\n";
+		out << "    }";
+	}
+	out << "\n  ]\n}\n";
+}
+
+// one line per case for whoever watches the run
+static void printSummary(const BenchResult &r)
+{
+	if (!r.loaded)
+	{
+		cerr << r.bench->name << ": could not load" << endl;
+		return;
+	}
+	long long total = r.rays.camera + r.rays.shadow + r.rays.reflection + r.rays.refraction;
+	ios::fmtflags flags = cerr.flags();
+	cerr << fixed << setprecision(3) << r.bench->name << ": first pixel " << r.firstPixel
+		<< " s, frame " << r.frame.median << " s median (+-" << r.frame.stddev << "), "
+		<< setprecision(2) << mraysPerSecond(total, r.frame.median) << " Mrays/s, peak "
+		<< r.peakMemory/(1 << 20) << " MB" << endl;
+	cerr.flags(flags);
+}
+
+// ==========================================================================
+// PROGRAM ENTRY POINT
+
+int main(int argc, char *argv[])
+{
+	//   bench [-o results.json] [-r repetitions] [-W warmup] [-c case]
+	//         [-t threads] [-k auto|binary|bvh4|bvh8] [-p 0|1]
+	BenchOptions options;
+	for (int i = 1; i < argc; i += 2)
+	{
+		string flag = argv[i];
+		if (i + 1 >= argc)
+		{
+			cerr << "usage: " << argv[0] << " [-o results.json] [-r repetitions] [-W warmup] [-c case]"
+				<< " [-t threads] [-k auto|binary|bvh4|bvh8] [-p 0|1]" << endl;
+			return -1;
+		}
+		if (flag == "-o") options.output = argv[i+1];
+		else if (flag == "-r") options.repetitions = std::max(1, atoi(argv[i+1]));
+		else if (flag == "-W") options.warmup = std::max(0, atoi(argv[i+1]));
+		else if (flag == "-c") options.filter = argv[i+1];
+		else if (flag == "-t") options.trace.threads = atoi(argv[i+1]);
+		else if (flag == "-p") options.trace.packets = atoi(argv[i+1]) != 0;
+		else if (flag == "-k")
+		{
+			if (!ParseTraversalKernel(argv[i+1], &options.kernel))
+			{
+				cerr << "Unknown traversal kernel " << argv[i+1] << endl;
+				return -1;
+			}
+		}
+		else cerr << "Ignoring unknown option " << flag << endl;
+	}
+
+	// one set of threads serves every frame
+	options.trace.pool = CreateTilePool(options.trace.threads);
+	vector<BenchResult> results;
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(benchCases)/sizeof(benchCases[0]); i++)
+	{
+		const BenchCase &bench = benchCases[i];
+		if (!options.filter.empty() && string(bench.name).find(options.filter) == string::npos)
+			continue;
+		results.push_back(runCase(bench, options));
+		printSummary(results.back());
+		failed += !results.back().loaded;
+	}
+	DestroyTilePool(options.trace.pool);
+	options.trace.pool = 0;
+
+	if (options.output.empty())
+		writeJSON(cout, results, options);
+	else
+	{
+		ofstream out(options.output);
+		writeJSON(out, results, options);
+		if (!out)
+		{
+			cerr << "unable to write " << options.output << endl;
+			return -1;
+		}
+	}
+	return failed ? -1 : 0;
+}
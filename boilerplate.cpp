@@ -17,9 +17,14 @@
 #include <string>
 #include <iterator>
 #include <cstring>
+#include <cstdio>
 #include "glm/glm.hpp"
 #include <vector>
+#include <map>
+#include <chrono>
+#include <iomanip>
 #include <unistd.h>
+#include <sys/stat.h>
 
 // specify that we want the OpenGL core profile before including GLFW headers
 #define GLFW_INCLUDE_GLCOREARB
@@ -31,6 +36,13 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
+#include "scene.h"
+#include "raytracer.h"
+#include "gpuscene.h"
+#include "scenefile.h"
+#include "watcher.h"
+#include "scenecache.h"
+
 using namespace std;
 using namespace glm;
 // --------------------------------------------------------------------------
@@ -58,23 +70,153 @@ struct MyShader
 	{}
 };
 
-// load, compile, and link shaders, returning true if successful
-bool InitializeShaders(MyShader *shader, string s)
+// linked programs are kept in SHADER_CACHE_DIR as returned by
+// glGetProgramBinary(), under a hash of everything the binary depends on
+#define SHADER_CACHE_DIR ".shadercache"
+#define SHADER_CACHE_MAGIC 0x42505347	// "GSPB"
+
+// 64 bit FNV-1a hash of text, continuing from hash
+unsigned long long hashText(const string &text, unsigned long long hash = 14695981039346656037ull)
+{
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// cache file of a program built from the given sources by the current driver
+string shaderCacheFile(const string &vertexSource, const string &fragmentSource)
+{
+	unsigned long long hash = hashText(vertexSource);
+	hash = hashText(fragmentSource, hash);
+	hash = hashText(reinterpret_cast<const char *>(glGetString(GL_VENDOR)), hash);
+	hash = hashText(reinterpret_cast<const char *>(glGetString(GL_RENDERER)), hash);
+	hash = hashText(reinterpret_cast<const char *>(glGetString(GL_VERSION)), hash);
+
+	ostringstream name;
+	name << SHADER_CACHE_DIR << "/" << hex << setw(16) << setfill('0') << hash << ".bin";
+	return name.str();
+}
+
+// creates a program from a cached binary, or returns 0 if there is none or
+// the driver rejects it
+GLuint loadCachedProgram(const string &file)
+{
+	ifstream in(file.c_str(), ios::binary);
+	unsigned int magic = 0;
+	GLenum format = 0;
+	in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+	in.read(reinterpret_cast<char *>(&format), sizeof(format));
+	if (!in || magic != SHADER_CACHE_MAGIC)
+		return 0;
+	vector<char> binary((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, format, binary.data(), binary.size());
+
+	GLint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE)
+	{
+		// an unknown format also raises GL_INVALID_ENUM, which would be
+		// reported by the next unrelated glGetError()
+		while (glGetError() != GL_NO_ERROR);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void saveCachedProgram(const string &file, GLuint program)
+{
+	GLint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE)
+		return;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+
+	// written aside and renamed into place, so a crash or a second viewer
+	// never leaves a half written binary under the name
+	mkdir(SHADER_CACHE_DIR, 0755);
+	ostringstream temp;
+	temp << file << "." << getpid() << ".tmp";
+	ofstream out(temp.str().c_str(), ios::binary);
+	unsigned int magic = SHADER_CACHE_MAGIC;
+	out.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+	out.write(reinterpret_cast<const char *>(&format), sizeof(format));
+	out.write(binary.data(), length);
+	out.close();
+	if (!out || rename(temp.str().c_str(), file.c_str()) != 0)
+	{
+		cout << "WARNING: could not write shader cache " << file << endl;
+		remove(temp.str().c_str());
+	}
+}
+
+// inserts lines of #defines after the #version line of source
+string injectDefines(const string &source, const string &defines)
+{
+	size_t version = source.find("#version");
+	size_t line = version == string::npos ? 0 : source.find('\n', version);
+	if (line == string::npos)
+		return source + "\n" + defines;
+	if (version != string::npos)
+		line++;
+	return source.substr(0, line) + defines + source.substr(line);
+}
+
+// load, compile, and link shaders, returning true if successful; defines are
+// prepended to the fragment shader, and a program linked before by the same
+// driver is taken from the cache instead
+bool InitializeShaders(MyShader *shader, string s, const string &defines = "")
 {
 	// load shader source from files
 	string vertexSource = LoadSource("vertex.glsl");
 	string fragmentSource = LoadSource(s);
 	if (vertexSource.empty() || fragmentSource.empty()) return false;
+	fragmentSource = injectDefines(fragmentSource, defines);
+
+	auto start = chrono::steady_clock::now();
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	string cacheFile = formats > 0 ? shaderCacheFile(vertexSource, fragmentSource) : "";
 
-	// compile shader source into shader objects
-	shader->vertex = CompileShader(GL_VERTEX_SHADER, vertexSource);
-	shader->fragment = CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+	GLuint cached = cacheFile.empty() ? 0 : loadCachedProgram(cacheFile);
+	if (cached)
+		shader->program = cached;
+	else
+	{
+		// compile shader source into shader objects
+		shader->vertex = CompileShader(GL_VERTEX_SHADER, vertexSource);
+		shader->fragment = CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+
+		// link shader program
+		shader->program = LinkProgram(shader->vertex, shader->fragment);
+
+		if (!cacheFile.empty())
+			saveCachedProgram(cacheFile, shader->program);
+	}
 
-	// link shader program
-	shader->program = LinkProgram(shader->vertex, shader->fragment);
+	GLint status;
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	cout << (cached ? "Loaded cached" : "Compiled") << " shader program " << s
+		<< " in " << elapsed.count()*1000 << " ms" << endl;
 
 	// check for OpenGL errors and return false if error occurred
-	return !CheckGLErrors();
+	return status == GL_TRUE && !CheckGLErrors();
 }
 
 // deallocate shader-related objects
@@ -252,12 +394,10 @@ void DestroyGeometry(MyGeometry *geometry)
 // --------------------------------------------------------------------------
 // Rendering function that draws our scene to the frame buffer
 
-void RenderScene(MyGeometry *geometry, MyShader *shader)
+// draws over whatever the bound framebuffer holds, so that blending can
+// combine the result with earlier frames
+void DrawScene(MyGeometry *geometry, MyShader *shader)
 {
-	// clear screen to a dark grey colour
-	glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
-
 	// bind our shader program and the vertex array object containing our
 	// scene geometry, then tell OpenGL to draw our geometry
 	glUseProgram(shader->program);
@@ -270,8 +410,20 @@ void RenderScene(MyGeometry *geometry, MyShader *shader)
 	glBindVertexArray(0);
 	glUseProgram(0);
 
-	// check for an report any OpenGL errors
+#ifdef GL_DEBUG
+	// check for an report any OpenGL errors; this waits for the GPU, so it
+	// only runs in builds made with -DGL_DEBUG
 	CheckGLErrors();
+#endif
+}
+
+void RenderScene(MyGeometry *geometry, MyShader *shader)
+{
+	// clear screen to a dark grey colour
+	glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	DrawScene(geometry, shader);
 }
 //--------------------------------------------------------------------------
 //Global Variables
@@ -280,346 +432,437 @@ MyTexture texture;
 MyGeometry geometry;
 MyShader shader;
 
-struct object
+// render targets and sample count of the interactive viewer, see
+// RenderProgressive()
+struct Progressive
 {
-	int type;
-	vec3 x, y, z;
-	vec4 color;
-	vec4 specularity;
-	int shininess;
-	float reflectance;
-	float refraction;
+	GLuint coarseFramebuffer;
+	GLuint coarseTexture;
+	GLuint accumFramebuffer;
+	GLuint accumTexture;
+	int width;				// framebuffer size the targets were made for
+	int height;
+	int samples;			// frames averaged in the accumulation buffer
+	double lastChange;		// glfwGetTime() of the last camera change
+	bool stale;				// window contents lost, the image must be shown again
+
+	Progressive() : coarseFramebuffer(0), coarseTexture(0), accumFramebuffer(0), accumTexture(0),
+		width(0), height(0), samples(0), lastChange(-1e9), stale(true)
+	{}
 };
 
-void deconstructObjects	(vector<object> objects, int* types, float* xs, 
-						float* ys, float* zs, float* color, float* specularities,
-						int* shininesses, float* reflectances,
-						float* refractions)
+Progressive progressive;
+
+// uniform locations of fragment.glsl, looked up once per program after linking
+struct MyUniforms
 {
-	for(int i=0; i<(int)objects.size(); i++)
-	{
-		types[i] = objects[i].type;
-		
-		for(int j=0; j<3; j++)
-		{
-			xs[i*3+j] =  objects[i].x[j];
-			ys[i*3+j] =  objects[i].y[j];
-			zs[i*3+j] =  objects[i].z[j];
-			color[i*4+j] = objects[i].color[j];
-			specularities[i*4+j] = objects[i].specularity[j];
-		}
-		color[i*4+3] = objects[i].color[3];
-		specularities[i*4+3] = objects[i].specularity[3];
-		
-		shininesses[i] = objects[i].shininess;
-		reflectances[i] = objects[i].reflectance;
-		
-		refractions[i] = objects[i].refraction;
-				
-	}
-}
+	GLuint program;
+	GLint jitter;
+	GLint maxBounces;
+	GLint ambientLight;
+	GLint numOfObjects;
+	GLint planeCount;
+	GLint nodeCount;
+	GLint lightNum;
+	GLint instanceCount;
+	GLint instanceRoot;
+	GLuint cameraBuffer;	// uniform buffer behind the Camera block
+
+	MyUniforms() : program(0), jitter(-1), maxBounces(-1), ambientLight(-1), numOfObjects(-1),
+		planeCount(-1), nodeCount(-1), lightNum(-1), instanceCount(-1), instanceRoot(-1), cameraBuffer(0)
+	{}
+};
 
-void setObjects(vector<object> objects, vector<float> lights, vector<float> lightIntensities)
+MyUniforms uniforms;
+
+// what the viewer shows; the callbacks only record changes here and
+// UploadFrameState() passes them on to the shader once per frame
+struct FrameState
 {
-	/*object o;
-	o.type = 0;
-	o.x = vec3(0,0,-10);
-	o.y = vec3(2,0,0);
-	o.z = vec3(0);
-	o.color = vec4(0.5);
-	o.specularity = vec4(1);
-	o.shininess = 1;
-	
-	objects = {o};
-	o.x=vec3(4,0,-15);
-	o.color=vec4(0,1,0,0);
-	objects.push_back(o);*/
-
-	int types[objects.size()];
-	float xs[objects.size()*3];
-	float ys[objects.size()*3];
-	float zs[objects.size()*3];
-	float colors[objects.size()*4];
-	float spec[objects.size()*4];
-	int shine[objects.size()];
-	float reflectances[objects.size()];
-	float refractions[objects.size()];
-	
-	deconstructObjects(objects, types, xs, ys, zs, colors, spec, shine, 
-						reflectances, refractions);
+	TraceCamera camera;
+	float zoom;				// scroll wheel position, mapped to the field of view
+	float ambientLight;
+	bool dirty;				// changed since the last upload
 
-	glUseProgram(shader.program);
-	GLuint loc = glGetUniformLocation(shader.program, "objectTypes");
-	glUniform1iv(loc, objects.size(), types);
-	
-	loc = glGetUniformLocation(shader.program, "xs");
-	glUniform3fv(loc, objects.size(), xs);
-	
-	loc = glGetUniformLocation(shader.program, "ys");
-	glUniform3fv(loc, objects.size(), ys);
-	
-	loc = glGetUniformLocation(shader.program, "zs");
-	glUniform3fv(loc, objects.size(), zs);
-	
-	loc = glGetUniformLocation(shader.program, "colors");
-	glUniform4fv(loc, objects.size(), colors);
-	
-	loc = glGetUniformLocation(shader.program, "specularities");
-	glUniform4fv(loc, objects.size(), spec);
-	
-	loc = glGetUniformLocation(shader.program, "shininesses");
-	glUniform1iv(loc, objects.size(), shine);
+	FrameState() : zoom(M_PI/3), ambientLight(1), dirty(true)
+	{}
+};
 
-	loc = glGetUniformLocation(shader.program, "reflectances");
-	glUniform1fv(loc, objects.size(), reflectances);
-	
-	loc = glGetUniformLocation(shader.program, "refractions");
-	glUniform1fv(loc, objects.size(), refractions);
-	
-	loc = glGetUniformLocation(shader.program, "numOfObjects");
-	glUniform1i(loc, objects.size());
+FrameState frame;
+
+// the Camera block of fragment.glsl in std140 layout
+struct CameraBlock
+{
+	float basis[3][4];		// mat3 columns, padded to vec4
+	float position[3];
+	float focalLength;
+};
 
-	loc = glGetUniformLocation(shader.program, "lights");
-	glUniform3fv(loc, lights.size(), lights.data());
+// sampler uniform and texture unit of every scene buffer
+static const char *sceneSamplers[7] = { "records", "geometry", "vertices", "materials", "nodes", "lightData",
+	"instances" };
 
-	loc = glGetUniformLocation(shader.program, "lightIntensities");
-	glUniform1fv(loc, lightIntensities.size(), lightIntensities.data());
+bool InitializeUniforms(MyUniforms *uniforms, const MyShader *shader)
+{
+	GLuint program = shader->program;
+	uniforms->program = program;
+	uniforms->jitter = glGetUniformLocation(program, "jitter");
+	uniforms->maxBounces = glGetUniformLocation(program, "maxBounces");
+	uniforms->ambientLight = glGetUniformLocation(program, "ambientLight");
+	uniforms->numOfObjects = glGetUniformLocation(program, "numOfObjects");
+	uniforms->planeCount = glGetUniformLocation(program, "planeCount");
+	uniforms->nodeCount = glGetUniformLocation(program, "nodeCount");
+	uniforms->lightNum = glGetUniformLocation(program, "lightNum");
+	uniforms->instanceCount = glGetUniformLocation(program, "instanceCount");
+	uniforms->instanceRoot = glGetUniformLocation(program, "instanceRoot");
+
+	// the scene buffers sit on texture units 0-6 for good
+	glUseProgram(program);
+	for (int i = 0; i < 7; i++)
+		glUniform1i(glGetUniformLocation(program, sceneSamplers[i]), i);
+	glUseProgram(0);
 
-	loc = glGetUniformLocation(shader.program, "lightNum");
-	glUniform1i(loc, lights.size()/3);
+	// every variant reads the one camera buffer
+	if (!uniforms->cameraBuffer)
+	{
+		glGenBuffers(1, &uniforms->cameraBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, uniforms->cameraBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), 0, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, 0, uniforms->cameraBuffer);
+	}
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Camera"), 0);
+
+	return !CheckGLErrors();
 }
 
-bool isValidObject(string w)
-{	
-	if(w=="sphere" || w=="plane" || w=="triangle")
-		return true;
-	return false;
+void DestroyUniforms(MyUniforms *uniforms)
+{
+	glDeleteBuffers(1, &uniforms->cameraBuffer);
+	*uniforms = MyUniforms();
 }
 
-struct Material
+// rotation about the y axis by the left/right angle, as in fragment.glsl
+mat3 yawMatrix(float theta)
 {
-	vec4 spec;
-	int phong;
-	float reflectance;
-	float refraction;
-	float transparency;
-};
+	return mat3	(cos(theta), 0, sin(theta),
+				 0,		1,		0,
+				 -sin(theta), 0, cos(theta));
+}
 
-object buildObject(string figure, Material m)
+// rotation about the x axis by the up/down angle, as in fragment.glsl
+mat3 pitchMatrix(float phi)
 {
-	int i = 13;
-	object o;
-	string term;
-	istringstream processor(figure);
-	vector<float> info;
+	return mat3 (1, 0, 0,
+				0, cos(phi), -sin(phi),
+				0, sin(phi), cos(phi));
+}
 
-	processor>>term;
-	if (term=="sphere")
-		o.type=0;
-	else if(term=="plane")
-		o.type=1;
-	else if(term=="triangle")
-		o.type=2;
+// hands the frame state to the shader if it changed, returning true if so
+bool UploadFrameState(FrameState *frame, const MyUniforms *uniforms)
+{
+	if (!frame->dirty)
+		return false;
 
-	processor>>term;
-	
-	while(processor>>term && term.find("}"))
-	{
-		info.push_back(stof(term,NULL));
-		i--;
-	}
+	const TraceCamera &camera = frame->camera;
+	mat3 basis = pitchMatrix(camera.phi)*yawMatrix(camera.theta);
 
-	if(i<0)
-		cout<<"Too many numbers! you forgot to change the code dummy"<<endl;
-	
-	while(i>0)
-	{
-		i--;
-		info.push_back(0);
-	}
-	
-	if(o.type==0)
+	CameraBlock block;
+	for (int c = 0; c < 3; c++)
 	{
-		o.x=vec3(info[0],info[1],info[2]);
-		o.y=vec3(info[3],0,0);
-		o.z=vec3(0);
-		o.color=vec4(info[4],info[5],info[6],info[7]);
+		for (int k = 0; k < 3; k++)
+			block.basis[c][k] = basis[c][k];
+		block.basis[c][3] = 0;
+		block.position[c] = camera.position[c];
 	}
+	block.focalLength = -1/tan(camera.fieldOfView/2);
 
-	else if(o.type==1)
-	{
-		o.x=vec3(info[0],info[1],info[2]);
-		o.y=vec3(info[3],info[4],info[5]);
-		o.z=vec3(0);
-		o.color=vec4(info[6],info[7],info[8],info[9]);
-	}
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms->cameraBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	glUseProgram(uniforms->program);
+	glUniform1f(uniforms->ambientLight, frame->ambientLight);
+
+	frame->dirty = false;
+	return true;
+}
+
+// texture buffers holding the scene for fragment.glsl, see gpuscene.h
+struct MySceneBuffers
+{
+	GLuint buffers[7];		// records, geometry, vertices, materials, nodes, lights, instances
+	GLuint textures[7];
 
-	else if(o.type==2)
+	MySceneBuffers()
 	{
-		o.x=vec3(info[0],info[1],info[2]);
-		o.y=vec3(info[3],info[4],info[5]);
-		o.z=vec3(info[6],info[7],info[8]);
-		o.color=vec4(info[9],info[10],info[11],info[12]);
+		for (int i = 0; i < 7; i++)
+			buffers[i] = textures[i] = 0;
 	}
+};
 
-	o.specularity=m.spec;
-	o.shininess=m.phong;
-	o.reflectance=m.reflectance;
-	o.refraction=m.refraction;
+MySceneBuffers sceneBuffers;
 
-	return o;
+void InitializeSceneBuffers(MySceneBuffers *scene)
+{
+	glGenBuffers(7, scene->buffers);
+	glGenTextures(7, scene->textures);
 }
 
-void buildMaterial(string material, Material *mater)
+void DestroySceneBuffers(MySceneBuffers *scene)
 {
-	istringstream bobTheBuilder(material);
-
-	string property;
-	bobTheBuilder>>property;
+	glDeleteTextures(7, scene->textures);
+	glDeleteBuffers(7, scene->buffers);
+	*scene = MySceneBuffers();
+}
 
-	while(bobTheBuilder>>property)
+// fill one buffer and attach it to its texture on texture unit index; empty
+// buffers get one texel so that the texture stays complete
+void uploadSceneBuffer(MySceneBuffers *scene, int index, GLenum format,
+						const void *data, size_t bytes)
+{
+	static const int zero[4] = { 0, 0, 0, 0 };
+	if (bytes == 0)
 	{
-		if(property=="phong:")
-		{
-			bobTheBuilder>>property;
-			mater->phong= stoi(property,NULL);
-		}
+		data = zero;
+		bytes = sizeof(zero);
+	}
 
-		else if(property=="spec:")
-		{
-			for(int i=0; i<4; i++)
-			{
-				bobTheBuilder>>property;
-				mater->spec[i]= stof(property,NULL);
-			}
-		}
+	size_t texels = bytes/(format == GL_RGB32F ? 12 : 16);
+	GLint maxTexels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	if (texels > (size_t)maxTexels)
+		cout << "WARNING: " << sceneSamplers[index] << " needs " << texels
+			<< " texels, the GPU allows " << maxTexels << endl;
 
-		else if(property=="reflectance:")
-		{
-			bobTheBuilder>>property;
-			mater->reflectance= stof(property,NULL);
-		}
-		
-		else if(property=="refraction:")
-		{
-			bobTheBuilder>>property;
-			//cout<<"Look at those flaots: " <<property<< ":end." <<endl;
-			mater->refraction= stof(property);
-		}
-	}
+	glBindBuffer(GL_TEXTURE_BUFFER, scene->buffers[index]);
+	glBufferData(GL_TEXTURE_BUFFER, bytes, data, GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
 
-	//cout<<"Spec: "<<mater->spec[0]<< " " << mater->spec[1]<< " "<< mater->spec[2] <<" Phong: "<< mater->phong<<" Reflectance: "<<mater->reflectance<<endl;
+	glActiveTexture(GL_TEXTURE0 + index);
+	glBindTexture(GL_TEXTURE_BUFFER, scene->textures[index]);
+	glTexBuffer(GL_TEXTURE_BUFFER, format, scene->buffers[index]);
 }
 
-void addLight(string info, vector<float> *lights, vector<float> *intensities)
+// texel formats of the scene buffers
+static const GLenum sceneFormats[7] = { GL_RGBA32I, GL_RGBA32F, GL_RGB32F, GL_RGBA32F, GL_RGBA32I,
+										GL_RGBA32F, GL_RGBA32I };
+
+// contents of scene buffer index in gpu, returning their size in bytes
+size_t sceneBufferData(const GPUScene &gpu, int index, const void **data)
 {
-	istringstream torch(info);
+	switch (index)
+	{
+	case 0: *data = gpu.records.data(); return gpu.records.size()*sizeof(int);
+	case 1: *data = gpu.geometry.data(); return gpu.geometry.size()*sizeof(float);
+	case 2: *data = gpu.vertices.data(); return gpu.vertices.size()*sizeof(float);
+	case 3: *data = gpu.materials.data(); return gpu.materials.size()*sizeof(float);
+	case 4: *data = gpu.nodes.data(); return gpu.nodes.size()*sizeof(int);
+	case 5: *data = gpu.lights.data(); return gpu.lights.size()*sizeof(float);
+	default: *data = gpu.instances.data(); return gpu.instances.size()*sizeof(int);
+	}
+}
 
-	string property;
-	torch>>property;
-	bool position =false, intensity=false;
+// texels closer than this between two changed runs go up with them in one call
+#define UPLOAD_GAP_TEXELS 64
 
-	while(torch>>property)
+// upload the texels of buffer index that differ between the contents it
+// holds and data, a run at a time; a buffer that changes size goes up whole.
+// Returns the number of bytes uploaded.
+size_t updateSceneBuffer(MySceneBuffers *scene, int index, const void *held, size_t heldBytes,
+						const void *data, size_t bytes)
+{
+	if (bytes != heldBytes)
 	{
-		if(property=="position:")
-		{
-			for(int i=0; i<3; i++)
-			{
-				torch>>property;
-				lights->push_back(stof(property,NULL));
-			}
-
-			position = true;
-		}
+		uploadSceneBuffer(scene, index, sceneFormats[index], data, bytes);
+		return bytes;
+	}
 
-		else if(property=="intensity:")
-		{
-			torch>>property;
-			//cout<<property<<endl;
-			intensities->push_back(stof(property,NULL));
-			intensity=true;
-		}
+	size_t texel = sceneFormats[index] == GL_RGB32F ? 12 : 16;
+	size_t texels = bytes/texel, uploaded = 0;
+	const char *a = (const char *)held, *b = (const char *)data;
+	glBindBuffer(GL_TEXTURE_BUFFER, scene->buffers[index]);
+	for (size_t t = 0; t < texels; t++)
+	{
+		if (!memcmp(a + t*texel, b + t*texel, texel))
+			continue;
+		size_t end = t + 1;
+		for (size_t next = end; next < texels && next < end + UPLOAD_GAP_TEXELS; next++)
+			if (memcmp(a + next*texel, b + next*texel, texel))
+				end = next + 1;
+		glBufferSubData(GL_TEXTURE_BUFFER, t*texel, (end - t)*texel, b + t*texel);
+		uploaded += (end - t)*texel;
+		t = end - 1;
 	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	return uploaded;
+}
+
+void setSceneUniforms(const GPUScene &gpu)
+{
+	glUseProgram(uniforms.program);
+	glUniform1i(uniforms.numOfObjects, gpu.objectCount);
+	glUniform1i(uniforms.planeCount, gpu.planeCount);
+	glUniform1i(uniforms.nodeCount, gpu.nodeCount);
+	glUniform1i(uniforms.lightNum, gpu.lightCount);
+	glUniform1i(uniforms.instanceCount, gpu.instanceCount);
+	glUniform1i(uniforms.instanceRoot, gpu.instanceRoot);
+
+	// samples of the previous scene are of no use
+	progressive.samples = 0;
+}
 
-	if(!intensity)
+// upload a packed scene, see PackGPUScene()
+void setObjects(const GPUScene &gpu)
+{
+	if (!sceneBuffers.buffers[0])
+		InitializeSceneBuffers(&sceneBuffers);
+
+	for (int i = 0; i < 7; i++)
 	{
-		intensities->push_back(1);
+		const void *data;
+		size_t bytes = sceneBufferData(gpu, i, &data);
+		uploadSceneBuffer(&sceneBuffers, i, sceneFormats[i], data, bytes);
 	}
+	glActiveTexture(GL_TEXTURE0);
+	setSceneUniforms(gpu);
+}
 
-	if(!position)
+// lay out a new version of the scene on show whose objects only changed in
+// place (see UpdateGPUScene()) and upload what differs from the last one;
+// returns the number of bytes uploaded
+size_t updateObjects(CachedScene *scene, const vector<int> &moved, int *rebuilt)
+{
+	// the buffers as the GPU holds them, to compare the new layout with
+	GPUScene &gpu = scene->gpu;
+	GPUScene held;
+	held.records.swap(gpu.records);
+	held.geometry.swap(gpu.geometry);
+	held.vertices.swap(gpu.vertices);
+	held.materials.swap(gpu.materials);
+	held.nodes.swap(gpu.nodes);
+	held.lights.swap(gpu.lights);
+	held.instances.swap(gpu.instances);
+
+	*rebuilt = UpdateGPUScene(&gpu, scene->objects, scene->meshes, scene->lights,
+							scene->lightIntensities, moved);
+	size_t uploaded = 0;
+	for (int i = 0; i < 7; i++)
 	{
-		for(int i=0; i<3; i++)
-			{
-				lights->push_back(0);
-			}
+		const void *heldData, *data;
+		size_t heldBytes = sceneBufferData(held, i, &heldData);
+		size_t bytes = sceneBufferData(gpu, i, &data);
+		uploaded += updateSceneBuffer(&sceneBuffers, i, heldData, heldBytes, data, bytes);
 	}
+	glActiveTexture(GL_TEXTURE0);
+	setSceneUniforms(gpu);
+	return uploaded;
 }
 
-bool parser(string file, vector<object>* objects, vector<float>* lights, vector<float>* lightIntensities)
+// --------------------------------------------------------------------------
+// Shader variants specialised for a scene
+//
+// Scene counts and features are compiled into the shader as constants, so
+// the driver can unroll the plane and light loops and drop the code of
+// features a scene lacks. Every variant is linked once and kept until exit.
+
+struct ShaderVariant
 {
-	ifstream inFile(file);
+	int planes;
+	int lights;
+	int bounces;			// depth of reflection and refraction chains, 0 without either
+	bool spheres;
+	bool triangles;
+	bool instances;
+	bool reflection;		// some object has a reflectance
+	bool refraction;		// some object has a colour alpha
+
+	ShaderVariant() : planes(0), lights(0), bounces(MAX_BOUNCES),
+		spheres(false), triangles(false), instances(false), reflection(false), refraction(false)
+	{}
+};
 
-	if (! inFile)
+ShaderVariant SceneVariant(const vector<object> &objects, const vector<Mesh> &meshes,
+						const vector<float> &lights)
+{
+	ShaderVariant variant;
+	variant.lights = lights.size()/3;
+	for (int i = 0; i < (int)objects.size(); i++)
 	{
-		cerr << "unable to open input file\n";
-		return false;
+		const object &o = objects[i];
+		variant.planes += o.type == PLANE_TYPE;
+		variant.spheres |= o.type == SPHERE_TYPE;
+		variant.triangles |= o.type == TRIANGLE_TYPE;
+		variant.reflection |= o.reflectance > 0;
+		variant.refraction |= o.color[3] > 0;
 	}
-
-	string line;
-	Material m;
-	m.spec=vec4(1);
-	m.phong=1;
-	m.reflectance=0;
-	m.refraction=1;
-	while(!inFile.eof())
+	for (int m = 0; m < (int)meshes.size(); m++)
 	{
-		getline(inFile, line);
+		const Mesh &mesh = meshes[m];
+		bool shown = !mesh.indices.empty() && (mesh.placed || !mesh.instances.empty());
+		variant.triangles |= shown;
+		variant.instances |= shown && !mesh.instances.empty();
+		variant.reflection |= mesh.material.reflectance > 0;
+		variant.refraction |= mesh.color[3] > 0;
+	}
 
-		if(!(line[0]=='#'))
-		{
-			string word;
-			string object = "";
-			
-			istringstream processor(line);
-			processor>>word;
-			
-			if(isValidObject(word) && word != "light")
-			{
-				while(line!="}")
-				{
-					object += line;
-					getline(inFile,line);
-				}			
-
-				object+=" } \n";
-				objects->push_back(buildObject(object, m));
-			}
+	// a chain has no bound short of the cap, since facing mirrors bounce
+	// until they reach it, but a scene with neither feature has no chain
+	variant.bounces = variant.reflection || variant.refraction ? MAX_BOUNCES : 0;
+	return variant;
+}
 
-			else if(word=="light")
-			{
-				string info = "";
-				while(line!="}")
-				{	
-					info += line;
-					getline(inFile,line);
-				}		
-				addLight(info, lights, lightIntensities);
-			}
+// the #defines fragment.glsl reads, which also name the variant
+string VariantDefines(const ShaderVariant &variant)
+{
+	ostringstream defines;
+	defines << "#define PLANE_COUNT " << variant.planes << "\n";
+	defines << "#define LIGHT_COUNT " << variant.lights << "\n";
+	defines << "#define MAX_BOUNCES " << variant.bounces << "\n";
+	if (!variant.spheres)
+		defines << "#define NO_SPHERES\n";
+	if (!variant.triangles)
+		defines << "#define NO_TRIANGLES\n";
+	if (!variant.instances)
+		defines << "#define NO_INSTANCES\n";
+	if (!variant.reflection)
+		defines << "#define NO_REFLECTION\n";
+	if (!variant.refraction)
+		defines << "#define NO_REFRACTION\n";
+	return defines.str();
+}
 
-			else if(word=="material")
-			{
-				string material = "";
-				while(line!="}")
-				{	
-					material += line;
-					getline(inFile,line);
-				}		
-				buildMaterial(material, &m);
-			}			
+map<string, MyShader> shaderVariants;
+
+// makes the variant current in shader and uniforms, building it on first
+// use; returns false if it does not compile
+bool UseShaderVariant(const ShaderVariant &variant)
+{
+	string defines = VariantDefines(variant);
+	map<string, MyShader>::iterator found = shaderVariants.find(defines);
+	if (found == shaderVariants.end())
+	{
+		MyShader built;
+		if (!InitializeShaders(&built, "fragment.glsl", defines))
+		{
+			DestroyShaders(&built);
+			return false;
 		}
+		found = shaderVariants.insert(make_pair(defines, built)).first;
 	}
-	return true;
+
+	shader = found->second;
+	return InitializeUniforms(&uniforms, &shader);
+}
+
+void DestroyShaderVariants()
+{
+	for (map<string, MyShader>::iterator i = shaderVariants.begin(); i != shaderVariants.end(); ++i)
+		DestroyShaders(&i->second);
+	shaderVariants.clear();
+	shader = MyShader();
 }
+
 // --------------------------------------------------------------------------
 // GLFW callback functions
 
@@ -630,191 +873,258 @@ void ErrorCallback(int error, const char* description)
 	cout << description << endl;
 }
 
-vector<object> objects;
-vector<float> lights;
-vector<float> lightIntensities;
+// scenes of keys 1-3
+static const char *sceneFiles[3] = { "Scenes/scene1.txt", "Scenes/scene2.txt", "Scenes/scene3.txt" };
 
-float r=0;
-float phi=0;
-vec3 camPos = vec3(0); 
-mat3 ry = mat3	(cos(r), 0, sin(r),
-				 0,		1,		0,
-				 -sin(r), 0, cos(r));
+// memory the cache may keep scenes in, see scenecache.h
+#define SCENE_CACHE_BYTES (1024ull << 20)
 
-mat3 rx = mat3 (1, 0, 0,
-				0, cos(phi), -sin(phi),
-				0, sin(phi), cos(phi));
+SceneCache *sceneCache = 0;
 
-float fov = M_PI/3;
-void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+// the scene on show, whose file is read again whenever it is saved
+shared_ptr<CachedScene> shownScene;
+SceneWatcher *sceneWatcher = 0;
+
+// moves the camera by offset, given in the frame of the left/right angle
+void moveCamera(FrameState *frame, vec3 offset)
 {
-	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-		glfwSetWindowShouldClose(window, GL_TRUE);
+	frame->camera.position += yawMatrix(frame->camera.theta)*offset;
+	frame->dirty = true;
+}
 
-	if (key == GLFW_KEY_W)
+// shows a loaded scene with its shader variant, returning false if that does
+// not compile. The scenes of the other keys are read ahead.
+bool showScene(const shared_ptr<CachedScene> &scene, float ambientLight)
+{
+	if (!UseShaderVariant(SceneVariant(scene->objects, scene->meshes, scene->lights)))
 	{
-		vec3 pos =vec3(0, 0, 0.1);
-		
-		pos = ry*pos;
-
-		camPos-=pos;
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "cameraPos");
-		glUniform3f(loc, camPos[0], camPos[1], camPos[2]);
+		cout << "ERROR: no shader for " << scene->file << endl;
+		return false;
 	}
+	shownScene = scene;
+	setObjects(shownScene->gpu);
+
+	// saving the file from now on shows the new version
+	DestroySceneWatcher(sceneWatcher);
+	sceneWatcher = CreateSceneWatcher(scene->file, glfwPostEmptyEvent);
+
+	// the keys next to this scene's are the likeliest to be pressed next
+	int key = 0;
+	while (key < 3 && scene->file != sceneFiles[key])
+		key++;
+	for (int step = 1; key < 3 && step < 3; step++)
+		for (int side = 1; side >= -1; side -= 2)
+			if (key + side*step >= 0 && key + side*step < 3)
+				PrefetchScene(sceneCache, sceneFiles[key + side*step]);
+
+	// the variant's own uniforms still need the frame state
+	frame.ambientLight = ambientLight;
+	frame.dirty = true;
+	return true;
+}
 
-	if (key == GLFW_KEY_A )
-	{
-		vec3 pos =vec3(0.1, 0, 0);
+// replaces the scene with the one in file right away, returning false if it
+// does not load or its shader does not compile
+bool loadScene(string file, float ambientLight)
+{
+	if (!sceneCache)
+		sceneCache = CreateSceneCache(SCENE_CACHE_BYTES);
 
-		pos = ry*pos;
-		
-		camPos-=pos;
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "cameraPos");
-		glUniform3f(loc, camPos[0], camPos[1], camPos[2]);
+	shared_ptr<CachedScene> scene = GetScene(sceneCache, file);
+	if (!scene)
+	{
+		cout << "ERROR: could not load " << file << endl;
+		return false;
 	}
+	return showScene(scene, ambientLight);
+}
 
-	if (key == GLFW_KEY_D )
-	{
-		vec3 pos =vec3(0.1, 0, 0);
+// --------------------------------------------------------------------------
+// Switching scenes in the background
 
-		pos = ry*pos;
-		
-		camPos+=pos;
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "cameraPos");
-		glUniform3f(loc, camPos[0], camPos[1], camPos[2]);
-	}
+#define WINDOW_TITLE "CPSC 453 OpenGL Boilerplate"
 
-	if (key == GLFW_KEY_S )
-	{
-		vec3 pos =vec3(0, 0, 0.1);
+SceneLoader *sceneLoader = 0;
 
-		pos = ry*pos;
-		
-		camPos+=pos;
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "cameraPos");
-		glUniform3f(loc, camPos[0], camPos[1], camPos[2]);
+// the scene asked for last, shown in place of the current one once loaded
+struct PendingScene
+{
+	string file;				// empty if there is none
+	float ambientLight;
+	bool placeCamera;			// move the camera to camera on the switch
+	vec3 camera;
+	double requested;			// glfwGetTime() of the request
+	int stage;					// LoadStage last reported
+
+	PendingScene() : ambientLight(1), placeCamera(false), requested(0), stage(-1)
+	{}
+};
+
+PendingScene pendingScene;
+
+// starts loading the scene in file, leaving the current one on show until it
+// is ready
+void requestScene(string file, float ambientLight, bool placeCamera = false, vec3 camera = vec3())
+{
+	if (!sceneLoader)
+		sceneLoader = CreateSceneLoader(sceneCache, glfwPostEmptyEvent);
+
+	pendingScene = PendingScene();
+	pendingScene.file = file;
+	pendingScene.ambientLight = ambientLight;
+	pendingScene.placeCamera = placeCamera;
+	pendingScene.camera = camera;
+	pendingScene.requested = glfwGetTime();
+	RequestScene(sceneLoader, file);
+}
+
+// reports how far the requested scene has got in the window title until it
+// is loaded, and shows it then
+void pollSceneLoad(GLFWwindow *window)
+{
+	if (pendingScene.file.empty())
+		return;
+
+	LoadStage stage = SceneLoadStage(sceneLoader);
+	double elapsed = glfwGetTime() - pendingScene.requested;
+	if (stage != pendingScene.stage && stage < LOAD_DONE)
+	{
+		ostringstream title;
+		title << WINDOW_TITLE << " - " << LoadStageName(stage) << " " << pendingScene.file;
+		glfwSetWindowTitle(window, title.str().c_str());
+		cout << pendingScene.file << ": " << LoadStageName(stage) << " after " << elapsed << " s" << endl;
 	}
+	pendingScene.stage = stage;
 
-	if (key == GLFW_KEY_E )
+	shared_ptr<CachedScene> scene;
+	if (!TakeLoadedScene(sceneLoader, &scene))
+		return;
+
+	PendingScene request = pendingScene;
+	pendingScene = PendingScene();
+	glfwSetWindowTitle(window, WINDOW_TITLE);
+	if (!scene)
 	{
-		camPos[1] += 0.1;
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "cameraPos");
-		glUniform3f(loc, camPos[0], camPos[1], camPos[2]);
+		cout << "ERROR: could not load " << request.file << ", keeping the current scene" << endl;
+		return;
 	}
+	if (!showScene(scene, request.ambientLight))
+		return;
+	if (request.placeCamera)
+		frame.camera.position = request.camera;
+	cout << "Showing " << request.file << " after " << elapsed << " s" << endl;
+}
 
-	if (key == GLFW_KEY_Q )
+// swaps in the version of the scene file the watcher read last, if there is
+// one. When only objects changed in place the tree is refitted and only the
+// texels that differ go up; any other edit loads the scene afresh.
+void reloadScene()
+{
+	vector<object> newObjects;
+	vector<Mesh> newMeshes;
+	vector<float> newLights;
+	vector<float> newIntensities;
+	if (!sceneWatcher || !TakeSceneVersion(sceneWatcher, &newObjects, &newMeshes, &newLights, &newIntensities))
+		return;
+
+	CachedScene *scene = shownScene.get();
+	auto start = chrono::steady_clock::now();
+	ShaderVariant variant = SceneVariant(newObjects, newMeshes, newLights);
+	vector<int> moved;
+	bool inPlace = VariantDefines(variant) == VariantDefines(SceneVariant(scene->objects, scene->meshes, scene->lights))
+		&& ChangedInPlace(scene->objects, scene->meshes, newObjects, newMeshes, &moved);
+
+	// the cached copy becomes the new version too, see UpdateCachedScene()
+	scene->objects.swap(newObjects);
+	scene->meshes.swap(newMeshes);
+	scene->lights.swap(newLights);
+	scene->lightIntensities.swap(newIntensities);
+
+	if (!inPlace)
 	{
-		camPos[1] -= 0.1;
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "cameraPos");
-		glUniform3f(loc, camPos[0], camPos[1], camPos[2]);
+		PackGPUScene(&scene->gpu, scene->objects, scene->meshes, scene->lights, scene->lightIntensities);
+		UpdateCachedScene(sceneCache, shownScene);
+		if (!UseShaderVariant(variant))
+		{
+			cout << "ERROR: no shader for " << scene->file << endl;
+			return;
+		}
+		setObjects(scene->gpu);
+		frame.dirty = true;
+		cout << "Reloaded " << scene->file << endl;
+		return;
 	}
+
+	int rebuilt = 0;
+	size_t uploaded = updateObjects(scene, moved, &rebuilt);
+	UpdateCachedScene(sceneCache, shownScene);
+	chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+	cout << "Updated " << scene->file << ": " << moved.size() << " objects moved, " << rebuilt
+		<< " subtrees rebuilt, " << uploaded << " bytes uploaded in " << elapsed.count() << " ms" << endl;
+}
+
+void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+		glfwSetWindowShouldClose(window, GL_TRUE);
+
+	if (key == GLFW_KEY_W)
+		moveCamera(&frame, vec3(0, 0, -0.1));
+
+	if (key == GLFW_KEY_A )
+		moveCamera(&frame, vec3(-0.1, 0, 0));
+
+	if (key == GLFW_KEY_D )
+		moveCamera(&frame, vec3(0.1, 0, 0));
+
+	if (key == GLFW_KEY_S )
+		moveCamera(&frame, vec3(0, 0, 0.1));
+
+	if (key == GLFW_KEY_E )
+		moveCamera(&frame, vec3(0, 0.1, 0));
+
+	if (key == GLFW_KEY_Q )
+		moveCamera(&frame, vec3(0, -0.1, 0));
 		
 	if (key == GLFW_KEY_LEFT )
 	{
-		r-=0.1;
-		ry = mat3	(cos(r), 0, sin(r),
-				 0,		1,		0,
-				 -sin(r), 0, cos(r));
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "theta");
-		glUniform1f(loc, r);
+		frame.camera.theta -= 0.1;
+		frame.dirty = true;
 	}
 
 	if (key == GLFW_KEY_RIGHT )
 	{
-		r+=0.1;
-		ry = mat3	(cos(r), 0, sin(r),
-				 0,		1,		0,
-				 -sin(r), 0, cos(r));
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "theta");
-		glUniform1f(loc, r);
+		frame.camera.theta += 0.1;
+		frame.dirty = true;
 	}
 
 	if (key == GLFW_KEY_UP )
 	{
-		phi+=0.1;
-
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "phi");
-		glUniform1f(loc, phi);
+		frame.camera.phi += 0.1;
+		frame.dirty = true;
 	}
 
 	if (key == GLFW_KEY_DOWN )
 	{
-		phi-=0.1;
-
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "phi");
-		glUniform1f(loc, phi);
+		frame.camera.phi -= 0.1;
+		frame.dirty = true;
 	}
 	
 	if (key==GLFW_KEY_1 && action==GLFW_PRESS)
-	{
-		objects.clear();
-		lights.clear();
-		lightIntensities.clear();
-		
-		parser("Scenes/scene1.txt", &objects, &lights,&lightIntensities);	
-		setObjects(objects, lights, lightIntensities);
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "ambientLight");
-		glUniform1f(loc, 1);
-	}
+		requestScene(sceneFiles[0], 1);
 	
 	if (key==GLFW_KEY_2 && action==GLFW_PRESS)
-	{
-		objects.clear();
-		lights.clear();
-		lightIntensities.clear();
-		
-		parser("Scenes/scene2.txt", &objects, &lights,&lightIntensities);	
-		setObjects(objects, lights, lightIntensities);
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "ambientLight");
-		glUniform1f(loc, 3);
-	}
+		requestScene(sceneFiles[1], 3);
 
 	if (key==GLFW_KEY_3 && action==GLFW_PRESS)
-	{
-		objects.clear();
-		lights.clear();
-		lightIntensities.clear();
-		
-		parser("Scenes/scene3.txt", &objects, &lights,&lightIntensities);	
-		setObjects(objects, lights, lightIntensities);
-		
-		glUseProgram(shader.program);
-		GLuint loc = glGetUniformLocation(shader.program, "ambientLight");
-		glUniform1f(loc, 3);
-
-		camPos=vec3(0, 4, 14);
-		loc = glGetUniformLocation(shader.program, "cameraPos");
-		glUniform3f(loc, camPos[0], camPos[1], camPos[2]);
-	}
+		requestScene(sceneFiles[2], 3, true, vec3(0, 4, 14));
 }
 // handles scroll weel input
 void scrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 {
-	fov += yoffset/10;
-
-	glUseProgram(shader.program);
-	GLuint loc = glGetUniformLocation(shader.program, "fieldOfView");
-	glUniform1f(loc, atan(fov)+M_PI/2);
+	frame.zoom += yoffset/10;
+	frame.camera.fieldOfView = atan(frame.zoom)+M_PI/2;
+	frame.dirty = true;
 }
 
 bool pan = false;
@@ -827,11 +1137,546 @@ static void cursor_position_callback(GLFWwindow* window, double xpos, double ypo
 {
 	
 }
+
+// --------------------------------------------------------------------------
+// Progressive refinement
+//
+// While the camera moves, frames are traced at 1/COARSE_SCALE of the window
+// resolution with COARSE_BOUNCES bounces and scaled up. Once the camera has
+// been still for IDLE_DELAY seconds, full resolution frames with every bounce
+// are traced, each through a different point of the pixels, and averaged in a
+// floating point accumulation buffer until MAX_SAMPLES are in.
+
+#define COARSE_SCALE 4
+#define COARSE_BOUNCES 2
+#define IDLE_DELAY 0.2
+#define MAX_SAMPLES 64
+
+// creates a framebuffer rendering to a new texture, returning true if complete
+bool InitializeTarget(GLuint *framebuffer, GLuint *texture, GLenum format, int width, int height)
+{
+	glGenTextures(1, texture);
+	glBindTexture(GL_TEXTURE_2D, *texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *texture, 0);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return complete && !CheckGLErrors();
+}
+
+void DestroyProgressive(Progressive *state)
+{
+	glDeleteFramebuffers(1, &state->coarseFramebuffer);
+	glDeleteTextures(1, &state->coarseTexture);
+	glDeleteFramebuffers(1, &state->accumFramebuffer);
+	glDeleteTextures(1, &state->accumTexture);
+	state->coarseFramebuffer = state->coarseTexture = 0;
+	state->accumFramebuffer = state->accumTexture = 0;
+}
+
+// (re)creates the render targets for a framebuffer of the given size
+bool InitializeProgressive(Progressive *state, int width, int height)
+{
+	DestroyProgressive(state);
+	state->width = width;
+	state->height = height;
+	state->samples = 0;
+
+	int coarseWidth = std::max(1, width/COARSE_SCALE);
+	int coarseHeight = std::max(1, height/COARSE_SCALE);
+	return InitializeTarget(&state->coarseFramebuffer, &state->coarseTexture, GL_RGBA8, coarseWidth, coarseHeight)
+		&& InitializeTarget(&state->accumFramebuffer, &state->accumTexture, GL_RGBA32F, width, height);
+}
+
+// element index of the radical inverse sequence in the given base, in [0, 1)
+float Halton(int index, int base)
+{
+	float result = 0;
+	float f = 1;
+	for (int i = index; i > 0; i /= base)
+	{
+		f /= base;
+		result += f*(i % base);
+	}
+	return result;
+}
+
+// traces one frame into the bound framebuffer
+void TracePass(MyGeometry *geometry, MyShader *shader, const MyUniforms *uniforms,
+			int width, int height, vec2 jitter, int bounces)
+{
+	glViewport(0, 0, width, height);
+	glUseProgram(shader->program);
+	glUniform2f(uniforms->jitter, jitter[0], jitter[1]);
+	glUniform1i(uniforms->maxBounces, bounces);
+	DrawScene(geometry, shader);
+}
+
+// copies a render target onto the window
+void ShowTarget(GLuint framebuffer, int width, int height, int windowWidth, int windowHeight)
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// draws the next frame of the viewer at time now (glfwGetTime())
+void RenderProgressive(Progressive *state, FrameState *frame, const MyUniforms *uniforms,
+					MyGeometry *geometry, MyShader *shader, int width, int height, double now)
+{
+	if (width != state->width || height != state->height)
+		if (!InitializeProgressive(state, width, height))
+		{
+			// without render targets every frame is traced in full
+			RenderScene(geometry, shader);
+			return;
+		}
+
+	if (UploadFrameState(frame, uniforms))
+	{
+		state->samples = 0;
+		state->lastChange = now;
+	}
+	state->stale = false;
+
+	if (now - state->lastChange < IDLE_DELAY)
+	{
+		int coarseWidth = std::max(1, width/COARSE_SCALE);
+		int coarseHeight = std::max(1, height/COARSE_SCALE);
+		glBindFramebuffer(GL_FRAMEBUFFER, state->coarseFramebuffer);
+		TracePass(geometry, shader, uniforms, coarseWidth, coarseHeight, vec2(0), COARSE_BOUNCES);
+		ShowTarget(state->coarseFramebuffer, coarseWidth, coarseHeight, width, height);
+		return;
+	}
+
+	if (state->samples < MAX_SAMPLES)
+	{
+		// the first sample goes through the pixel centres like a plain frame,
+		// the others spread over the pixel; textureCoords span 2 per axis
+		int n = state->samples;
+		vec2 jitter = vec2(0);
+		if (n > 0)
+			jitter = vec2((Halton(n, 2) - 0.5f)*2/width, (Halton(n, 3) - 0.5f)*2/height);
+
+		// running average: the new frame gets weight 1/(n+1)
+		glBindFramebuffer(GL_FRAMEBUFFER, state->accumFramebuffer);
+		glEnable(GL_BLEND);
+		glBlendColor(0, 0, 0, 1.f/(n + 1));
+		glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+		TracePass(geometry, shader, uniforms, width, height, jitter, MAX_BOUNCES);
+		glDisable(GL_BLEND);
+		state->samples++;
+	}
+	ShowTarget(state->accumFramebuffer, width, height, width, height);
+}
+
+// seconds until the viewer has to draw again at time now: 0 if right away,
+// negative if nothing changes before the next event
+double NextRedraw(const Progressive *state, const FrameState *frame, int width, int height, double now)
+{
+	if (frame->dirty || state->stale || width != state->width || height != state->height)
+		return 0;
+
+	// the coarse frame stays up until the camera has rested
+	double idle = state->lastChange + IDLE_DELAY - now;
+	if (idle > 0)
+		return idle;
+
+	return state->samples < MAX_SAMPLES ? 0 : -1;
+}
+
+// the window system lost the window contents
+void windowRefreshCallback(GLFWwindow* window)
+{
+	progressive.stale = true;
+}
+
+// --------------------------------------------------------------------------
+// Headless rendering on the CPU
+
+// command line settings shared by the headless modes
+struct HeadlessOptions
+{
+	int width;
+	int height;
+	float ambient;
+	TraversalKernel kernel;
+	TraceSettings trace;
+	bool stats;			// print how busy every thread was
+
+	HeadlessOptions() : width(1000), height(1000), ambient(1), kernel(KERNEL_AUTO), stats(false)
+	{}
+};
+
+// reads "-flag value" pairs from argv[first] on, returning true if all are valid
+bool ParseHeadlessOptions(int argc, char *argv[], int first, HeadlessOptions *options)
+{
+	for (int i = first; i < argc; i += 2)
+	{
+		string flag = argv[i];
+		if (i + 1 >= argc)
+		{
+			cout << "Missing value for option " << flag << endl;
+			return false;
+		}
+		if (flag == "-w") options->width = atoi(argv[i+1]);
+		else if (flag == "-h") options->height = atoi(argv[i+1]);
+		else if (flag == "-t") options->trace.threads = atoi(argv[i+1]);
+		else if (flag == "-p") options->trace.packets = atoi(argv[i+1]) != 0;
+		else if (flag == "-s") options->stats = atoi(argv[i+1]) != 0;
+		else if (flag == "-a") options->ambient = atof(argv[i+1]);
+		else if (flag == "-k")
+		{
+			if (!ParseTraversalKernel(argv[i+1], &options->kernel))
+			{
+				cout << "Unknown traversal kernel " << argv[i+1] << endl;
+				return false;
+			}
+		}
+		else cout << "Ignoring unknown option " << flag << endl;
+	}
+	if (options->width <= 0 || options->height <= 0)
+	{
+		cout << "Image size must be positive" << endl;
+		return false;
+	}
+	return true;
+}
+
+// parses a scene file and prepares it for tracing, returning true if successful
+bool LoadTraceScene(string sceneFile, float ambient, TraversalKernel kernel, TraceScene *scene)
+{
+	vector<object> sceneObjects;
+	vector<Mesh> sceneMeshes;
+	vector<float> sceneLights;
+	vector<float> sceneIntensities;
+	if (!ReadScene(sceneFile, &sceneObjects, &sceneMeshes, &sceneLights, &sceneIntensities))
+		return false;
+
+	if (!InitializeTraceScene(scene, sceneObjects, sceneMeshes, sceneLights, sceneIntensities, ambient, kernel))
+		return false;
+
+	cout << "BVH over " << scene->bvh.indices.size() << " objects: "
+		<< scene->bvh.nodes.size() << " nodes, SAH cost " << scene->bvh.cost
+		<< ", built in " << scene->bvh.buildTime*1000 << "ms, traversed with "
+		<< TraversalKernelName(scene->kernel) << ", triangles tested with "
+		<< SimdLevelName(TriangleKernelLevel()) << endl;
+	const InstanceBVH &instances = scene->instances;
+	if (!instances.meshes.empty())
+		cout << instances.meshes.size() << " instances of " << instances.starts.back() - instances.starts[0]
+			<< " triangles in all, top-level tree of " << instances.top.nodes.size()
+			<< " nodes, both levels built in " << instances.buildTime*1000 << "ms" << endl;
+	return true;
+}
+
+// prints the share of the frame time every thread spent rendering tiles
+void PrintTileStats(const TileStats &stats)
+{
+	int tiles = 0, stolen = 0;
+	double busy = 0;
+	int threads = stats.workers.size();
+	ios::fmtflags flags = cout.flags();
+	streamsize precision = cout.precision();
+	cout << fixed << setprecision(1);
+	for (int i = 0; i < threads; i++)
+	{
+		const WorkerStats &w = stats.workers[i];
+		cout << "  thread " << i << ": " << w.tiles << " tiles, " << w.stolen << " stolen, "
+			<< 100*w.busy/stats.elapsed << "% busy" << endl;
+		tiles += w.tiles;
+		stolen += w.stolen;
+		busy += w.busy;
+	}
+	cout << "  " << tiles << " tiles on " << threads << " threads, " << stolen << " stolen, "
+		<< 100*busy/(threads*stats.elapsed) << "% average utilization" << endl;
+	cout.flags(flags);
+	cout.precision(precision);
+}
+
+// traces one frame and saves it as a png
+void RenderToFile(const TraceScene *scene, const TraceCamera &camera, int width, int height,
+				string imageFile, const TraceSettings &settings, bool printStats)
+{
+	Framebuffer frame;
+	frame.width = width;
+	frame.height = height;
+
+	TileStats stats;
+	auto start = chrono::steady_clock::now();
+	TraceFrame(scene, camera, &frame, settings, &stats);
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+	cout << "Traced " << imageFile << " at " << width << "x" << height
+		<< " in " << elapsed.count() << "s" << endl;
+	if (printStats)
+		PrintTileStats(stats);
+
+	SaveImage(imageFile.c_str(), width, height, frame.pixels.data());
+}
+
+// traces a scene file with the CPU ray tracer and saves the frame as a png
+int RenderHeadless(string sceneFile, string imageFile, const HeadlessOptions &options)
+{
+	TraceScene scene;
+	if (!LoadTraceScene(sceneFile, options.ambient, options.kernel, &scene))
+		return -1;
+
+	TraceSettings settings = options.trace;
+	settings.pool = CreateTilePool(settings.threads);
+	RenderToFile(&scene, TraceCamera(), options.width, options.height, imageFile, settings, options.stats);
+	DestroyTilePool(settings.pool);
+	return 0;
+}
+
+struct BatchCamera
+{
+	TraceCamera camera;
+	int width;
+	int height;
+	string output;
+};
+
+struct BatchScene
+{
+	string file;
+	float ambient;
+	vector<BatchCamera> cameras;
+};
+
+// reads the optional number ending a job file line into value, which is
+// kept if the line ends first; false if anything else is left on the line
+bool readOptional(istringstream &processor, float *value)
+{
+	processor >> ws;
+	if (processor.eof())
+		return true;
+	return (processor >> *value) && (processor >> ws).eof();
+}
+
+// reads a job file listing scenes and the cameras to render for each one:
+//
+//   scene  path [ambientLight]
+//   camera x y z  theta phi  width height  image.png [fieldOfView]
+//
+// cameras belong to the scene line above them; lines starting with '#' are
+// comments. Cameras of a scene listed several times are merged so that every
+// scene is loaded exactly once, which takes the same ambient light on every
+// line of the scene. The bracketed fields may be left out, but not garbled.
+bool ReadBatchFile(string file, vector<BatchScene> *scenes)
+{
+	ifstream inFile(file);
+	if (!inFile)
+	{
+		cerr << "unable to open job file " << file << endl;
+		return false;
+	}
+
+	string line;
+	int lineNumber = 0;
+	int current = -1;
+	while (getline(inFile, line))
+	{
+		lineNumber++;
+		istringstream processor(line);
+		string word;
+		if (!(processor >> word) || word[0] == '#')
+			continue;
+
+		if (word == "scene")
+		{
+			BatchScene scene;
+			scene.ambient = 1;
+			if (!(processor >> scene.file))
+			{
+				cerr << file << ":" << lineNumber << ": scene needs a path" << endl;
+				return false;
+			}
+			if (!readOptional(processor, &scene.ambient))
+			{
+				cerr << file << ":" << lineNumber << ": malformed ambient light" << endl;
+				return false;
+			}
+
+			current = -1;
+			for (int i = 0; i < (int)scenes->size(); i++)
+				if ((*scenes)[i].file == scene.file)
+					current = i;
+			if (current >= 0 && (*scenes)[current].ambient != scene.ambient)
+			{
+				cerr << file << ":" << lineNumber << ": " << scene.file << " listed again with ambient light "
+					<< scene.ambient << " instead of " << (*scenes)[current].ambient << endl;
+				return false;
+			}
+			if (current < 0)
+			{
+				current = scenes->size();
+				scenes->push_back(scene);
+			}
+		}
+
+		else if (word == "camera")
+		{
+			BatchCamera job;
+			vec3 &p = job.camera.position;
+			if (current < 0)
+			{
+				cerr << file << ":" << lineNumber << ": camera before any scene" << endl;
+				return false;
+			}
+			if (!(processor >> p[0] >> p[1] >> p[2] >> job.camera.theta >> job.camera.phi
+				>> job.width >> job.height >> job.output)
+				|| job.width <= 0 || job.height <= 0)
+			{
+				cerr << file << ":" << lineNumber << ": malformed camera" << endl;
+				return false;
+			}
+			if (!readOptional(processor, &job.camera.fieldOfView))
+			{
+				cerr << file << ":" << lineNumber << ": malformed field of view" << endl;
+				return false;
+			}
+			(*scenes)[current].cameras.push_back(job);
+		}
+
+		else
+		{
+			cerr << file << ":" << lineNumber << ": unknown entry " << word << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// renders every camera of a job file, loading each scene once
+int RenderBatch(string jobFile, const HeadlessOptions &options)
+{
+	vector<BatchScene> scenes;
+	if (!ReadBatchFile(jobFile, &scenes))
+		return -1;
+
+	// one set of threads serves every frame of the batch
+	TraceSettings settings = options.trace;
+	settings.pool = CreateTilePool(settings.threads);
+
+	int failed = 0;
+	auto batchStart = chrono::steady_clock::now();
+	for (int i = 0; i < (int)scenes.size(); i++)
+	{
+		const BatchScene &job = scenes[i];
+		if (job.cameras.empty())
+			continue;
+
+		auto start = chrono::steady_clock::now();
+		TraceScene scene;
+		if (!LoadTraceScene(job.file, job.ambient, options.kernel, &scene))
+		{
+			cout << "Skipping " << job.cameras.size() << " cameras of " << job.file << endl;
+			failed += job.cameras.size();
+			continue;
+		}
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		cout << "Loaded " << job.file << " (" << scene.objects.size() << " objects) in "
+			<< elapsed.count() << "s" << endl;
+
+		for (int j = 0; j < (int)job.cameras.size(); j++)
+		{
+			const BatchCamera &cam = job.cameras[j];
+			RenderToFile(&scene, cam.camera, cam.width, cam.height, cam.output, settings, options.stats);
+		}
+	}
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - batchStart;
+	cout << "Batch finished in " << elapsed.count() << "s" << endl;
+	DestroyTilePool(settings.pool);
+
+	return failed ? -1 : 0;
+}
+
 // ==========================================================================
 // PROGRAM ENTRY POINT
 
 int main(int argc, char *argv[])
 {
+	// headless mode, no window or GPU needed:
+	//   boilerplate --cpu scene.txt image.png [-w width] [-h height]
+	//               [-t threads] [-a ambientLight] [-k auto|binary|bvh4|bvh8]
+	//               [-p packets 0|1] [-s threadStats 0|1]
+	if (argc > 1 && string(argv[1]) == "--cpu")
+	{
+		HeadlessOptions options;
+		if (argc < 4 || !ParseHeadlessOptions(argc, argv, 4, &options))
+		{
+			cout << "usage: " << argv[0] << " --cpu scene.txt image.png"
+				<< " [-w width] [-h height] [-t threads] [-a ambientLight]"
+				<< " [-k auto|binary|bvh4|bvh8] [-p 0|1] [-s 0|1]" << endl;
+			return -1;
+		}
+
+		return RenderHeadless(argv[2], argv[3], options);
+	}
+
+	// batch mode, renders every camera of a job file (see ReadBatchFile):
+	//   boilerplate --batch jobs.txt [-t threads] [-k auto|binary|bvh4|bvh8] [-p 0|1]
+	//               [-s 0|1]
+	if (argc > 1 && string(argv[1]) == "--batch")
+	{
+		HeadlessOptions options;
+		if (argc < 3 || !ParseHeadlessOptions(argc, argv, 3, &options))
+		{
+			cout << "usage: " << argv[0] << " --batch jobs.txt [-t threads]"
+				<< " [-k auto|binary|bvh4|bvh8] [-p 0|1] [-s 0|1]" << endl;
+			return -1;
+		}
+
+		return RenderBatch(argv[2], options);
+	}
+
+	// converts a text scene into a binary one:
+	//   boilerplate --convert scene.txt scene.rtsc
+	if (argc > 1 && string(argv[1]) == "--convert")
+	{
+		if (argc != 4)
+		{
+			cout << "usage: " << argv[0] << " --convert scene.txt scene.rtsc" << endl;
+			return -1;
+		}
+
+		vector<object> sceneObjects;
+		vector<Mesh> sceneMeshes;
+		vector<float> sceneLights;
+		vector<float> sceneIntensities;
+		if (!ReadScene(argv[2], &sceneObjects, &sceneMeshes, &sceneLights, &sceneIntensities))
+			return -1;
+		if (!WriteSceneFile(argv[3], sceneObjects, sceneMeshes, sceneLights, sceneIntensities))
+		{
+			cout << "Could not write " << argv[3] << endl;
+			return -1;
+		}
+		cout << "Wrote " << sceneObjects.size() << " objects, " << sceneMeshes.size() << " meshes and "
+			<< sceneLights.size()/3 << " lights to " << argv[3] << endl;
+		return 0;
+	}
+
+	// interactive mode, optionally drawing at most limit frames a second:
+	//   boilerplate [--fps limit]
+	double maxFrameRate = 0;
+	if (argc > 1 && string(argv[1]) == "--fps")
+	{
+		if (argc < 3 || atof(argv[2]) <= 0)
+		{
+			cout << "usage: " << argv[0] << " [--fps limit]" << endl;
+			return -1;
+		}
+		maxFrameRate = atof(argv[2]);
+	}
+
 	// initialize the GLFW windowing system
 	if (!glfwInit()) {
 		cout << "ERROR: GLFW failed to initialize, TERMINATING" << endl;
@@ -845,7 +1690,7 @@ int main(int argc, char *argv[])
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	window = glfwCreateWindow(1000, 1000, "CPSC 453 OpenGL Boilerplate", 0, 0);
+	window = glfwCreateWindow(1000, 1000, WINDOW_TITLE, 0, 0);
 	if (!window) {
 		cout << "Program failed to create GLFW window, TERMINATING" << endl;
 		glfwTerminate();
@@ -857,41 +1702,70 @@ int main(int argc, char *argv[])
 	glfwSetScrollCallback(window, scrollCallback);
 	glfwSetCursorPosCallback(window, cursor_position_callback);
 	glfwSetMouseButtonCallback(window, mouse_button_callback);
+	glfwSetWindowRefreshCallback(window, windowRefreshCallback);
 	glfwMakeContextCurrent(window);
 
 	// query and print out information about our OpenGL environment
 	QueryGLVersion();
 
-	// call function to load and compile shader programs
-	if (!InitializeShaders(&shader, "fragment.glsl")) {
-		cout << "Program could not initialize shaders, TERMINATING" << endl;
-		return -1;
-	}
-	
 	// call function to create and fill buffers with geometry data
 	if (!InitializeGeometry(&geometry))
 		cout << "Program failed to intialize geometry!" << endl;
 
-	parser("Scenes/scene1.txt", &objects, &lights,&lightIntensities);	
-	setObjects(objects, lights, lightIntensities);
-	// run an event-triggered main loop
-	
+	// load the first scene along with the shader variant made for it
+	if (!loadScene(sceneFiles[0], 1)) {
+		cout << "Program could not show its first scene, TERMINATING" << endl;
+		return -1;
+	}
+	// run an event-triggered main loop that only draws when the image can
+	// change, and sleeps in between
+	double nextFrame = 0;
 	while (!glfwWindowShouldClose(window))
 	{
+		int width, height;
+		glfwGetFramebufferSize(window, &width, &height);
+
+		pollSceneLoad(window);
+		reloadScene();
 
-		// call function to draw our scene
-		RenderScene(&geometry, &shader); //render scene with texture
+		double now = glfwGetTime();
+		double wait = NextRedraw(&progressive, &frame, width, height, now);
+		if (wait >= 0)
+			wait = std::max(wait, nextFrame - now);
+
+		if (wait < 0)
+		{
+			glfwWaitEvents();
+			continue;
+		}
+		if (wait > 0)
+		{
+			glfwWaitEventsTimeout(wait);
+			continue;
+		}
+
+		// call function to draw our scene, coarse while the camera moves and
+		// refined once it stops
+		RenderProgressive(&progressive, &frame, &uniforms, &geometry, &shader, width, height, now);
 
 		glfwSwapBuffers(window);
+		if (maxFrameRate > 0)
+			nextFrame = now + 1/maxFrameRate;
 
 		glfwPollEvents();
-		//	usleep(2000);
 	}
 
 
 	// clean up allocated resources before exit
+	DestroySceneWatcher(sceneWatcher);
+	DestroySceneLoader(sceneLoader);
+	DestroySceneCache(sceneCache);
+	shownScene.reset();
+	DestroyProgressive(&progressive);
+	DestroySceneBuffers(&sceneBuffers);
+	DestroyUniforms(&uniforms);
 	DestroyGeometry(&geometry);
-	DestroyShaders(&shader);
+	DestroyShaderVariants();
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
@@ -1003,6 +1877,9 @@ GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
 	if (vertexShader)   glAttachShader(programObject, vertexShader);
 	if (fragmentShader) glAttachShader(programObject, fragmentShader);
 
+	// keep the binary retrievable for the program cache
+	glProgramParameteri(programObject, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	// try linking the program with given attachments
 	glLinkProgram(programObject);
 
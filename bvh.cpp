@@ -0,0 +1,838 @@
+// ==========================================================================
+// Bounding volume hierarchy construction and traversal
+// ==========================================================================
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include "bvh.h"
+#include "intersect.h"
+#include "mesh.h"
+
+using namespace std;
+using namespace glm;
+
+// cost of one node visit relative to one object test
+#define TRAVERSAL_COST 1.0f
+// nodes up to this size become leaves when no split is cheaper
+#define MAX_LEAF_SIZE 8
+// slots per axis the binned builder evaluates splits between
+#define BIN_COUNT 16
+// ranges at least this large are binned by several threads together
+#define PARALLEL_BINNING 65536
+// subtrees at least this large are built on a thread of their own
+#define PARALLEL_SUBTREE 4096
+// a refit that grows a subtree's box by more than this factor in area
+// builds the subtree again
+#define REFIT_GROWTH 2.0f
+// refits that leave the tree costing more than this factor over its cost
+// when built from scratch build it again
+#define REFIT_COST_LIMIT 1.3f
+
+struct BuildPrimitive
+{
+	AABB bounds;
+	vec3 centroid;
+	int index;
+};
+
+AABB ObjectBounds(const object &o)
+{
+	AABB b;
+	if (o.type == SPHERE_TYPE)
+	{
+		float r = std::abs(o.y[0]);
+		b.grow(o.x - vec3(r));
+		b.grow(o.x + vec3(r));
+	}
+	else if (o.type == TRIANGLE_TYPE)
+	{
+		b.grow(o.x);
+		b.grow(o.y);
+		b.grow(o.z);
+	}
+	else
+		return b;
+
+	// pad the box so that flat boxes around axis aligned triangles are not
+	// lost to rounding in the slab test
+	vec3 m = glm::max(glm::abs(b.min), glm::abs(b.max));
+	float eps = 1e-5f*(1 + std::max(m[0], std::max(m[1], m[2])));
+	b.min -= vec3(eps);
+	b.max += vec3(eps);
+	return b;
+}
+
+// --------------------------------------------------------------------------
+// Construction
+//
+// Binned SAH: centroids are dropped into BIN_COUNT slots along each axis and
+// only the planes between slots are evaluated. Large ranges near the root are
+// binned by several threads at once; further down, whole subtrees are handed
+// to their own threads.
+
+struct Bin
+{
+	AABB bounds;
+	AABB centroids;
+	int count;
+
+	Bin() : count(0)
+	{}
+};
+
+struct BuildContext
+{
+	BVH *bvh;
+	vector<BuildPrimitive> *prims;
+	atomic<int> nodeCount;
+};
+
+// maps centroids to bins; axes without extent get a zero scale and are skipped
+struct BinMapping
+{
+	vec3 min;
+	vec3 scale;
+
+	BinMapping(const AABB &centroids)
+	{
+		min = centroids.min;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float extent = centroids.max[axis] - centroids.min[axis];
+			scale[axis] = extent > 0 ? BIN_COUNT/extent : 0;
+		}
+	}
+
+	int bin(vec3 centroid, int axis) const
+	{
+		int b = (int)((centroid[axis] - min[axis])*scale[axis]);
+		return std::max(0, std::min(b, BIN_COUNT - 1));
+	}
+};
+
+static void binRange(const vector<BuildPrimitive> &prims, int begin, int end,
+					const BinMapping &mapping, Bin bins[3][BIN_COUNT])
+{
+	for (int i = begin; i < end; i++)
+	{
+		const BuildPrimitive &p = prims[i];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			Bin &bin = bins[axis][mapping.bin(p.centroid, axis)];
+			bin.bounds.grow(p.bounds);
+			bin.centroids.grow(p.centroid);
+			bin.count++;
+		}
+	}
+}
+
+// bin prims[begin, end), splitting the range over up to threads workers
+static void binParallel(const vector<BuildPrimitive> &prims, int begin, int end,
+						const BinMapping &mapping, int threads, Bin bins[3][BIN_COUNT])
+{
+	int n = end - begin;
+	threads = std::max(1, std::min(threads, n/(PARALLEL_BINNING/4)));
+	if (threads == 1)
+	{
+		binRange(prims, begin, end, mapping, bins);
+		return;
+	}
+
+	vector<Bin> partial(threads*3*BIN_COUNT);
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		int b = begin + (long long)n*t/threads;
+		int e = begin + (long long)n*(t + 1)/threads;
+		Bin (*local)[BIN_COUNT] = (Bin (*)[BIN_COUNT])&partial[t*3*BIN_COUNT];
+		workers.push_back(thread(binRange, std::cref(prims), b, e, std::cref(mapping), local));
+	}
+	for (int t = 0; t < threads; t++)
+	{
+		workers[t].join();
+		for (int axis = 0; axis < 3; axis++)
+			for (int i = 0; i < BIN_COUNT; i++)
+			{
+				const Bin &p = partial[(t*3 + axis)*BIN_COUNT + i];
+				Bin &bin = bins[axis][i];
+				bin.bounds.grow(p.bounds);
+				bin.centroids.grow(p.centroids);
+				bin.count += p.count;
+			}
+	}
+}
+
+static void makeLeaf(BuildContext *ctx, int nodeIndex, int begin, int end)
+{
+	BVHNode &node = ctx->bvh->nodes[nodeIndex];
+	node.first = begin;
+	node.count = end - begin;
+	for (int i = begin; i < end; i++)
+		ctx->bvh->indices[i] = (*ctx->prims)[i].index;
+}
+
+struct BinPredicate
+{
+	const BinMapping *mapping;
+	int axis;
+	int split;
+	bool operator()(const BuildPrimitive &p) const
+	{
+		return mapping->bin(p.centroid, axis) < split;
+	}
+};
+
+// build the subtree of nodeIndex over prims[begin, end); bounds and centroids
+// are the boxes of the objects and of their centroids, threads is how many
+// threads this subtree may keep busy
+static void subdivide(BuildContext *ctx, int nodeIndex, int begin, int end,
+					AABB bounds, AABB centroids, int depth, int threads)
+{
+	vector<BuildPrimitive> &prims = *ctx->prims;
+	BVHNode &node = ctx->bvh->nodes[nodeIndex];
+	node.min = bounds.min;
+	node.max = bounds.max;
+	node.count = 0;
+
+	int n = end - begin;
+	if (n <= 1 || depth >= BVH_MAX_DEPTH - 1)
+	{
+		makeLeaf(ctx, nodeIndex, begin, end);
+		return;
+	}
+
+	Bin bins[3][BIN_COUNT];
+	BinMapping mapping(centroids);
+	binParallel(prims, begin, end, mapping, n >= PARALLEL_BINNING ? threads : 1, bins);
+
+	// sweep the planes between bins, accumulating from the right first
+	float area = bounds.area();
+	float bestCost = 1e30f;
+	int bestAxis = -1, bestSplit = -1;
+	AABB leftBounds, rightBounds, leftCentroids, rightCentroids;
+	for (int axis = 0; axis < 3 && area > 0; axis++)
+	{
+		if (mapping.scale[axis] == 0)
+			continue;
+
+		float rightCost[BIN_COUNT];
+		AABB right;
+		int rightCount = 0;
+		for (int i = BIN_COUNT - 1; i > 0; i--)
+		{
+			right.grow(bins[axis][i].bounds);
+			rightCount += bins[axis][i].count;
+			rightCost[i] = right.area()*rightCount;
+		}
+
+		AABB left;
+		int leftCount = 0;
+		for (int i = 1; i < BIN_COUNT; i++)
+		{
+			left.grow(bins[axis][i - 1].bounds);
+			leftCount += bins[axis][i - 1].count;
+			if (leftCount == 0 || leftCount == n)
+				continue;
+			float cost = TRAVERSAL_COST + (left.area()*leftCount + rightCost[i])/area;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+
+	int mid;
+	if (bestAxis >= 0 && (bestCost < n || n > MAX_LEAF_SIZE))
+	{
+		BinPredicate predicate = {&mapping, bestAxis, bestSplit};
+		mid = std::partition(prims.begin() + begin, prims.begin() + end, predicate) - prims.begin();
+		for (int i = 0; i < BIN_COUNT; i++)
+		{
+			const Bin &bin = bins[bestAxis][i];
+			(i < bestSplit ? leftBounds : rightBounds).grow(bin.bounds);
+			(i < bestSplit ? leftCentroids : rightCentroids).grow(bin.centroids);
+		}
+	}
+	else if (n <= MAX_LEAF_SIZE)
+	{
+		makeLeaf(ctx, nodeIndex, begin, end);
+		return;
+	}
+	else
+	{
+		// every centroid is in the same spot, split the range in half
+		mid = begin + n/2;
+		for (int i = begin; i < end; i++)
+		{
+			(i < mid ? leftBounds : rightBounds).grow(prims[i].bounds);
+			(i < mid ? leftCentroids : rightCentroids).grow(prims[i].centroid);
+		}
+	}
+
+	int left = ctx->nodeCount.fetch_add(2);
+	node.first = left;
+
+	// big subtrees run on a thread of their own while this one builds the
+	// other side; the thread budget is shared out between the two halves
+	if (threads > 1 && n >= PARALLEL_SUBTREE)
+	{
+		int leftThreads = std::max(1, (int)((long long)threads*(mid - begin)/n));
+		leftThreads = std::min(leftThreads, threads - 1);
+		thread worker(subdivide, ctx, left, begin, mid, leftBounds, leftCentroids, depth + 1, leftThreads);
+		subdivide(ctx, left + 1, mid, end, rightBounds, rightCentroids, depth + 1, threads - leftThreads);
+		worker.join();
+	}
+	else
+	{
+		subdivide(ctx, left, begin, mid, leftBounds, leftCentroids, depth + 1, 1);
+		subdivide(ctx, left + 1, mid, end, rightBounds, rightCentroids, depth + 1, 1);
+	}
+}
+
+// fills bvh->nodes and bvh->indices over prims; bounds and centroids are
+// their boxes and those of their centroids, depth that of the tree's root
+// in a larger one
+static void buildTree(BVH *bvh, vector<BuildPrimitive> &prims, const AABB &bounds,
+					const AABB &centroids, int threads, int depth = 0)
+{
+	if (threads <= 0)
+		threads = std::max(1u, thread::hardware_concurrency());
+
+	bvh->nodes.clear();
+	bvh->indices.clear();
+	if (prims.empty())
+		return;
+
+	// a binary tree with at least one object per leaf never needs more
+	bvh->nodes.resize(2*prims.size());
+	bvh->indices.resize(prims.size());
+
+	BuildContext ctx;
+	ctx.bvh = bvh;
+	ctx.prims = &prims;
+	ctx.nodeCount = 1;
+	subdivide(&ctx, 0, 0, prims.size(), bounds, centroids, depth, threads);
+	bvh->nodes.resize(ctx.nodeCount);
+}
+
+static void addPrimitive(vector<BuildPrimitive> *prims, const AABB &box, int index,
+						AABB *bounds, AABB *centroids)
+{
+	BuildPrimitive p;
+	p.bounds = box;
+	p.centroid = (box.min + box.max)*0.5f;
+	p.index = index;
+	prims->push_back(p);
+	bounds->grow(p.bounds);
+	centroids->grow(p.centroid);
+}
+
+void BuildBVH(BVH *bvh, const vector<object> &objects, const vector<Mesh> &meshes, int threads)
+{
+	auto start = chrono::steady_clock::now();
+
+	bvh->unbounded.clear();
+	vector<int> starts = MeshStarts(objects.size(), meshes);
+	vector<BuildPrimitive> prims;
+	prims.reserve(starts.back());
+	AABB bounds, centroids;
+	for (int i = 0; i < starts.back(); i++)
+	{
+		object o = ScenePrimitive(objects, meshes, starts, i);
+		if (o.type == PLANE_TYPE)
+			bvh->unbounded.push_back(i);
+		else if (o.type == SPHERE_TYPE || o.type == TRIANGLE_TYPE)
+			addPrimitive(&prims, ObjectBounds(o), i, &bounds, &centroids);
+	}
+
+	buildTree(bvh, prims, bounds, centroids, threads);
+	BuildTriangleSoA(&bvh->triangles, objects, meshes, bvh->indices);
+
+	chrono::duration<float> elapsed = chrono::steady_clock::now() - start;
+	bvh->buildTime = elapsed.count();
+	bvh->cost = bvh->builtCost = BVHCost(bvh);
+}
+
+void BuildBVH(BVH *bvh, const Mesh &mesh, int threads)
+{
+	auto start = chrono::steady_clock::now();
+
+	bvh->unbounded.clear();
+	int count = mesh.indices.size()/3;
+	vector<BuildPrimitive> prims;
+	prims.reserve(count);
+	AABB bounds, centroids;
+	for (int t = 0; t < count; t++)
+		addPrimitive(&prims, ObjectBounds(MeshTriangle(mesh, t)), t, &bounds, &centroids);
+
+	buildTree(bvh, prims, bounds, centroids, threads);
+	BuildTriangleSoA(&bvh->triangles, mesh, bvh->indices);
+
+	chrono::duration<float> elapsed = chrono::steady_clock::now() - start;
+	bvh->buildTime = elapsed.count();
+	bvh->cost = bvh->builtCost = BVHCost(bvh);
+}
+
+void BuildBVH(BVH *bvh, const vector<AABB> &boxes, int threads)
+{
+	auto start = chrono::steady_clock::now();
+
+	bvh->unbounded.clear();
+	vector<BuildPrimitive> prims;
+	prims.reserve(boxes.size());
+	AABB bounds, centroids;
+	for (int i = 0; i < (int)boxes.size(); i++)
+		addPrimitive(&prims, boxes[i], i, &bounds, &centroids);
+
+	buildTree(bvh, prims, bounds, centroids, threads);
+	bvh->triangles = TriangleSoA();
+
+	chrono::duration<float> elapsed = chrono::steady_clock::now() - start;
+	bvh->buildTime = elapsed.count();
+	bvh->cost = bvh->builtCost = BVHCost(bvh);
+}
+
+// --------------------------------------------------------------------------
+// Refitting
+//
+// The leaves holding objects that moved get their boxes recomputed, and the
+// change is carried up towards the root. A refit keeps the shape of the
+// tree, which grows poor once objects travel far, so the topmost subtrees
+// whose boxes a refit swells by more than REFIT_GROWTH in area are built
+// again over the leaf slots they held. Their new nodes take the node slots of
+// the old ones, so the rest of the tree keeps its place. Small refits still
+// add up, and a tree that ends up costing REFIT_COST_LIMIT times what it did
+// when last built from scratch is built again whole.
+
+static AABB nodeBounds(const BVHNode &node)
+{
+	AABB b;
+	b.min = node.min;
+	b.max = node.max;
+	return b;
+}
+
+// first pair of every inner node below root, parents before children
+static void subtreePairs(const BVH *bvh, int root, vector<int> *pairs)
+{
+	vector<int> stack(1, root);
+	while (!stack.empty())
+	{
+		const BVHNode &node = bvh->nodes[stack.back()];
+		stack.pop_back();
+		if (node.count > 0)
+			continue;
+		pairs->push_back(node.first);
+		stack.push_back(node.first + 1);
+		stack.push_back(node.first);
+	}
+}
+
+// copies node n of sub and everything below it into slot target of bvh,
+// taking pairs for inner nodes from free and appending more once it runs
+// out; leaves move on by offset slots
+static void spliceNode(BVH *bvh, const BVH &sub, int n, int target, int offset,
+					const vector<int> &free, size_t *used)
+{
+	BVHNode node = sub.nodes[n];
+	if (node.count > 0)
+		node.first += offset;
+	else
+	{
+		int pair = bvh->nodes.size();
+		if (*used < free.size())
+			pair = free[(*used)++];
+		else
+			bvh->nodes.resize(pair + 2);
+		spliceNode(bvh, sub, node.first, pair, offset, free, used);
+		spliceNode(bvh, sub, node.first + 1, pair + 1, offset, free, used);
+		node.first = pair;
+	}
+	bvh->nodes[target] = node;
+}
+
+// the leaves of a subtree hold a contiguous range of slots, [*lo, *hi)
+static void subtreeRange(const BVH *bvh, int root, int *lo, int *hi)
+{
+	int begin = root, end = root;
+	while (bvh->nodes[begin].count == 0)
+		begin = bvh->nodes[begin].first;
+	while (bvh->nodes[end].count == 0)
+		end = bvh->nodes[end].first + 1;
+	*lo = bvh->nodes[begin].first;
+	*hi = bvh->nodes[end].first + bvh->nodes[end].count;
+}
+
+static int subtreeSlots(const BVH *bvh, int root)
+{
+	int lo, hi;
+	subtreeRange(bvh, root, &lo, &hi);
+	return hi - lo;
+}
+
+// builds the subtree of root, at the given depth, again over the slots its
+// leaves hold; pairs it no longer needs are added to spare
+static void rebuildSubtree(BVH *bvh, const vector<object> &objects, const vector<Mesh> &meshes,
+						const vector<int> &starts, int root, int depth, int threads,
+						vector<int> *spare)
+{
+	int lo, hi;
+	subtreeRange(bvh, root, &lo, &hi);
+
+	vector<BuildPrimitive> prims;
+	prims.reserve(hi - lo);
+	AABB bounds, centroids;
+	for (int k = lo; k < hi; k++)
+	{
+		int id = bvh->indices[k];
+		addPrimitive(&prims, ObjectBounds(ScenePrimitive(objects, meshes, starts, id)), id,
+					&bounds, &centroids);
+	}
+
+	BVH sub;
+	buildTree(&sub, prims, bounds, centroids, threads, depth);
+	std::copy(sub.indices.begin(), sub.indices.end(), bvh->indices.begin() + lo);
+
+	vector<int> free;
+	subtreePairs(bvh, root, &free);
+	size_t used = 0;
+	spliceNode(bvh, sub, 0, root, lo, free, &used);
+	spare->insert(spare->end(), free.begin() + used, free.end());
+}
+
+// removes the pairs in spare from the node array, moving pairs from its end
+// into their slots
+static void dropPairs(BVH *bvh, vector<int> spare)
+{
+	vector<BVHNode> &nodes = bvh->nodes;
+	vector<int> parent(nodes.size(), -1);
+	vector<bool> unused(nodes.size(), false);
+	for (size_t s = 0; s < spare.size(); s++)
+		unused[spare[s]] = unused[spare[s] + 1] = true;
+	for (int i = 0; i < (int)nodes.size(); i++)
+		if (!unused[i] && nodes[i].count == 0)
+			parent[nodes[i].first] = i;
+
+	std::sort(spare.begin(), spare.end());
+	int end = nodes.size();
+	for (size_t s = 0; s < spare.size(); s++)
+	{
+		int hole = spare[s];
+		while (end > hole && unused[end - 2])
+			end -= 2;
+		if (end <= hole)
+			break;
+
+		int last = end - 2;
+		nodes[hole] = nodes[last];
+		nodes[hole + 1] = nodes[last + 1];
+		nodes[parent[last]].first = hole;
+		parent[hole] = parent[last];
+		for (int c = 0; c < 2; c++)
+			if (nodes[hole + c].count == 0)
+				parent[nodes[hole + c].first] = hole + c;
+		unused[hole] = false;
+		end -= 2;
+	}
+	nodes.resize(end);
+}
+
+int RefitBVH(BVH *bvh, const vector<object> &objects, const vector<Mesh> &meshes,
+			const vector<int> &moved, int threads)
+{
+	auto start = chrono::steady_clock::now();
+
+	vector<BVHNode> &nodes = bvh->nodes;
+	vector<int> starts = MeshStarts(objects.size(), meshes);
+	int nodeCount = nodes.size();
+	vector<int> parent(nodeCount, -1), leafOf(bvh->indices.size()), slotOf(starts.back(), -1);
+	for (int i = 0; i < nodeCount; i++)
+	{
+		const BVHNode &node = nodes[i];
+		if (node.count > 0)
+			std::fill(leafOf.begin() + node.first, leafOf.begin() + node.first + node.count, i);
+		else
+			parent[node.first] = parent[node.first + 1] = i;
+	}
+	for (int k = 0; k < (int)bvh->indices.size(); k++)
+		slotOf[bvh->indices[k]] = k;
+
+	// areas before the refit of the nodes it touches, -1 for the others
+	vector<float> oldArea(nodeCount, -1);
+	vector<int> leaves;
+	for (size_t m = 0; m < moved.size(); m++)
+	{
+		int id = moved[m];
+		if (id < 0 || id >= starts.back() || slotOf[id] < 0)
+			continue;
+		int leaf = leafOf[slotOf[id]];
+		if (oldArea[leaf] < 0)
+		{
+			oldArea[leaf] = nodeBounds(nodes[leaf]).area();
+			leaves.push_back(leaf);
+		}
+	}
+
+	for (size_t l = 0; l < leaves.size(); l++)
+	{
+		BVHNode &leaf = nodes[leaves[l]];
+		AABB b;
+		for (int k = leaf.first; k < leaf.first + leaf.count; k++)
+			b.grow(ObjectBounds(ScenePrimitive(objects, meshes, starts, bvh->indices[k])));
+		leaf.min = b.min;
+		leaf.max = b.max;
+
+		// ancestors stop changing where a box comes out the same
+		for (int p = parent[leaves[l]]; p >= 0; p = parent[p])
+		{
+			BVHNode &node = nodes[p];
+			AABB grown = nodeBounds(nodes[node.first]);
+			grown.grow(nodeBounds(nodes[node.first + 1]));
+			if (grown.min == node.min && grown.max == node.max)
+				break;
+			if (oldArea[p] < 0)
+				oldArea[p] = nodeBounds(node).area();
+			node.min = grown.min;
+			node.max = grown.max;
+		}
+	}
+
+	// the topmost inner nodes that swelled are built again, at the depth
+	// they are at so that traversal stacks still never overflow; once they
+	// hold most of the slots the whole tree is
+	vector<bool> swollen(nodeCount, false);
+	for (int i = 0; i < nodeCount; i++)
+		swollen[i] = oldArea[i] >= 0 && nodeBounds(nodes[i]).area() > REFIT_GROWTH*oldArea[i];
+	vector<int> roots, depths;
+	int swollenSlots = 0;
+	for (int i = 0; i < nodeCount; i++)
+	{
+		if (!swollen[i] || nodes[i].count > 0)
+			continue;
+		int depth = 0;
+		bool topmost = true;
+		for (int p = parent[i]; p >= 0 && topmost; p = parent[p], depth++)
+			topmost = !swollen[p];
+		if (!topmost)
+			continue;
+		roots.push_back(i);
+		depths.push_back(depth);
+		swollenSlots += subtreeSlots(bvh, i);
+	}
+	if (2*swollenSlots > (int)bvh->indices.size())
+		roots.assign(1, 0);
+
+	vector<int> spare;
+	for (size_t r = 0; r < roots.size(); r++)
+		rebuildSubtree(bvh, objects, meshes, starts, roots[r], roots[r] ? depths[r] : 0, threads, &spare);
+	bool whole = roots.size() == 1 && roots[0] == 0;
+
+	// refits add up over many edits, so the tree is built afresh once it
+	// costs much more than it did then
+	bvh->cost = BVHCost(bvh);
+	if (!whole && bvh->cost > REFIT_COST_LIMIT*bvh->builtCost)
+	{
+		rebuildSubtree(bvh, objects, meshes, starts, 0, 0, threads, &spare);
+		roots.push_back(0);
+		whole = true;
+	}
+	dropPairs(bvh, spare);
+
+	BuildTriangleSoA(&bvh->triangles, objects, meshes, bvh->indices);
+
+	chrono::duration<float> elapsed = chrono::steady_clock::now() - start;
+	bvh->buildTime = elapsed.count();
+	bvh->cost = BVHCost(bvh);
+	if (whole)
+		bvh->builtCost = bvh->cost;
+	return roots.size();
+}
+
+float BVHCost(const BVH *bvh)
+{
+	if (bvh->nodes.empty())
+		return 0;
+
+	float rootArea = nodeBounds(bvh->nodes[0]).area();
+	if (!(rootArea > 0))
+		return 0;
+
+	float cost = 0;
+	for (int i = 0; i < (int)bvh->nodes.size(); i++)
+	{
+		const BVHNode &node = bvh->nodes[i];
+		cost += (node.count > 0 ? node.count : TRAVERSAL_COST)*nodeBounds(node).area()/rootArea;
+	}
+	return cost;
+}
+
+// --------------------------------------------------------------------------
+// Traversal
+
+vec3 InverseDirection(vec3 ray)
+{
+	vec3 inv;
+	for (int i = 0; i < 3; i++)
+	{
+		float d = ray[i];
+		if (std::abs(d) < 1e-30f)
+			d = d < 0 ? -1e-30f : 1e-30f;
+		inv[i] = 1/d;
+	}
+	return inv;
+}
+
+float SlabTest(const BVHNode &node, vec3 origin, vec3 inv, float maxT)
+{
+	float tx1 = (node.min[0] - origin[0])*inv[0], tx2 = (node.max[0] - origin[0])*inv[0];
+	float ty1 = (node.min[1] - origin[1])*inv[1], ty2 = (node.max[1] - origin[1])*inv[1];
+	float tz1 = (node.min[2] - origin[2])*inv[2], tz2 = (node.max[2] - origin[2])*inv[2];
+
+	float tNear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.f));
+	float tFar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::max(tz1, tz2));
+
+	if (tNear <= tFar && tNear < maxT)
+		return tNear;
+	return 1e30f;
+}
+
+int IntersectUnbounded(const BVH *bvh, const vector<object> &objects, const vector<vec3> &normals,
+					vec3 ray, vec3 origin, int ignore, float *best)
+{
+	int hit = -1;
+	for (int k = 0; k < (int)bvh->unbounded.size(); k++)
+	{
+		int i = bvh->unbounded[k];
+		float d = planeIntersection(ray, origin, normals[i], objects[i].y);
+		if (d > 0 && d < *best && i != ignore)
+		{
+			*best = d;
+			hit = i;
+		}
+	}
+	return hit;
+}
+
+int IntersectLeaf(const BVH *bvh, const vector<object> &objects,
+				vec3 ray, vec3 origin, int first, int count, int ignore, float *best)
+{
+	int hit = IntersectTriangles(&bvh->triangles, &bvh->indices[0], first, count, ray, origin, ignore, best);
+	for (int k = first; k < first + count; k++)
+	{
+		if (bvh->triangles.triangle[k])
+			continue;
+		int i = bvh->indices[k];
+		float d = sphereIntersection(ray, origin, objects[i].x, objects[i].y[0]);
+		if (d > 0 && d < *best && i != ignore)
+		{
+			*best = d;
+			hit = i;
+		}
+	}
+	return hit;
+}
+
+// closest hit below root, or with anyHit the first hit found
+static int traverse(const BVH *bvh, const vector<object> &objects, vec3 ray, vec3 origin,
+					int root, int ignore, bool anyHit, float *best)
+{
+	int hit = -1;
+	vec3 inv = InverseDirection(ray);
+	int stack[BVH_MAX_DEPTH];
+	float stackNear[BVH_MAX_DEPTH];
+	int sp = 0;
+
+	int current = SlabTest(bvh->nodes[root], origin, inv, *best) < 1e30f ? root : -1;
+	while (current >= 0)
+	{
+		const BVHNode &node = bvh->nodes[current];
+		current = -1;
+
+		if (node.count > 0)
+		{
+			int leafHit = IntersectLeaf(bvh, objects, ray, origin, node.first, node.count, ignore, best);
+			if (leafHit >= 0)
+			{
+				hit = leafHit;
+				if (anyHit)
+					break;
+			}
+		}
+		else
+		{
+			// visit the nearer child first, the other one waits on the stack
+			int a = node.first, b = node.first + 1;
+			float da = SlabTest(bvh->nodes[a], origin, inv, *best);
+			float db = SlabTest(bvh->nodes[b], origin, inv, *best);
+			if (db < da)
+			{
+				std::swap(a, b);
+				std::swap(da, db);
+			}
+			if (da < 1e30f)
+			{
+				current = a;
+				if (db < 1e30f)
+				{
+					stack[sp] = b;
+					stackNear[sp++] = db;
+				}
+			}
+		}
+
+		// pop until a node that can still hold something closer
+		while (current < 0 && sp > 0)
+		{
+			sp--;
+			if (stackNear[sp] < *best)
+				current = stack[sp];
+		}
+	}
+	return hit;
+}
+
+int IntersectSubtree(const BVH *bvh, const vector<object> &objects,
+					vec3 ray, vec3 origin, int root, int ignore, float *best)
+{
+	return traverse(bvh, objects, ray, origin, root, ignore, false, best);
+}
+
+int IntersectClosest(const BVH *bvh, const vector<object> &objects, const vector<vec3> &normals,
+					vec3 ray, vec3 origin, int ignore, float maxT, float *t)
+{
+	float best = maxT;
+	int hit = IntersectUnbounded(bvh, objects, normals, ray, origin, ignore, &best);
+
+	if (!bvh->nodes.empty())
+	{
+		int treeHit = IntersectSubtree(bvh, objects, ray, origin, 0, ignore, &best);
+		if (treeHit >= 0)
+			hit = treeHit;
+	}
+
+	if (hit >= 0)
+		*t = best;
+	return hit;
+}
+
+int IntersectAny(const BVH *bvh, const vector<object> &objects, const vector<vec3> &normals,
+				vec3 ray, vec3 origin, int ignore, float maxT, float *t)
+{
+	// the tree is walked near to far, so the first hit is usually the
+	// closest one too; planes are rarely in the way and go last
+	float best = maxT;
+	int hit = -1;
+	if (!bvh->nodes.empty())
+		hit = traverse(bvh, objects, ray, origin, 0, ignore, true, &best);
+	if (hit < 0)
+		hit = IntersectUnbounded(bvh, objects, normals, ray, origin, ignore, &best);
+
+	if (hit >= 0 && t)
+		*t = best;
+	return hit;
+}
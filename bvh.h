@@ -0,0 +1,141 @@
+// ==========================================================================
+// Bounding volume hierarchy over the objects of a scene
+//
+// Spheres, triangles and the triangles of meshes are stored in a binary tree
+// built with the surface area heuristic (SAH). Planes have no finite bounds and are kept in a separate
+// list that every query tests.
+// ==========================================================================
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+#include "triangles.h"
+
+// nodes this deep become leaves, so traversal stacks sized from this never
+// overflow
+#define BVH_MAX_DEPTH 64
+
+struct AABB
+{
+	glm::vec3 min;
+	glm::vec3 max;
+
+	// an empty box, growing it by anything yields that thing's bounds
+	AABB() : min(1e30f), max(-1e30f)
+	{}
+
+	void grow(glm::vec3 p)
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	void grow(const AABB &b)
+	{
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+
+	// half the surface area, which is all the heuristic needs
+	float area() const
+	{
+		glm::vec3 e = max - min;
+		if (e[0] < 0)
+			return 0;
+		return e[0]*e[1] + e[1]*e[2] + e[2]*e[0];
+	}
+};
+
+// 32 byte node: leaves hold count > 0 objects starting at first in
+// BVH::indices, inner nodes have count == 0 and children first, first+1
+struct BVHNode
+{
+	glm::vec3 min;
+	int first;
+	glm::vec3 max;
+	int count;
+};
+
+struct BVH
+{
+	std::vector<BVHNode> nodes;
+	std::vector<int> indices;		// object or mesh triangle of every leaf slot
+	std::vector<int> unbounded;		// planes, tested by every query
+	TriangleSoA triangles;			// triangles of the leaf slots
+	float buildTime;				// seconds
+	float cost;						// SAH cost of the tree
+	float builtCost;				// cost when last built from scratch, see RefitBVH()
+
+	BVH() : buildTime(0), cost(0), builtCost(0)
+	{}
+};
+
+// bounds of an object; planes return an empty box
+AABB ObjectBounds(const object &o);
+
+// build the tree over every object and mesh triangle of the scene with a
+// binned SAH builder using the given number of threads (0 uses every
+// hardware thread); mesh triangles are numbered as in scene.h
+void BuildBVH(BVH *bvh, const std::vector<object> &objects, const std::vector<Mesh> &meshes,
+			int threads = 0);
+
+// build the tree of a single mesh; leaves hold the numbers of the mesh's
+// triangles
+void BuildBVH(BVH *bvh, const Mesh &mesh, int threads = 0);
+
+// build the tree over boxes; leaves hold box numbers and no triangles
+void BuildBVH(BVH *bvh, const std::vector<AABB> &boxes, int threads = 0);
+
+// bring the tree of BuildBVH(objects, meshes) up to date after the objects
+// in moved changed shape or place, every object keeping its type: boxes are
+// refitted, and subtrees a refit makes much worse are built again over the
+// same leaf slots, or the whole tree once edits have made it much worse.
+// Returns the number of subtrees built again.
+int RefitBVH(BVH *bvh, const std::vector<object> &objects, const std::vector<Mesh> &meshes,
+			const std::vector<int> &moved, int threads = 0);
+
+// SAH cost of a built tree, relative to one object test
+float BVHCost(const BVH *bvh);
+
+// reciprocal of a ray direction, with zero components nudged off zero
+glm::vec3 InverseDirection(glm::vec3 ray);
+
+// ray parameter where the ray enters the node, or 1e30 if it misses the node
+// or only reaches it beyond maxT
+float SlabTest(const BVHNode &node, glm::vec3 origin, glm::vec3 inv, float maxT);
+
+// closest plane hit at a ray parameter in (0, *best), skipping object ignore;
+// returns the object index and lowers best to its parameter, or returns -1
+int IntersectUnbounded(const BVH *bvh, const std::vector<object> &objects,
+					const std::vector<glm::vec3> &normals,
+					glm::vec3 ray, glm::vec3 origin, int ignore, float *best);
+
+// closest object of leaf slots [first, first + count) hit at a ray parameter
+// in (0, *best), skipping object ignore; returns the object index and lowers
+// best, or returns -1
+int IntersectLeaf(const BVH *bvh, const std::vector<object> &objects,
+				glm::vec3 ray, glm::vec3 origin, int first, int count, int ignore, float *best);
+
+// closest object in the subtree of node root hit at a ray parameter in
+// (0, *best); returns the object index and lowers best, or returns -1
+int IntersectSubtree(const BVH *bvh, const std::vector<object> &objects,
+					glm::vec3 ray, glm::vec3 origin, int root, int ignore, float *best);
+
+// closest object hit at a ray parameter in (0, maxT), skipping object ignore;
+// returns the object index and stores the parameter in t, or returns -1.
+// normals holds the unit normal of every plane.
+int IntersectClosest(const BVH *bvh, const std::vector<object> &objects,
+					const std::vector<glm::vec3> &normals,
+					glm::vec3 ray, glm::vec3 origin, int ignore, float maxT, float *t);
+
+// occlusion query: some object hit at a ray parameter in (0, maxT), skipping
+// object ignore. The search stops at the first hit found, which need not be
+// the closest; returns its index and stores its parameter in t unless t is
+// null, or returns -1 if nothing lies before maxT.
+int IntersectAny(const BVH *bvh, const std::vector<object> &objects,
+				const std::vector<glm::vec3> &normals,
+				glm::vec3 ray, glm::vec3 origin, int ignore, float maxT, float *t);
+
+#endif
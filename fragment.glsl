@@ -5,8 +5,16 @@
 // Date:    December 2015
 // ==========================================================================
 #version 410
-#extension GL_NV_shader_buffer_load : enable
-#define MAX_OBJECT_NUM 50
+#define STACK_SIZE 64
+
+// scene constants; InitializeShaders() defines them right after #version to
+// build a variant specialised for one scene (see SceneVariant() in
+// boilerplate.cpp): PLANE_COUNT, LIGHT_COUNT, MAX_BOUNCES and NO_SPHERES,
+// NO_TRIANGLES, NO_INSTANCES, NO_REFLECTION, NO_REFRACTION for features the
+// scene lacks
+#ifndef MAX_BOUNCES
+#define MAX_BOUNCES 10
+#endif
 
 const float PI = 3.14159265359;	
 
@@ -19,35 +27,45 @@ in vec2 textureCoords;
 // first output is mapped to the framebuffer's colour index by default
 out vec4 FragmentColour;
 
-uniform int objectTypes[MAX_OBJECT_NUM] = NULL;
-uniform vec3 xs[MAX_OBJECT_NUM] = NULL;
-uniform vec3 ys[MAX_OBJECT_NUM] = NULL;
-uniform vec3 zs[MAX_OBJECT_NUM] = NULL;
-uniform vec4 colors[MAX_OBJECT_NUM] = NULL;
-uniform vec4 specularities[MAX_OBJECT_NUM] = NULL;
-uniform int shininesses[MAX_OBJECT_NUM] = NULL;
-uniform float reflectances[MAX_OBJECT_NUM] = NULL;
-uniform float refractions[MAX_OBJECT_NUM]=NULL;
-uniform int numOfObjects = 0;
-
-uniform vec3 lights[MAX_OBJECT_NUM] = NULL;
-uniform float lightIntensities[MAX_OBJECT_NUM] = NULL;
+// scene records laid out by PackGPUScene() in gpuscene.cpp: planes first,
+// then the objects of every BVH leaf, spheres ahead of triangles
+uniform isamplerBuffer records;		// (shape, type, -1, material) or (corners, material)
+uniform samplerBuffer geometry;		// (x, 0) (y, 0) of planes and spheres
+uniform samplerBuffer vertices;		// triangle corners, shared within a mesh
+uniform samplerBuffer materials;	// color, specularity, (shininess, reflectance, refraction, 0)
+uniform isamplerBuffer nodes;		// (min bits, first) (max bits, spheres | triangles << 16)
+uniform samplerBuffer lightData;	// (position, intensity)
+uniform isamplerBuffer instances;	// (root, records, first, 0), inverse rows, transform rows
+uniform int numOfObjects = 0;		// records of the scene's own objects
+uniform int nodeCount = 0;			// nodes of the scene's own tree
+uniform int instanceCount = 0;
+uniform int instanceRoot = -1;		// top-level node of the instances
+#ifdef PLANE_COUNT
+const int planeCount = PLANE_COUNT;
+#else
+uniform int planeCount = 0;
+#endif
+#ifdef LIGHT_COUNT
+const int lightNum = LIGHT_COUNT;
+#else
 uniform int lightNum = 1;
+#endif
 
-uniform float fieldOfView = PI/(3.f); 
-uniform vec3 cameraPos = vec3(0,0,0.14);
+// camera, uploaded by UploadFrameState() in boilerplate.cpp whenever it
+// changes rather than rebuilt from angles for every fragment
+layout(std140) uniform Camera
+{
+	mat3 cameraBasis;	// rotation by phi about x after theta about y
+	vec3 cameraPos;
+	float focalLength;	// -1/tan(fieldOfView/2)
+};
 
 uniform float ambientLight = 1;
 
-uniform float theta=0;
-uniform float phi=0;
-mat3 ry = mat3	(cos(theta), 0, sin(theta),
-				 0,1,0,
-				 -sin(theta), 0, cos(theta));
-
-mat3 rx = mat3 (1, 0, 0,
-				0, cos(phi), -sin(phi),
-				0, sin(phi), cos(phi));
+// length of the reflection and refraction loops, at most MAX_BOUNCES
+uniform int maxBounces = MAX_BOUNCES;
+// offset of the ray inside the pixel, in textureCoords units
+uniform vec2 jitter = vec2(0);
 
 struct object
 {
@@ -58,6 +76,72 @@ struct object
 	int shininess;
 };
 
+// instance triangles are numbered on from the records, instance by instance
+// in the order of the instance records (see gpuscene.h)
+const int INSTANCE_TEXELS = 7;
+ivec4 instanceHeader(int k)		{ return texelFetch(instances, INSTANCE_TEXELS*k); }
+
+// row 1 of instance k's texels maps the scene into the mesh, row 4 back
+vec3 instanceApply(int k, int row, vec4 p)
+{
+	int base = INSTANCE_TEXELS*k + row;
+	return vec3(dot(intBitsToFloat(texelFetch(instances, base)), p),
+				dot(intBitsToFloat(texelFetch(instances, base + 1)), p),
+				dot(intBitsToFloat(texelFetch(instances, base + 2)), p));
+}
+
+// instance holding triangle i, by bisection on the first triangles
+int instanceOf(int i)
+{
+	int lo = 0, hi = instanceCount - 1;
+	while(lo < hi)
+	{
+		int mid = (lo + hi + 1)/2;
+		if(instanceHeader(mid)[2] <= i)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+// planes and spheres have no third corner, triangles have a type of 2
+ivec4 objectRecord(int i)
+{
+#ifndef NO_INSTANCES
+	if(i >= numOfObjects)
+	{
+		ivec4 header = instanceHeader(instanceOf(i));
+		return texelFetch(records, header[1] + i - header[2]);
+	}
+#endif
+	return texelFetch(records, i);
+}
+vec3 vertex(int v)				{ return texelFetch(vertices, v).xyz; }
+
+// corner v of triangle i, in the scene
+vec3 objectVertex(int i, int v)
+{
+#ifndef NO_INSTANCES
+	if(i >= numOfObjects)
+		return instanceApply(instanceOf(i), 4, vec4(vertex(v), 1));
+#endif
+	return vertex(v);
+}
+
+int objectType(int i)			{ ivec4 r = objectRecord(i); return r.z < 0 ? r.y : 2; }
+vec3 objectX(int i)				{ ivec4 r = objectRecord(i); return r.z < 0 ? texelFetch(geometry, 2*r.x).xyz : objectVertex(i, r.x); }
+vec3 objectY(int i)				{ ivec4 r = objectRecord(i); return r.z < 0 ? texelFetch(geometry, 2*r.x + 1).xyz : objectVertex(i, r.y); }
+vec3 objectZ(int i)				{ return objectVertex(i, objectRecord(i).z); }
+int objectMaterial(int i)		{ return 3*objectRecord(i)[3]; }
+vec4 objectColor(int i)			{ return texelFetch(materials, objectMaterial(i)); }
+vec4 objectSpecularity(int i)	{ return texelFetch(materials, objectMaterial(i) + 1); }
+int objectShininess(int i)		{ return int(texelFetch(materials, objectMaterial(i) + 2)[0]); }
+float objectReflectance(int i)	{ return texelFetch(materials, objectMaterial(i) + 2)[1]; }
+float objectRefraction(int i)	{ return texelFetch(materials, objectMaterial(i) + 2)[2]; }
+vec3 lightPosition(int i)		{ return texelFetch(lightData, i).xyz; }
+float lightIntensity(int i)		{ return texelFetch(lightData, i)[3]; }
+
 float getMagnitude(vec3 v)
 {
 	return sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
@@ -66,15 +150,7 @@ float getMagnitude(vec3 v)
 
 vec3 calculateRay(vec2 coords)
 {
-	float z = -1/tan(fieldOfView/2);
-		
-	vec3 ray = vec3(coords, z);//- cameraPos;
-	
-	ray=ry*ray;
-	ray=rx*ray;
-	
-	//ray[2] = -ray[2];
-	
+	vec3 ray = cameraBasis*vec3(coords, focalLength);
 	return ray/sqrt(dot(ray,ray));
 }
 
@@ -91,7 +167,7 @@ float sphereIntersection(vec3 ray, vec3 origin, vec3 center, float radius)
 	float t, t1, t2;
 	if(discriminant < 0)
 	{
-		return -1;
+		return -1.0;
 	}
 	
 	else
@@ -114,7 +190,7 @@ float planeIntersection(vec3 ray, vec3 origin, vec3 n, vec3 q)
 	if(dot(ray,n)!=0)
 		return (dot(q,n)-dot(n,origin))/dot(ray,n);
 
-	return -1;
+	return -1.0;
 }
 
 float triangleIntersection(vec3 ray, vec3 origin, vec3 p0, vec3 p1, vec3 p2)
@@ -137,7 +213,7 @@ float triangleIntersection(vec3 ray, vec3 origin, vec3 p0, vec3 p1, vec3 p2)
 		return t;
 	}
 
-	return -1;
+	return -1.0;
 
 }
 
@@ -148,86 +224,293 @@ struct lightRay
 	int object;
 };
 
-lightRay getColour(vec3 ray, vec3 position, int ob)
+// --------------------------------------------------------------------------
+// BVH traversal, as in bvh.cpp
+
+vec3 inverseDirection(vec3 ray)
 {
-	lightRay info;
-	info.color = vec4(0);
-	info.distance = -1;
-	info.object=-1;
+	vec3 inv;
+	for(int i = 0; i<3; i++)
+	{
+		float d = ray[i];
+		if(abs(d) < 1e-30)
+			d = d < 0 ? -1e-30 : 1e-30;
+		inv[i] = 1/d;
+	}
+	return inv;
+}
 
-	float mt = -1;
-	for(int i = 0; i<numOfObjects; i++)
+// ray parameter where the ray enters node, or 1e30 if it misses the node or
+// only reaches it beyond maxT
+float nodeEntry(int node, vec3 origin, vec3 inv, float maxT)
+{
+	vec3 lo = intBitsToFloat(texelFetch(nodes, 2*node).xyz);
+	vec3 hi = intBitsToFloat(texelFetch(nodes, 2*node + 1).xyz);
+	vec3 t1 = (lo - origin)*inv;
+	vec3 t2 = (hi - origin)*inv;
+	vec3 tmin = min(t1, t2);
+	vec3 tmax = max(t1, t2);
+
+	float tNear = max(max(tmin[0], tmin[1]), max(tmin[2], 0));
+	float tFar = min(min(tmax[0], tmax[1]), tmax[2]);
+
+	if(tNear <= tFar && tNear < maxT)
+		return tNear;
+	return 1e30;
+}
+
+// closest object of the tree below root before best, or with anyHit the
+// first one found; the records of the tree's leaves are objects numbered
+// offset higher. best is lowered to the distance of the object returned.
+int traverseTree(int root, int offset, vec3 ray, vec3 origin, int ob, bool anyHit, inout float best)
+{
+	int hit = -1;
+	vec3 inv = inverseDirection(ray);
+	int stack[STACK_SIZE];
+	float stackNear[STACK_SIZE];
+	int sp = 0;
+
+	int current = nodeEntry(root, origin, inv, best) < 1e30 ? root : -1;
+	while(current >= 0)
 	{
-		float t = 0;
-		if(objectTypes[i]==0)
-		{
-			t = sphereIntersection(ray, position, xs[i], ys[i][0]);
-		}
-		
-		else if(objectTypes[i]==1)
+		ivec4 bounds = texelFetch(nodes, 2*current + 1);
+		int first = texelFetch(nodes, 2*current)[3];
+		int spheres = bounds[3] & 0xffff;
+		int triangles = bounds[3] >> 16;
+		current = -1;
+
+		if(spheres + triangles > 0)
 		{
-			t = planeIntersection(ray, position, xs[i], ys[i]);
+			bool found = false;
+#ifndef NO_SPHERES
+			for(int i = first; i<first + spheres; i++)
+			{
+				int shape = 2*texelFetch(records, i)[0];
+				float t = sphereIntersection(ray, origin, texelFetch(geometry, shape).xyz,
+											 texelFetch(geometry, shape + 1)[0]);
+				if(t>0 && t<best && i + offset!=ob)
+				{
+					best = t;
+					hit = i + offset;
+					found = true;
+				}
+			}
+#endif
+#ifndef NO_TRIANGLES
+			for(int i = first + spheres; i<first + spheres + triangles; i++)
+			{
+				ivec4 r = texelFetch(records, i);
+				float t = triangleIntersection(ray, origin, vertex(r[0]), vertex(r[1]), vertex(r[2]));
+				if(t>0 && t<best && i + offset!=ob)
+				{
+					best = t;
+					hit = i + offset;
+					found = true;
+				}
+			}
+#endif
+			if(found && anyHit)
+				break;
 		}
-		
-		else if(objectTypes[i]==2)
+		else
 		{
-			t = triangleIntersection(ray, position, xs[i], ys[i], zs[i]);
+			// visit the nearer child first, the other one waits on the stack
+			int a = first, b = first + 1;
+			float da = nodeEntry(a, origin, inv, best);
+			float db = nodeEntry(b, origin, inv, best);
+			if(db < da)
+			{
+				a = first + 1;
+				b = first;
+				float d = da;
+				da = db;
+				db = d;
+			}
+			if(da < 1e30)
+			{
+				current = a;
+				if(db < 1e30 && sp < STACK_SIZE)
+				{
+					stack[sp] = b;
+					stackNear[sp++] = db;
+				}
+			}
 		}
-		
-		if (t>0 && (mt > t || mt == -1) && !(ob==i))
+
+		// pop until a node that can still hold something closer
+		while(current < 0 && sp > 0)
 		{
-			mt = t;
-			info.color = colors[i];
-			info.object=i;
+			sp--;
+			if(stackNear[sp] < best)
+				current = stack[sp];
 		}
 	}
-	info.distance = mt;
-	return info;
+	return hit;
 }
 
-vec2 calculateShadow(vec3 position, int j, int objectSeen)
+#ifndef NO_INSTANCES
+// closest instance triangle before best, or with anyHit the first one found,
+// walking the top-level tree as in instances.cpp; rays reach the meshes'
+// trees in mesh space, unnormalised so that distances carry over
+int traverseInstances(vec3 ray, vec3 origin, int ob, bool anyHit, inout float best)
 {
-	float shadow = 1;
-	vec3 darkRay = lights[j]-position;
+	int hit = -1;
+	if(instanceRoot < 0)
+		return hit;
 
-	float maxT = getMagnitude(darkRay);
+	vec3 inv = inverseDirection(ray);
+	int stack[STACK_SIZE];
+	float stackNear[STACK_SIZE];
+	int sp = 0;
 
-	darkRay = darkRay/sqrt(dot(darkRay,darkRay));
-	
-	position += darkRay*0.001;
-	
-	float mt = -1;
-	int objectHit = -1;
-	for(int i = 0; i<numOfObjects; i++)
+	int current = nodeEntry(instanceRoot, origin, inv, best) < 1e30 ? instanceRoot : -1;
+	while(current >= 0)
 	{
-		float t = 0;
-		if(objectTypes[i]==0)
+		int first = texelFetch(nodes, 2*current)[3];
+		int count = texelFetch(nodes, 2*current + 1)[3];
+		current = -1;
+
+		if(count > 0)
 		{
-			t = sphereIntersection(darkRay, position, xs[i], ys[i][0]);
+			bool found = false;
+			for(int k = first; k<first + count && !(found && anyHit); k++)
+			{
+				ivec4 header = instanceHeader(k);
+				vec3 meshRay = instanceApply(k, 1, vec4(ray, 0));
+				vec3 meshOrigin = instanceApply(k, 1, vec4(origin, 1));
+				int instanceHit = traverseTree(header[0], header[2] - header[1], meshRay, meshOrigin,
+											   ob, anyHit, best);
+				if(instanceHit >= 0)
+				{
+					hit = instanceHit;
+					found = true;
+				}
+			}
+			if(found && anyHit)
+				break;
 		}
-		
-		else if(objectTypes[i]==1)
+		else
 		{
-			t = planeIntersection(darkRay, position, xs[i], ys[i]);
+			int a = first, b = first + 1;
+			float da = nodeEntry(a, origin, inv, best);
+			float db = nodeEntry(b, origin, inv, best);
+			if(db < da)
+			{
+				a = first + 1;
+				b = first;
+				float d = da;
+				da = db;
+				db = d;
+			}
+			if(da < 1e30)
+			{
+				current = a;
+				if(db < 1e30 && sp < STACK_SIZE)
+				{
+					stack[sp] = b;
+					stackNear[sp++] = db;
+				}
+			}
 		}
-		
-		else if(objectTypes[i]==2)
+
+		while(current < 0 && sp > 0)
 		{
-			t = triangleIntersection(darkRay, position, xs[i], ys[i], zs[i]);
+			sp--;
+			if(stackNear[sp] < best)
+				current = stack[sp];
 		}
-		
-		if (t>0 && (mt > t || mt == -1))
+	}
+	return hit;
+}
+#endif
+
+// closest object of the scene's tree and its instances before best, or
+// with anyHit the first one found
+int traverse(vec3 ray, vec3 origin, int ob, bool anyHit, inout float best)
+{
+	int hit = nodeCount > 0 ? traverseTree(0, 0, ray, origin, ob, anyHit, best) : -1;
+#ifndef NO_INSTANCES
+	if(hit < 0 || !anyHit)
+	{
+		int instanceHit = traverseInstances(ray, origin, ob, anyHit, best);
+		if(instanceHit >= 0)
+			hit = instanceHit;
+	}
+#endif
+	return hit;
+}
+
+// closest plane before best, lowering best to its distance
+int nearestPlane(vec3 ray, vec3 position, int ob, inout float best)
+{
+	int hit = -1;
+	for(int i = 0; i<planeCount; i++)
+	{
+		float t = planeIntersection(ray, position, objectX(i), objectY(i));
+		if(t>0 && t<best && i!=ob)
 		{
-			mt = t;
-			objectHit = i;
+			best = t;
+			hit = i;
 		}
 	}
+	return hit;
+}
+
+lightRay getColour(vec3 ray, vec3 position, int ob)
+{
+	lightRay info;
+	info.color = vec4(0);
+	info.distance = -1;
+	info.object=-1;
+
+	float best = 1e30;
+	int hit = nearestPlane(ray, position, ob, best);
+	int treeHit = traverse(ray, position, ob, false, best);
+	if(treeHit >= 0)
+		hit = treeHit;
+
+	if(hit >= 0)
+	{
+		info.color = objectColor(hit);
+		info.distance = best;
+		info.object = hit;
+	}
+	return info;
+}
+
+// closest object in front of position and before maxT
+int closestOccluder(vec3 ray, vec3 position, float maxT, out float mt)
+{
+	float best = maxT;
+	int hit = nearestPlane(ray, position, -1, best);
+	int treeHit = traverse(ray, position, -1, false, best);
+	if(treeHit >= 0)
+		hit = treeHit;
+
+	mt = hit >= 0 ? best : -1;
+	return hit;
+}
+
+vec2 calculateShadow(vec3 position, int j, int objectSeen)
+{
+	float shadow = 1;
+	vec3 darkRay = lightPosition(j)-position;
+
+	float maxT = getMagnitude(darkRay);
+
+	darkRay = darkRay/sqrt(dot(darkRay,darkRay));
+	
+	position += darkRay*0.001;
+	
+	// the soft shadow takes the distance and alpha of the closest occluder
+	float mt;
+	int objectHit = closestOccluder(darkRay, position, maxT, mt);
 
-	if (mt>0 && (mt < maxT))
+	if (objectHit >= 0)
 	{
-		if(objectTypes[objectSeen]==0)
+		if(objectType(objectSeen)==0)
 		{
-			float diameter = 2*ys[objectSeen][0];
+			float diameter = 2*objectY(objectSeen)[0];
 
 			vec3 v = darkRay*mt;
 			float length = getMagnitude(v); 
@@ -239,7 +522,7 @@ vec2 calculateShadow(vec3 position, int j, int objectSeen)
 			
 		else
 		{
-			shadow*=(atan(mt*2+colors[objectHit][3])/(PI/2)*0.3+0.7);
+			shadow*=(atan(mt*2+objectColor(objectHit)[3])/(PI/2)*0.3+0.7);
 
 		}
 	}
@@ -255,13 +538,13 @@ vec2 calculateShadows(vec3 ray,vec3 pos, float t, int objectSeen)
 	bool sawLight = false;
 	float nearestLight = -1;
 	float darkFactor = 1;
-	if(objectTypes[objectSeen]==0)
+	if(objectType(objectSeen)==0)
 		darkFactor = 0;
 
 	for (int i = 0; i < lightNum; ++i)
 	{
 		info = calculateShadow(position, i, objectSeen);
-		if(objectTypes[objectSeen]==0)
+		if(objectType(objectSeen)==0)
 			 darkFactor = max(darkFactor, info[0]);
 		else
 			darkFactor=darkFactor*info[0];
@@ -288,22 +571,22 @@ reflection findReflectedRay(vec3 ray, vec3 position, float t, int objectSeen)
 
 	vec3 contactPoint = ray*t + position;
 	vec3 n =vec3(3);
-	if(objectTypes[objectSeen]==0)
+	if(objectType(objectSeen)==0)
 	{
-		n = xs[objectSeen];
+		n = objectX(objectSeen);
 		n= contactPoint-n;
 		n = n/getMagnitude(n);
 	}
-	else if(objectTypes[objectSeen]==1)
+	else if(objectType(objectSeen)==1)
 	{
-		n = xs[objectSeen];
+		n = objectX(objectSeen);
 		n=n/getMagnitude(n);
 	}
-	else if(objectTypes[objectSeen]==2)
+	else if(objectType(objectSeen)==2)
 	{
-		vec3 p0 = xs[objectSeen];
-		vec3 p1 = ys[objectSeen];
-		vec3 p2 = zs[objectSeen];
+		vec3 p0 = objectX(objectSeen);
+		vec3 p1 = objectY(objectSeen);
+		vec3 p2 = objectZ(objectSeen);
 
 		vec3 v1 = p1-p0;
 		vec3 v2 = p2-p0;
@@ -325,7 +608,7 @@ reflection findReflectedRay(vec3 ray, vec3 position, float t, int objectSeen)
 vec4 getBrightness(vec3 ray, vec3 position, float t, int objectSeen)
 {
 	vec3 pos = position+ray*t;
-	vec3 brightRay = lights[0]-pos;
+	vec3 brightRay = lightPosition(0)-pos;
 	vec3 sight = cameraPos-pos;
 	sight = sight/getMagnitude(sight); 
 
@@ -333,7 +616,7 @@ vec4 getBrightness(vec3 ray, vec3 position, float t, int objectSeen)
 	vec4 temp = vec4(0);
 	for(int i=0; i<lightNum; i++)
 	{
-		brightRay = lights[i]-pos;
+		brightRay = lightPosition(i)-pos;
 		sight = cameraPos-pos;
 		sight = sight/getMagnitude(sight); 
 
@@ -348,8 +631,8 @@ vec4 getBrightness(vec3 ray, vec3 position, float t, int objectSeen)
 		
 		vec3 r = -brightRay + 2*dot(brightRay,ref.n)*ref.n;
 
-		c = colors[objectSeen]*(ambientLight + lightIntensities[i]*max(0,dot(brightRay,ref.n)))+ 
-			lightIntensities[i]*specularities[objectSeen]*pow(max(0,dot(ref.n,h)),shininesses[objectSeen]);//max(0,(pow(dot(ref.n,h),shininesses[objectSeen])));
+		c = objectColor(objectSeen)*(ambientLight + lightIntensity(i)*max(0,dot(brightRay,ref.n)))+ 
+			lightIntensity(i)*objectSpecularity(objectSeen)*pow(max(0,dot(ref.n,h)),objectShininess(objectSeen));//max(0,(pow(dot(ref.n,h),objectShininess(objectSeen))));
 
 		temp += c/lightNum;
 	}
@@ -359,7 +642,7 @@ vec4 getBrightness(vec3 ray, vec3 position, float t, int objectSeen)
 
 reflection calculateRefractedRay(vec3 ray, vec3 position, float n, int objectSeen)
 {
-	float nt = refractions[objectSeen];
+	float nt = objectRefraction(objectSeen);
 	ray = normalize(ray);
 	reflection ref = findReflectedRay(ray, position, 0, objectSeen);
 	if(dot(ref.n,-ray)<0)
@@ -373,9 +656,13 @@ reflection calculateRefractedRay(vec3 ray, vec3 position, float n, int objectSee
 	return r;
 }
 
+// the chains below loop a constant MAX_BOUNCES times at most, stopping
+// early at maxBounces, so the driver can unroll them; a variant with
+// MAX_BOUNCES 0 has neither reflection nor refraction and drops them
+#if MAX_BOUNCES > 0
 vec4 getRefractedColour(vec3 ray, vec3 position, float t, int objectSeen, vec4 colour)
 {	
-	int i=10, j=0;
+	int j=0;
 	vec4 finalc = vec4(1);
 	int obj = objectSeen;
 	vec3 oray = ray;
@@ -384,11 +671,12 @@ vec4 getRefractedColour(vec3 ray, vec3 position, float t, int objectSeen, vec4 c
 	bool once = true;
 	vec4 r;
 	
-	vec4 newc[10];
+	vec4 newc[MAX_BOUNCES];
 	
-	while(i>0)
+	for(int i=0; i<MAX_BOUNCES; i++)
 	{
-		i--;
+		if(i>=maxBounces)
+			break;
 		vec4 c;
 	
 		//position+=vec3(0.001);
@@ -410,17 +698,17 @@ vec4 getRefractedColour(vec3 ray, vec3 position, float t, int objectSeen, vec4 c
 			c = (getBrightness(refRay.ray, position, lumos.distance, lumos.object));
 			c=c*(darkness[0]*1.f/pow(darkness[1],0.7));
 
-		    c[3]=colors[lumos.object][3];
+		    c[3]=objectColor(lumos.object)[3];
 			newc[j]=c;//mix(r,c,dot(-ray, refRay.n));
 			j++;
-			if(colors[lumos.object][3]>0)
+			if(objectColor(lumos.object)[3]>0)
 			{				
 				position=position+ray*t;
 				ray = refRay.ray;
 				t=lumos.distance;
 				obj = lumos.object;	
 				if(refIndex==1)
-					refIndex=colors[lumos.object][3];
+					refIndex=objectColor(lumos.object)[3];
 				else
 					refIndex=1;
 			}
@@ -440,20 +728,21 @@ vec4 getRefractedColour(vec3 ray, vec3 position, float t, int objectSeen, vec4 c
 	//return finalc;
 	finalc = mix(colour, finalc, min( max(0,dot(n,-ray))+0.2, 1));
 	//return finalc;
-	return mix(colors[objectSeen], finalc, colors[objectSeen][3]);
+	return mix(objectColor(objectSeen), finalc, objectColor(objectSeen)[3]);
 }
 
 vec4 getRelectedColour(vec3 ray, vec3 position, float t, int objectSeen)
 {
-	int i=10, j=0;
+	int j=0;
 	vec4 finalc = vec4(0);
 	int obj = objectSeen;
 	
-	vec4 newc[10];
+	vec4 newc[MAX_BOUNCES];
 	
-	while(i>0)
+	for(int i=0; i<MAX_BOUNCES; i++)
 	{
-		i--;
+		if(i>=maxBounces)
+			break;
 		vec4 c;
 
 		//position+=vec3(0.001);
@@ -468,18 +757,20 @@ vec4 getRelectedColour(vec3 ray, vec3 position, float t, int objectSeen)
 			c = (getBrightness(ref.ray, position, lumos.distance, lumos.object));
 		 	c=c*(darkness[0]*1.f/pow(darkness[1],0.7));
 			
-			if(colors[lumos.object][3]>0)
+#ifndef NO_REFRACTION
+			if(objectColor(lumos.object)[3]>0)
 			{
 				c = getRefractedColour(ref.ray, position+ray*t, lumos.distance, lumos.object, c);
 			
 			}
+#endif
 					
-			c[3]=reflectances[lumos.object];
+			c[3]=objectReflectance(lumos.object);
 			newc[j]=c;
 			j++;
 			
 			
-			if(reflectances[lumos.object]>0)
+			if(objectReflectance(lumos.object)>0)
 			{				
 				position=position+ray*t;
 				ray = ref.ray;
@@ -502,11 +793,12 @@ vec4 getRelectedColour(vec3 ray, vec3 position, float t, int objectSeen)
 	//return finalc;
 	return finalc;
 } 
+#endif
 
 void main(void)
 {  
 	vec4 colour = vec4(0);
-	vec3 ray = calculateRay(textureCoords);
+	vec3 ray = calculateRay(textureCoords + jitter);
 
 	ray = ray/getMagnitude(ray);
 	vec3 rcamPos = cameraPos;
@@ -523,17 +815,27 @@ void main(void)
 		//if(darkness[0]==1)
 		colour = (getBrightness(ray, rcamPos, t, photon.object));
 		colour=colour*(darkness[0]*1.f/pow(darkness[1],0.7));
+		// refraction blends with the reflected colour even where nothing
+		// reflects
+#if !defined(NO_REFLECTION) || !defined(NO_REFRACTION)
 		vec4 r = (getRelectedColour(ray,rcamPos, t, photon.object));
-		colour = mix(colour, r, reflectances[photon.object]);
+#endif
+#ifndef NO_REFLECTION
+		colour = mix(colour, r, objectReflectance(photon.object));
+#endif
 		
-		if(colors[photon.object][3]>0)
+#ifndef NO_REFRACTION
+		if(objectColor(photon.object)[3]>0)
 		{
 			colour = getRefractedColour(ray, rcamPos, t, photon.object, r);
 			
 		}
+#endif
 		
 		
 			//1.f/pow(darkness[1],0.7)
 	}
-	FragmentColour = colour;
+	// clamped here rather than by the framebuffer so that accumulated
+	// samples average what is displayed
+	FragmentColour = clamp(colour, 0, 1);
 }
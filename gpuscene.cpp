@@ -0,0 +1,262 @@
+// ==========================================================================
+// Scene records for the shader
+// ==========================================================================
+
+#include <cassert>
+#include <cstring>
+#include "gpuscene.h"
+#include "mesh.h"
+
+using namespace std;
+using namespace glm;
+
+static int floatBits(float f)
+{
+	int i;
+	memcpy(&i, &f, sizeof(i));
+	return i;
+}
+
+static void pushTexel(vector<float> *buffer, vec3 v, float w)
+{
+	buffer->push_back(v[0]);
+	buffer->push_back(v[1]);
+	buffer->push_back(v[2]);
+	buffer->push_back(w);
+}
+
+static void pushTexel(vector<float> *buffer, vec4 v)
+{
+	pushTexel(buffer, vec3(v), v[3]);
+}
+
+static void pushMaterial(GPUScene *gpu, vec4 color, vec4 specularity, int shininess,
+						float reflectance, float refraction)
+{
+	pushTexel(&gpu->materials, color);
+	pushTexel(&gpu->materials, specularity);
+	pushTexel(&gpu->materials, vec3(shininess, reflectance, refraction), 0);
+}
+
+static int materialCount(const GPUScene *gpu)
+{
+	return gpu->materials.size()/(4*GPU_MATERIAL_TEXELS);
+}
+
+static void pushVertex(GPUScene *gpu, vec3 v)
+{
+	for (int a = 0; a < 3; a++)
+		gpu->vertices.push_back(v[a]);
+}
+
+// the last texel of a leaf node; leaves hold at most MAX_LEAF_SIZE
+// primitives unless the depth limit of the builder cut a subtree short
+static int leafCounts(int spheres, int triangles)
+{
+	assert(spheres <= GPU_LEAF_SPHERES && triangles <= GPU_LEAF_TRIANGLES);
+	return spheres | triangles << 16;
+}
+
+static void pushNode(GPUScene *gpu, const BVHNode &node, int first, int counts)
+{
+	int texels[4*GPU_NODE_TEXELS];
+	for (int a = 0; a < 3; a++)
+	{
+		texels[a] = floatBits(node.min[a]);
+		texels[4 + a] = floatBits(node.max[a]);
+	}
+	texels[3] = first;
+	texels[7] = counts;
+	gpu->nodes.insert(gpu->nodes.end(), texels, texels + 4*GPU_NODE_TEXELS);
+}
+
+static void pushRecord(GPUScene *gpu, int a, int b, int c, int material)
+{
+	int record[4] = { a, b, c, material };
+	gpu->records.insert(gpu->records.end(), record, record + 4);
+}
+
+// appends the record of triangle t of mesh m, whose vertices start at
+// vertexStart; the materials of the meshes come first
+static void pushMeshTriangle(GPUScene *gpu, const Mesh &mesh, int m, int vertexStart, int t)
+{
+	const unsigned int *c = &mesh.indices[3*t];
+	pushRecord(gpu, vertexStart + c[0], vertexStart + c[1], vertexStart + c[2], m);
+}
+
+// appends the record of object or mesh triangle id
+static void pushPrimitive(GPUScene *gpu, const vector<object> &objects, const vector<Mesh> &meshes,
+						const vector<int> &starts, const vector<int> &vertexStarts, int id)
+{
+	gpu->order.push_back(id);
+	if (id >= (int)objects.size())
+	{
+		int m = FindMesh(starts, id);
+		pushMeshTriangle(gpu, meshes[m], m, vertexStarts[m], id - starts[m]);
+		return;
+	}
+
+	const object &o = objects[id];
+	int material = materialCount(gpu);
+	pushMaterial(gpu, o.color, o.specularity, o.shininess, o.reflectance, o.refraction);
+	if (o.type == TRIANGLE_TYPE)
+	{
+		int v = gpu->vertices.size()/3;
+		pushVertex(gpu, o.x);
+		pushVertex(gpu, o.y);
+		pushVertex(gpu, o.z);
+		pushRecord(gpu, v, v + 1, v + 2, material);
+		return;
+	}
+
+	int shape = gpu->geometry.size()/(4*GPU_GEOMETRY_TEXELS);
+	pushTexel(&gpu->geometry, o.x, 0);
+	pushTexel(&gpu->geometry, o.y, 0);
+	pushRecord(gpu, shape, o.type, -1, material);
+}
+
+// the trees of instanced meshes follow the scene's nodes, each with the
+// records of its leaves; the top-level tree comes last, its leaves holding
+// instances in leaf order
+static void packInstances(GPUScene *gpu, const vector<Mesh> &meshes, const vector<int> &vertexStarts)
+{
+	InstanceBVH &instanced = gpu->instanced;
+	vector<int> nodeStarts(meshes.size(), -1), recordStarts(meshes.size(), -1);
+	for (int m = 0; m < (int)meshes.size(); m++)
+	{
+		const BVH &mesh = instanced.bottom[m];
+		if (mesh.nodes.empty())
+			continue;
+
+		nodeStarts[m] = gpu->nodes.size()/(4*GPU_NODE_TEXELS);
+		recordStarts[m] = gpu->records.size()/(4*GPU_RECORD_TEXELS);
+		for (int k = 0; k < (int)mesh.indices.size(); k++)
+			pushMeshTriangle(gpu, meshes[m], m, vertexStarts[m], mesh.indices[k]);
+		for (int i = 0; i < (int)mesh.nodes.size(); i++)
+		{
+			const BVHNode &node = mesh.nodes[i];
+			if (node.count > 0)
+				pushNode(gpu, node, recordStarts[m] + node.first, leafCounts(0, node.count));
+			else
+				pushNode(gpu, node, nodeStarts[m] + node.first, 0);
+		}
+	}
+
+	const BVH &top = instanced.top;
+	gpu->instanceCount = top.indices.size();
+	gpu->instanceRoot = top.nodes.empty() ? -1 : gpu->nodes.size()/(4*GPU_NODE_TEXELS);
+	for (int i = 0; i < (int)top.nodes.size(); i++)
+	{
+		const BVHNode &node = top.nodes[i];
+		pushNode(gpu, node, node.count > 0 ? node.first : gpu->instanceRoot + node.first, node.count);
+	}
+
+	// the shader numbers instance triangles in this order, on from the records
+	int first = gpu->objectCount;
+	for (int k = 0; k < (int)top.indices.size(); k++)
+	{
+		int i = top.indices[k];
+		int m = instanced.meshes[i];
+		int header[4] = { nodeStarts[m], recordStarts[m], first, 0 };
+		gpu->instances.insert(gpu->instances.end(), header, header + 4);
+		first += meshes[m].indices.size()/3;
+
+		const mat4x3 *transforms[2] = { &instanced.inverses[i], &instanced.transforms[i] };
+		for (int t = 0; t < 2; t++)
+			for (int row = 0; row < 3; row++)
+				for (int column = 0; column < 4; column++)
+					gpu->instances.push_back(floatBits((*transforms[t])[column][row]));
+	}
+}
+
+// lays out the scene around the trees in gpu
+static void packScene(GPUScene *gpu, const vector<object> &objects, const vector<Mesh> &meshes,
+					const vector<float> &lights, const vector<float> &lightIntensities)
+{
+	const BVH &bvh = gpu->bvh;
+	vector<int> starts = MeshStarts(objects.size(), meshes);
+
+	gpu->records.clear();
+	gpu->geometry.clear();
+	gpu->vertices.clear();
+	gpu->materials.clear();
+	gpu->nodes.clear();
+	gpu->lights.clear();
+	gpu->instances.clear();
+	gpu->order.clear();
+
+	// meshes go up as they are, material m being that of mesh m
+	vector<int> vertexStarts;
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		const Mesh &mesh = meshes[m];
+		const Material &mat = mesh.material;
+		vertexStarts.push_back(gpu->vertices.size()/3);
+		gpu->vertices.insert(gpu->vertices.end(), &mesh.vertices.data()->x,
+							&mesh.vertices.data()->x + 3*mesh.vertices.size());
+		pushMaterial(gpu, mesh.color, mat.spec, mat.phong, mat.reflectance, mat.refraction);
+	}
+
+	for (int k = 0; k < (int)bvh.unbounded.size(); k++)
+		pushPrimitive(gpu, objects, meshes, starts, vertexStarts, bvh.unbounded[k]);
+	gpu->planeCount = bvh.unbounded.size();
+
+	// leaf records follow the leaf slots of the tree, so a subtree built
+	// again by RefitBVH() only reorders the records of its own slots
+	gpu->nodeCount = bvh.nodes.size();
+	vector<int> leafAt(bvh.indices.size()), counts(gpu->nodeCount, 0);
+	for (int i = 0; i < gpu->nodeCount; i++)
+		if (bvh.nodes[i].count > 0)
+			leafAt[bvh.nodes[i].first] = i;
+	for (int slot = 0; slot < (int)bvh.indices.size(); slot += bvh.nodes[leafAt[slot]].count)
+	{
+		const BVHNode &node = bvh.nodes[leafAt[slot]];
+		int spheres = 0, triangles = 0;
+		for (int pass = 0; pass < 2; pass++)
+			for (int k = node.first; k < node.first + node.count; k++)
+			{
+				int id = bvh.indices[k];
+				bool sphere = id < (int)objects.size() && objects[id].type == SPHERE_TYPE;
+				if (sphere != (pass == 0))
+					continue;
+				pushPrimitive(gpu, objects, meshes, starts, vertexStarts, id);
+				(sphere ? spheres : triangles)++;
+			}
+		counts[leafAt[slot]] = leafCounts(spheres, triangles);
+	}
+	gpu->objectCount = gpu->order.size();
+
+	// node indices stay those of the BVH, so inner nodes keep their links
+	for (int i = 0; i < gpu->nodeCount; i++)
+	{
+		const BVHNode &node = bvh.nodes[i];
+		pushNode(gpu, node, node.count > 0 ? gpu->planeCount + node.first : node.first, counts[i]);
+	}
+
+	packInstances(gpu, meshes, vertexStarts);
+
+	gpu->lightCount = lights.size()/3;
+	for (int i = 0; i < gpu->lightCount; i++)
+	{
+		float intensity = i < (int)lightIntensities.size() ? lightIntensities[i] : 1;
+		pushTexel(&gpu->lights, vec3(lights[3*i], lights[3*i + 1], lights[3*i + 2]), intensity);
+	}
+}
+
+void PackGPUScene(GPUScene *gpu, const vector<object> &objects, const vector<Mesh> &meshes,
+				const vector<float> &lights, const vector<float> &lightIntensities)
+{
+	BuildBVH(&gpu->bvh, objects, meshes);
+	vector<int> starts = MeshStarts(objects.size(), meshes);
+	BuildInstanceBVH(&gpu->instanced, meshes, starts.back());
+	packScene(gpu, objects, meshes, lights, lightIntensities);
+}
+
+int UpdateGPUScene(GPUScene *gpu, const vector<object> &objects, const vector<Mesh> &meshes,
+				const vector<float> &lights, const vector<float> &lightIntensities,
+				const vector<int> &moved)
+{
+	int rebuilt = moved.empty() ? 0 : RefitBVH(&gpu->bvh, objects, meshes, moved);
+	packScene(gpu, objects, meshes, lights, lightIntensities);
+	return rebuilt;
+}
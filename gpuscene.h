@@ -0,0 +1,84 @@
+// ==========================================================================
+// Scene records for the shader
+//
+// fragment.glsl reads the scene from texture buffers sized by the scene. Every
+// primitive has a record of one RGBA32I texel: planes and spheres point at
+// their geometry, triangles hold the indices of their corners in a shared
+// vertex buffer, and both name their material. Mesh triangles use their
+// mesh's vertices and material as they are; the loose triangles of a scene
+// get corners and a material of their own. Records of planes come first,
+// then those of the BVH leaves in leaf slot order, every leaf's spheres
+// ahead of its triangles, so the shader loops over one kind of primitive at
+// a time.
+//
+// Instanced meshes (see instances.h) add the nodes and leaf records of their
+// own trees once, whatever the number of instances, then the top-level tree
+// and a transform record per instance.
+// ==========================================================================
+#ifndef GPUSCENE_H
+#define GPUSCENE_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+#include "bvh.h"
+#include "instances.h"
+
+// texels per entry in each buffer
+#define GPU_RECORD_TEXELS 1		// (shape, type, -1, material) or (corners, material)
+#define GPU_GEOMETRY_TEXELS 2	// (x, 0) (y, 0) of a plane or sphere
+#define GPU_VERTEX_TEXELS 1		// RGB32F position
+#define GPU_MATERIAL_TEXELS 3	// color, specularity, (shininess, reflectance, refraction, 0)
+#define GPU_NODE_TEXELS 2		// (min bits, first) (max bits, spheres | triangles << 16)
+#define GPU_LIGHT_TEXELS 1		// (position, intensity)
+#define GPU_INSTANCE_TEXELS 7	// (root, records, first, 0), inverse and transform rows as bits
+
+// most primitives of each kind a leaf can count in its node texel; the
+// triangle count sits in the top bits of a signed int, so it gets 15 of them
+#define GPU_LEAF_SPHERES 0xffff
+#define GPU_LEAF_TRIANGLES 0x7fff
+
+struct GPUScene
+{
+	std::vector<int> records;
+	std::vector<float> geometry;
+	std::vector<float> vertices;
+	std::vector<float> materials;
+	std::vector<int> nodes;
+	std::vector<float> lights;
+	std::vector<int> instances;
+
+	int objectCount;			// records of the scene's own objects and meshes
+	int planeCount;				// records [0, planeCount) are planes
+	int nodeCount;				// nodes of the scene's own tree
+	int lightCount;
+	int instanceCount;
+	int instanceRoot;			// top-level node, -1 without instances
+
+	// object or mesh triangle, numbered as in scene.h, of records [0, objectCount)
+	std::vector<int> order;
+
+	// trees the node records were made from
+	BVH bvh;
+	InstanceBVH instanced;
+
+	GPUScene() : objectCount(0), planeCount(0), nodeCount(0), lightCount(0), instanceCount(0),
+		instanceRoot(-1)
+	{}
+};
+
+// lay out a scene as parsed by parser(); lights holds three floats per light
+void PackGPUScene(GPUScene *gpu, const std::vector<object> &objects, const std::vector<Mesh> &meshes,
+				const std::vector<float> &lights, const std::vector<float> &lightIntensities);
+
+// lay out a new version of the scene packed last, whose objects changed in
+// place without changing type and whose meshes differ at most in colour and
+// material; the tree is refitted around the objects in moved rather than
+// built again (see RefitBVH()), so everything else keeps its place and only
+// the texels of what changed differ from the last layout. Returns the number
+// of subtrees built again.
+int UpdateGPUScene(GPUScene *gpu, const std::vector<object> &objects, const std::vector<Mesh> &meshes,
+				const std::vector<float> &lights, const std::vector<float> &lightIntensities,
+				const std::vector<int> &moved);
+
+#endif
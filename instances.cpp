@@ -0,0 +1,170 @@
+// ==========================================================================
+// Two-level acceleration structure for instanced meshes
+// ==========================================================================
+
+#include <chrono>
+#include "instances.h"
+#include "mesh.h"
+
+using namespace std;
+using namespace glm;
+
+// inverse of an affine transform with an invertible linear part
+static mat4x3 inverseTransform(const mat4x3 &m)
+{
+	mat3 r = inverse(mat3(m));
+	return mat4x3(r[0], r[1], r[2], -(r*m[3]));
+}
+
+// scene space box around the root box of a mesh's tree
+static AABB instanceBounds(const BVH &mesh, const mat4x3 &transform)
+{
+	AABB b;
+	if (mesh.nodes.empty())
+		return b;
+	const BVHNode &root = mesh.nodes[0];
+	for (int corner = 0; corner < 8; corner++)
+	{
+		vec3 p(corner & 1 ? root.max[0] : root.min[0],
+			corner & 2 ? root.max[1] : root.min[1],
+			corner & 4 ? root.max[2] : root.min[2]);
+		b.grow(transform*vec4(p, 1));
+	}
+	return b;
+}
+
+void BuildInstanceBVH(InstanceBVH *bvh, const vector<Mesh> &meshes, int first, int threads)
+{
+	auto start = chrono::steady_clock::now();
+
+	bvh->meshes.clear();
+	bvh->transforms.clear();
+	bvh->inverses.clear();
+	bvh->starts.assign(1, first);
+	bvh->bottom.assign(meshes.size(), BVH());
+	for (int m = 0; m < (int)meshes.size(); m++)
+	{
+		const Mesh &mesh = meshes[m];
+		if (mesh.instances.empty())
+			continue;
+		BuildBVH(&bvh->bottom[m], mesh, threads);
+		for (size_t k = 0; k < mesh.instances.size(); k++)
+		{
+			bvh->meshes.push_back(m);
+			bvh->transforms.push_back(mesh.instances[k]);
+			bvh->inverses.push_back(inverseTransform(mesh.instances[k]));
+			bvh->starts.push_back(bvh->starts.back() + mesh.indices.size()/3);
+		}
+	}
+
+	vector<AABB> boxes(bvh->meshes.size());
+	for (int i = 0; i < (int)boxes.size(); i++)
+		boxes[i] = instanceBounds(bvh->bottom[bvh->meshes[i]], bvh->transforms[i]);
+	BuildBVH(&bvh->top, boxes, threads);
+
+	chrono::duration<float> elapsed = chrono::steady_clock::now() - start;
+	bvh->buildTime = elapsed.count();
+}
+
+int FindInstance(const InstanceBVH *bvh, int id)
+{
+	return FindMesh(bvh->starts, id);
+}
+
+object InstanceTriangle(const InstanceBVH *bvh, const vector<Mesh> &meshes, int id)
+{
+	int i = FindInstance(bvh, id);
+	const mat4x3 &transform = bvh->transforms[i];
+	object o = MeshTriangle(meshes[bvh->meshes[i]], id - bvh->starts[i]);
+	o.x = transform*vec4(o.x, 1);
+	o.y = transform*vec4(o.y, 1);
+	o.z = transform*vec4(o.z, 1);
+	return o;
+}
+
+// the ray in the space of instance i down the mesh's tree
+static int intersectInstance(const InstanceBVH *bvh, int i, vec3 ray, vec3 origin, int ignore,
+							bool anyHit, float *best)
+{
+	static const vector<object> noObjects;
+	static const vector<vec3> noNormals;
+
+	const BVH &mesh = bvh->bottom[bvh->meshes[i]];
+	if (mesh.nodes.empty())
+		return -1;
+
+	const mat4x3 &inverse = bvh->inverses[i];
+	vec3 meshRay = mat3(inverse)*ray;
+	vec3 meshOrigin = inverse*vec4(origin, 1);
+	int first = bvh->starts[i];
+	int local = ignore >= first && ignore < bvh->starts[i + 1] ? ignore - first : -1;
+
+	int hit = anyHit
+		? IntersectAny(&mesh, noObjects, noNormals, meshRay, meshOrigin, local, *best, best)
+		: IntersectSubtree(&mesh, noObjects, meshRay, meshOrigin, 0, local, best);
+	return hit >= 0 ? first + hit : -1;
+}
+
+int IntersectInstances(const InstanceBVH *bvh, vec3 ray, vec3 origin, int ignore,
+					bool anyHit, float *best)
+{
+	const BVH &top = bvh->top;
+	int hit = -1;
+	if (top.nodes.empty())
+		return hit;
+
+	vec3 inv = InverseDirection(ray);
+	int stack[BVH_MAX_DEPTH];
+	float stackNear[BVH_MAX_DEPTH];
+	int sp = 0;
+
+	int current = SlabTest(top.nodes[0], origin, inv, *best) < 1e30f ? 0 : -1;
+	while (current >= 0)
+	{
+		const BVHNode &node = top.nodes[current];
+		current = -1;
+
+		if (node.count > 0)
+		{
+			for (int k = node.first; k < node.first + node.count; k++)
+			{
+				int instanceHit = intersectInstance(bvh, top.indices[k], ray, origin, ignore, anyHit, best);
+				if (instanceHit < 0)
+					continue;
+				hit = instanceHit;
+				if (anyHit)
+					return hit;
+			}
+		}
+		else
+		{
+			// visit the nearer child first, the other one waits on the stack
+			int a = node.first, b = node.first + 1;
+			float da = SlabTest(top.nodes[a], origin, inv, *best);
+			float db = SlabTest(top.nodes[b], origin, inv, *best);
+			if (db < da)
+			{
+				std::swap(a, b);
+				std::swap(da, db);
+			}
+			if (da < 1e30f)
+			{
+				current = a;
+				if (db < 1e30f)
+				{
+					stack[sp] = b;
+					stackNear[sp++] = db;
+				}
+			}
+		}
+
+		// pop until a node that can still hold something closer
+		while (current < 0 && sp > 0)
+		{
+			sp--;
+			if (stackNear[sp] < *best)
+				current = stack[sp];
+		}
+	}
+	return hit;
+}
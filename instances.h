@@ -0,0 +1,51 @@
+// ==========================================================================
+// Two-level acceleration structure for instanced meshes
+//
+// Every mesh placed by instance blocks gets a BVH of its own in mesh space,
+// shared by all of its instances, and a top-level BVH over the scene space
+// boxes of the instances leads rays to them. A ray reaching an instance is
+// carried into mesh space by the inverse transform, left unnormalised so
+// that ray parameters stay those of the scene, and goes on down the mesh's
+// tree. Memory grows with the meshes rather than with their copies.
+// ==========================================================================
+#ifndef INSTANCES_H
+#define INSTANCES_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+#include "bvh.h"
+
+// instances are numbered mesh by mesh in the order of Mesh::instances
+struct InstanceBVH
+{
+	std::vector<int> meshes;				// mesh of every instance
+	std::vector<glm::mat4x3> transforms;	// mesh to scene space
+	std::vector<glm::mat4x3> inverses;		// scene to mesh space
+	std::vector<int> starts;				// first triangle of every instance, then the end
+	std::vector<BVH> bottom;				// tree of every mesh, empty if it has no instances
+	BVH top;								// leaves hold instance numbers
+	float buildTime;						// seconds, both levels
+
+	InstanceBVH() : buildTime(0)
+	{}
+};
+
+// gather the instances of the meshes, numbering their triangles on from
+// first, and build both levels with the given number of threads (0 uses
+// every hardware thread)
+void BuildInstanceBVH(InstanceBVH *bvh, const std::vector<Mesh> &meshes, int first, int threads = 0);
+
+// instance holding the triangle numbered id
+int FindInstance(const InstanceBVH *bvh, int id);
+
+// the triangle numbered id, in scene space
+object InstanceTriangle(const InstanceBVH *bvh, const std::vector<Mesh> &meshes, int id);
+
+// closest instance triangle hit at a ray parameter in (0, *best), or with
+// anyHit the first one found, skipping triangle ignore; returns its number
+// and lowers best, or returns -1
+int IntersectInstances(const InstanceBVH *bvh, glm::vec3 ray, glm::vec3 origin, int ignore,
+					bool anyHit, float *best);
+
+#endif
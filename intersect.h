@@ -0,0 +1,76 @@
+// ==========================================================================
+// Ray/primitive intersection tests of fragment.glsl
+//
+// Each test returns the ray parameter of the hit, or a value <= 0 on a miss.
+// ==========================================================================
+#ifndef INTERSECT_H
+#define INTERSECT_H
+
+#include <cmath>
+#include <algorithm>
+#include "glm/glm.hpp"
+#include "scene.h"
+
+inline float sphereIntersection(glm::vec3 ray, glm::vec3 origin, glm::vec3 center, float radius)
+{
+	float a = glm::dot(ray, ray);
+	float b = -2*glm::dot(center, ray)+2*glm::dot(ray, origin);
+	float c = -2*glm::dot(origin, center)+glm::dot(center, center)
+			  -radius*radius+glm::dot(origin, origin);
+
+	float discriminant = b*b - 4*a*c;
+	if (discriminant < 0)
+		return -1;
+
+	float t1 = (-b-std::sqrt(discriminant))/(2*a);
+	float t2 = (-b+std::sqrt(discriminant))/(2*a);
+
+	if (t1<0 && t2>=0)
+		t1 = t2;
+	else if (t1>=0 && t2<0)
+		t2 = t1;
+
+	return std::min(t1, t2);
+}
+
+// n must be of unit length
+inline float planeIntersection(glm::vec3 ray, glm::vec3 origin, glm::vec3 n, glm::vec3 q)
+{
+	if (glm::dot(ray, n) != 0)
+		return (glm::dot(q, n)-glm::dot(n, origin))/glm::dot(ray, n);
+
+	return -1;
+}
+
+// Cramer's rule on [-ray e1 e2], written out with triple products instead of
+// the four mat3 determinants of the shader
+inline float triangleIntersection(glm::vec3 ray, glm::vec3 origin, glm::vec3 p0, glm::vec3 p1, glm::vec3 p2)
+{
+	glm::vec3 s = origin - p0;
+	glm::vec3 e1 = p1 - p0;
+	glm::vec3 e2 = p2 - p0;
+
+	float d = glm::dot(-ray, glm::cross(e1, e2));
+	float t = glm::dot(s, glm::cross(e1, e2))/d;
+	float u = glm::dot(-ray, glm::cross(s, e2))/d;
+	float v = glm::dot(-ray, glm::cross(e1, s))/d;
+
+	if (t > 0 && (u+v)<1 && (u+v)>0 && u<1 && u>0 && v<1 && v>0)
+		return t;
+
+	return -1;
+}
+
+// dispatch on the object type; normal is the unit normal of planes
+inline float objectIntersection(const object &o, glm::vec3 normal, glm::vec3 ray, glm::vec3 origin)
+{
+	if (o.type == SPHERE_TYPE)
+		return sphereIntersection(ray, origin, o.x, o.y[0]);
+	else if (o.type == PLANE_TYPE)
+		return planeIntersection(ray, origin, normal, o.y);
+	else if (o.type == TRIANGLE_TYPE)
+		return triangleIntersection(ray, origin, o.x, o.y, o.z);
+	return 0;
+}
+
+#endif
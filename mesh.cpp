@@ -0,0 +1,751 @@
+// ==========================================================================
+// Mesh import
+// ==========================================================================
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mesh.h"
+#include "parser.h"
+#include "scheduler.h"
+
+using namespace std;
+using namespace glm;
+
+// text parsed by one task; larger files are parsed on every core
+#define MESH_BLOCK_BYTES (4 << 20)
+
+// corners of a block at or above this are OBJ's negative indices, counted
+// from the vertices of their own block
+#define RELATIVE_CORNER (int64_t(1) << 40)
+
+enum MeshKind
+{
+	MESH_OBJ,
+	MESH_PLY_ASCII,
+	MESH_PLY_BINARY
+};
+
+// scalar types of PLY properties
+enum PlyType
+{
+	PLY_INT8,
+	PLY_UINT8,
+	PLY_INT16,
+	PLY_UINT16,
+	PLY_INT32,
+	PLY_UINT32,
+	PLY_FLOAT32,
+	PLY_FLOAT64,
+	PLY_TYPES
+};
+
+static const char *plyTypeNames[PLY_TYPES][2] = {
+	{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+	{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+};
+static const int plyTypeSizes[PLY_TYPES] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+struct plyProperty
+{
+	int type;				// of the items, for lists
+	bool list;
+	int countType;
+	int axis;				// 0, 1 or 2 for the x, y, z of a vertex, else -1
+	bool corners;			// the vertex list of a face
+};
+
+struct plyElement
+{
+	string name;
+	int64_t count;
+	int64_t first;			// record of the body the element starts at
+	vector<plyProperty> properties;
+};
+
+struct meshFormat
+{
+	MeshKind kind;
+	bool swap;				// binary numbers are big endian
+	vector<plyElement> elements;
+	int64_t bodyLine;		// line of the file the body starts on
+};
+
+// --------------------------------------------------------------------------
+// Streaming
+
+struct meshStream
+{
+	int fd;
+	vector<char> buffer;
+	size_t begin, end;		// unread bytes of the buffer
+	int64_t left;			// bytes of the file not read into the buffer yet
+	bool eof;
+	bool failed;
+
+	meshStream() : fd(-1), begin(0), end(0), left(0), eof(false), failed(false)
+	{}
+};
+
+static size_t available(const meshStream *s)
+{
+	return s->end - s->begin;
+}
+
+static const char *unread(const meshStream *s)
+{
+	return s->buffer.data() + s->begin;
+}
+
+// reads until at least bytes are buffered, returning false if the file ends
+// first; refills the whole buffer to keep reads large
+static bool fill(meshStream *s, size_t bytes)
+{
+	if (available(s) >= bytes)
+		return true;
+
+	if (s->begin > 0)
+	{
+		memmove(s->buffer.data(), unread(s), available(s));
+		s->end -= s->begin;
+		s->begin = 0;
+	}
+	if (s->buffer.size() < bytes)
+		s->buffer.resize(std::max(bytes, std::max(2*s->buffer.size(), (size_t)MESH_BLOCK_BYTES)));
+
+	while (!s->eof && s->end < s->buffer.size())
+	{
+		ssize_t n = read(s->fd, s->buffer.data() + s->end, s->buffer.size() - s->end);
+		if (n <= 0)
+		{
+			s->eof = true;
+			s->failed = n < 0;
+		}
+		else
+		{
+			s->end += n;
+			s->left -= n;
+		}
+	}
+	return available(s) >= bytes;
+}
+
+// moves the next whole lines, about MESH_BLOCK_BYTES of them, into text;
+// returns false once the file is used up
+static bool readLines(meshStream *s, vector<char> *text)
+{
+	fill(s, MESH_BLOCK_BYTES);
+	const char *newline;
+	while (!(newline = static_cast<const char *>(memrchr(unread(s), '\n', available(s)))) && !s->eof)
+		fill(s, available(s) + 1);
+
+	size_t length = s->eof ? available(s) : newline + 1 - unread(s);
+	text->assign(unread(s), unread(s) + length);
+	s->begin += length;
+	return length > 0;
+}
+
+// reads one line of a header, without its line break
+static bool readLine(meshStream *s, string *line)
+{
+	const char *newline;
+	while (!(newline = static_cast<const char *>(memchr(unread(s), '\n', available(s)))) && !s->eof)
+		fill(s, available(s) + 1);
+	if (available(s) == 0)
+		return false;
+
+	size_t length = newline ? newline - unread(s) : available(s);
+	line->assign(unread(s), length);
+	if (!line->empty() && (*line)[line->size() - 1] == '\r')
+		line->erase(line->size() - 1);
+	s->begin += newline ? length + 1 : length;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Headers
+
+static int plyType(const string &name)
+{
+	for (int t = 0; t < PLY_TYPES; t++)
+		if (name == plyTypeNames[t][0] || name == plyTypeNames[t][1])
+			return t;
+	return -1;
+}
+
+static bool readPlyHeader(meshStream *s, meshFormat *format, string *error)
+{
+	string line;
+	readLine(s, &line);
+	int lines = 1;
+	bool ended = false, formatted = false;
+	while (!ended && readLine(s, &line))
+	{
+		lines++;
+		istringstream in(line);
+		string word;
+		in >> word;
+		if (word == "format")
+		{
+			string kind;
+			in >> kind;
+			formatted = true;
+			if (kind == "ascii")
+				format->kind = MESH_PLY_ASCII;
+			else if (kind == "binary_little_endian" || kind == "binary_big_endian")
+			{
+				format->kind = MESH_PLY_BINARY;
+				format->swap = kind == "binary_big_endian";
+			}
+			else
+			{
+				*error = "unknown PLY format " + kind;
+				return false;
+			}
+		}
+		else if (word == "element")
+		{
+			plyElement element;
+			in >> element.name >> element.count;
+			if (!in || element.count < 0)
+			{
+				*error = "bad PLY element: " + line;
+				return false;
+			}
+			element.first = format->elements.empty() ? 0
+				: format->elements.back().first + format->elements.back().count;
+			format->elements.push_back(element);
+		}
+		else if (word == "property")
+		{
+			plyProperty property;
+			string type, name;
+			in >> type;
+			property.list = type == "list";
+			property.countType = -1;
+			if (property.list)
+			{
+				string countType;
+				in >> countType >> type;
+				property.countType = plyType(countType);
+			}
+			in >> name;
+			property.type = plyType(type);
+			if (!in || property.type < 0 || (property.list && property.countType < 0)
+				|| format->elements.empty())
+			{
+				*error = "bad PLY property: " + line;
+				return false;
+			}
+
+			const string &element = format->elements.back().name;
+			property.axis = -1;
+			if (element == "vertex" && !property.list && name.size() == 1 && name[0] >= 'x' && name[0] <= 'z')
+				property.axis = name[0] - 'x';
+			property.corners = element == "face" && property.list
+				&& (name == "vertex_indices" || name == "vertex_index");
+			format->elements.back().properties.push_back(property);
+		}
+		else if (word == "end_header")
+			ended = true;
+	}
+
+	if (!ended || !formatted)
+	{
+		*error = "PLY header is not complete";
+		return false;
+	}
+
+	// every mesh needs positions, and faces their corners
+	for (size_t e = 0; e < format->elements.size(); e++)
+	{
+		const plyElement &element = format->elements[e];
+		int axes = 0, corners = 0;
+		for (size_t p = 0; p < element.properties.size(); p++)
+		{
+			axes += element.properties[p].axis >= 0;
+			corners += element.properties[p].corners;
+		}
+		if (element.name == "vertex" && axes != 3)
+		{
+			*error = "PLY vertices need x, y and z";
+			return false;
+		}
+		if (element.name == "face" && corners != 1)
+		{
+			*error = "PLY faces need vertex_indices";
+			return false;
+		}
+	}
+	format->bodyLine = lines + 1;
+	return true;
+}
+
+// tells OBJ from PLY by the first line, and reads the header of a PLY
+static bool readHeader(meshStream *s, meshFormat *format, string *error)
+{
+	format->kind = MESH_OBJ;
+	format->swap = false;
+	format->bodyLine = 1;
+
+	fill(s, 4);
+	const char *p = unread(s);
+	if (available(s) >= 4 && memcmp(p, "ply", 3) == 0 && (p[3] == '\n' || p[3] == '\r'))
+		return readPlyHeader(s, format, error);
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Text
+
+// a run of whole lines of the file and what they hold
+struct meshBlock
+{
+	vector<char> text;
+	int64_t firstLine;
+
+	vector<vec3> vertices;
+	vector<int64_t> corners;	// three per triangle, into the mesh or RELATIVE_CORNER + into the block
+	vector<int64_t> polygon;
+
+	bool parsed;
+	string error;
+};
+
+static bool isBlank(char c)
+{
+	return (unsigned char)c <= ' ';
+}
+
+static const char *skipBlanks(const char *p, const char *end)
+{
+	while (p < end && isBlank(*p))
+		p++;
+	return p;
+}
+
+static bool failBlock(meshBlock *block, int64_t line, const string &message)
+{
+	ostringstream out;
+	out << "line " << line << ": " << message;
+	block->error = out.str();
+	return false;
+}
+
+static bool readFloat(const char **p, const char *end, float *value)
+{
+	const char *stop;
+	const char *q = skipBlanks(*p, end);
+	if (!ParseNumber(q, end, &stop, value) || (stop < end && !isBlank(*stop)))
+		return false;
+	*p = stop;
+	return true;
+}
+
+// reads an integer ending at a blank, a '/' or the end of the line
+static bool readIndex(const char **p, const char *end, int64_t *value)
+{
+	const char *q = skipBlanks(*p, end);
+	bool negative = q < end && *q == '-';
+	if (q < end && (*q == '-' || *q == '+'))
+		q++;
+	const char *digits = q;
+	int64_t n = 0;
+	for (; q < end && *q >= '0' && *q <= '9' && n < RELATIVE_CORNER; q++)
+		n = n*10 + (*q - '0');
+	if (q == digits || (q < end && !isBlank(*q) && *q != '/'))
+		return false;
+	*value = negative ? -n : n;
+	*p = q;
+	return true;
+}
+
+// splits the polygon of a block into a fan of triangles
+static void addFan(meshBlock *block)
+{
+	const vector<int64_t> &polygon = block->polygon;
+	for (size_t k = 1; k + 1 < polygon.size(); k++)
+	{
+		block->corners.push_back(polygon[0]);
+		block->corners.push_back(polygon[k]);
+		block->corners.push_back(polygon[k + 1]);
+	}
+}
+
+static bool parseObjLine(meshBlock *block, const char *p, const char *end, int64_t line)
+{
+	p = skipBlanks(p, end);
+	if (end - p < 2 || !isBlank(p[1]))
+		return true;
+
+	if (p[0] == 'v')
+	{
+		vec3 v;
+		p++;
+		for (int i = 0; i < 3; i++)
+			if (!readFloat(&p, end, &v[i]))
+				return failBlock(block, line, "expected three numbers after v");
+		block->vertices.push_back(v);
+	}
+	else if (p[0] == 'f')
+	{
+		block->polygon.clear();
+		for (p++;;)
+		{
+			p = skipBlanks(p, end);
+			if (p == end || *p == '#')
+				break;
+			int64_t index;
+			if (!readIndex(&p, end, &index) || index == 0)
+				return failBlock(block, line, "expected a vertex index in f");
+			block->polygon.push_back(index > 0 ? index - 1
+				: RELATIVE_CORNER + (int64_t)block->vertices.size() + index);
+
+			// texture coordinate and normal indices
+			while (p < end && !isBlank(*p))
+				p++;
+		}
+		if (block->polygon.size() < 3)
+			return failBlock(block, line, "a face needs three vertices");
+		addFan(block);
+	}
+	return true;
+}
+
+// reads one record of an ascii PLY element
+static bool parsePlyLine(meshBlock *block, const plyElement &element, const char *p,
+						const char *end, int64_t line)
+{
+	bool vertex = element.name == "vertex", face = element.name == "face";
+	if (!vertex && !face)
+		return true;
+
+	vec3 v(0);
+	block->polygon.clear();
+	for (size_t i = 0; i < element.properties.size(); i++)
+	{
+		const plyProperty &property = element.properties[i];
+		float value;
+		if (!property.list)
+		{
+			if (!readFloat(&p, end, &value))
+				return failBlock(block, line, "expected a number in " + element.name);
+			if (property.axis >= 0)
+				v[property.axis] = value;
+			continue;
+		}
+
+		int64_t count;
+		if (!readIndex(&p, end, &count) || count < 0)
+			return failBlock(block, line, "expected a list length in " + element.name);
+		for (int64_t j = 0; j < count; j++)
+		{
+			int64_t index;
+			bool read = property.corners ? readIndex(&p, end, &index) && index >= 0
+				: readFloat(&p, end, &value);
+			if (!read)
+				return failBlock(block, line, "expected a list item in " + element.name);
+			if (property.corners)
+				block->polygon.push_back(index);
+		}
+	}
+
+	if (vertex)
+		block->vertices.push_back(v);
+	else if (block->polygon.size() >= 3)
+		addFan(block);
+	return true;
+}
+
+static void parseBlock(meshBlock *block, const meshFormat &format)
+{
+	const char *p = block->text.data(), *end = p + block->text.size();
+	size_t e = 0;
+	for (int64_t line = block->firstLine; p < end; line++)
+	{
+		const char *lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+		if (!lineEnd)
+			lineEnd = end;
+
+		if (format.kind == MESH_OBJ)
+		{
+			if (!parseObjLine(block, p, lineEnd, line))
+				return;
+		}
+		else
+		{
+			// records after the last element are ignored
+			int64_t record = line - format.bodyLine;
+			const vector<plyElement> &elements = format.elements;
+			while (e < elements.size() && record >= elements[e].first + elements[e].count)
+				e++;
+			if (e == elements.size())
+				break;
+			if (!parsePlyLine(block, elements[e], p, lineEnd, line))
+				return;
+		}
+		p = lineEnd < end ? lineEnd + 1 : end;
+	}
+	block->parsed = true;
+}
+
+// appends a parsed block to the mesh, resolving its relative corners
+static bool mergeBlock(const meshBlock &block, Mesh *mesh, string *error)
+{
+	if (!block.parsed)
+	{
+		*error = block.error;
+		return false;
+	}
+
+	int64_t base = mesh->vertices.size();
+	mesh->vertices.insert(mesh->vertices.end(), block.vertices.begin(), block.vertices.end());
+	for (size_t i = 0; i < block.corners.size(); i++)
+	{
+		int64_t corner = block.corners[i];
+		if (corner >= RELATIVE_CORNER/2)
+			corner = base + corner - RELATIVE_CORNER;
+		if (corner < 0 || corner > UINT32_MAX)
+		{
+			*error = "a face refers to a vertex that does not exist";
+			return false;
+		}
+		mesh->indices.push_back(corner);
+	}
+	return true;
+}
+
+// runs task(i) for every i in [0, count), on the pool if there is one
+static void runTasks(TilePool *pool, int count, const function<void(int)> &task)
+{
+	if (pool)
+		RunTiles(pool, count, task);
+	else
+		for (int i = 0; i < count; i++)
+			task(i);
+}
+
+// reads an OBJ or ascii PLY a batch of blocks at a time, one block per worker
+static bool readText(meshStream *s, const meshFormat &format, TilePool *pool, Mesh *mesh,
+					string *error)
+{
+	vector<meshBlock> blocks(pool ? std::max(1u, thread::hardware_concurrency()) : 1);
+	int64_t line = format.bodyLine;
+	for (;;)
+	{
+		int count = 0;
+		for (; count < (int)blocks.size() && readLines(s, &blocks[count].text); count++)
+		{
+			meshBlock &block = blocks[count];
+			block.firstLine = line;
+			block.vertices.clear();
+			block.corners.clear();
+			block.parsed = false;
+			line += std::count(block.text.begin(), block.text.end(), '\n');
+		}
+		if (count == 0)
+			return true;
+
+		runTasks(pool, count, [&](int i) { parseBlock(&blocks[i], format); });
+		for (int i = 0; i < count; i++)
+			if (!mergeBlock(blocks[i], mesh, error))
+				return false;
+	}
+}
+
+// --------------------------------------------------------------------------
+// Binary PLY
+
+// reads a scalar of a little endian host from a file of either order
+static double readScalar(const char *p, int type, bool swap)
+{
+	char bytes[8];
+	int size = plyTypeSizes[type];
+	for (int i = 0; i < size; i++)
+		bytes[i] = p[swap ? size - 1 - i : i];
+
+	switch (type)
+	{
+	case PLY_INT8:		{ int8_t v; memcpy(&v, bytes, 1); return v; }
+	case PLY_UINT8:		{ uint8_t v; memcpy(&v, bytes, 1); return v; }
+	case PLY_INT16:		{ int16_t v; memcpy(&v, bytes, 2); return v; }
+	case PLY_UINT16:	{ uint16_t v; memcpy(&v, bytes, 2); return v; }
+	case PLY_INT32:		{ int32_t v; memcpy(&v, bytes, 4); return v; }
+	case PLY_UINT32:	{ uint32_t v; memcpy(&v, bytes, 4); return v; }
+	case PLY_FLOAT32:	{ float v; memcpy(&v, bytes, 4); return v; }
+	default:			{ double v; memcpy(&v, bytes, 8); return v; }
+	}
+}
+
+// binary records are read in order as they stream in; converting them costs
+// little next to reading the file
+static bool readBinaryPly(meshStream *s, const meshFormat &format, Mesh *mesh, string *error)
+{
+	vector<int64_t> polygon;
+	for (size_t e = 0; e < format.elements.size(); e++)
+	{
+		const plyElement &element = format.elements[e];
+		bool vertex = element.name == "vertex", face = element.name == "face";
+		for (int64_t r = 0; r < element.count; r++)
+		{
+			vec3 v(0);
+			polygon.clear();
+			for (size_t i = 0; i < element.properties.size(); i++)
+			{
+				const plyProperty &property = element.properties[i];
+				int size = plyTypeSizes[property.type];
+				int64_t count = 1;
+				if (property.list && fill(s, plyTypeSizes[property.countType]))
+				{
+					double n = readScalar(unread(s), property.countType, format.swap);
+					s->begin += plyTypeSizes[property.countType];
+
+					// a corrupt count must not size a buffer past the end of the file
+					count = n >= 0 && n <= (double)(s->left + available(s))/size ? (int64_t)n : -1;
+				}
+				else if (property.list)
+					count = -1;
+				if (count < 0 || !fill(s, count*size))
+				{
+					*error = "PLY file ends in element " + element.name;
+					return false;
+				}
+
+				const char *p = unread(s);
+				if (property.axis >= 0)
+					v[property.axis] = readScalar(p, property.type, format.swap);
+				else if (property.corners)
+					for (int64_t j = 0; j < count; j++)
+						polygon.push_back((int64_t)readScalar(p + j*size, property.type, format.swap));
+				s->begin += count*size;
+			}
+
+			if (vertex)
+				mesh->vertices.push_back(v);
+			for (size_t k = 1; face && k + 1 < polygon.size(); k++)
+			{
+				int64_t corners[3] = { polygon[0], polygon[k], polygon[k + 1] };
+				for (int c = 0; c < 3; c++)
+				{
+					if (corners[c] < 0 || corners[c] > UINT32_MAX)
+					{
+						*error = "a face refers to a vertex that does not exist";
+						return false;
+					}
+					mesh->indices.push_back(corners[c]);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Loading
+
+bool LoadMesh(const string &path, const vec4 &color, const Material &material,
+			Mesh *mesh, string *error, TilePool *pool)
+{
+	meshStream s;
+	s.fd = open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (s.fd < 0 || fstat(s.fd, &info) != 0)
+	{
+		if (s.fd >= 0)
+			close(s.fd);
+		*error = "unable to open the file";
+		return false;
+	}
+
+	s.left = info.st_size;
+
+	// small meshes are not worth waking the workers for
+	if (info.st_size <= MESH_BLOCK_BYTES)
+		pool = 0;
+
+	mesh->vertices.clear();
+	mesh->indices.clear();
+	mesh->color = color;
+	mesh->material = material;
+
+	meshFormat format;
+	bool read = readHeader(&s, &format, error);
+	if (read)
+	{
+		// every record takes a byte at least, which bounds what a corrupt
+		// header can make us allocate
+		for (size_t e = 0; e < format.elements.size(); e++)
+			if (format.elements[e].name == "vertex")
+				mesh->vertices.reserve(std::min<int64_t>(format.elements[e].count, info.st_size));
+			else if (format.elements[e].name == "face")
+				mesh->indices.reserve(3*std::min<int64_t>(format.elements[e].count, info.st_size));
+
+		if (format.kind == MESH_PLY_BINARY)
+			read = readBinaryPly(&s, format, mesh, error);
+		else
+			read = readText(&s, format, pool, mesh, error);
+	}
+	if (read && s.failed)
+	{
+		*error = "unable to read the file";
+		read = false;
+	}
+	close(s.fd);
+
+	for (size_t i = 0; read && i < mesh->indices.size(); i++)
+		if (mesh->indices[i] >= mesh->vertices.size())
+		{
+			ostringstream out;
+			out << "a face refers to vertex " << mesh->indices[i] + 1 << " of " << mesh->vertices.size();
+			*error = out.str();
+			read = false;
+		}
+	return read;
+}
+
+// --------------------------------------------------------------------------
+// Numbering
+
+vector<int> MeshStarts(int objectCount, const vector<Mesh> &meshes)
+{
+	vector<int> starts(1, objectCount);
+	for (size_t m = 0; m < meshes.size(); m++)
+		starts.push_back(starts.back() + (meshes[m].placed ? meshes[m].indices.size()/3 : 0));
+	return starts;
+}
+
+int FindMesh(const vector<int> &starts, int id)
+{
+	return upper_bound(starts.begin(), starts.end(), id) - starts.begin() - 1;
+}
+
+object MeshTriangle(const Mesh &mesh, int t)
+{
+	const unsigned int *corners = &mesh.indices[3*t];
+
+	object o;
+	o.type = TRIANGLE_TYPE;
+	o.x = mesh.vertices[corners[0]];
+	o.y = mesh.vertices[corners[1]];
+	o.z = mesh.vertices[corners[2]];
+	o.color = mesh.color;
+	o.specularity = mesh.material.spec;
+	o.shininess = mesh.material.phong;
+	o.reflectance = mesh.material.reflectance;
+	o.refraction = mesh.material.refraction;
+	return o;
+}
+
+object ScenePrimitive(const vector<object> &objects, const vector<Mesh> &meshes,
+					const vector<int> &starts, int id)
+{
+	if (id < (int)objects.size())
+		return objects[id];
+	int m = FindMesh(starts, id);
+	return MeshTriangle(meshes[m], id - starts[m]);
+}
@@ -0,0 +1,46 @@
+// ==========================================================================
+// Indexed triangle meshes
+//
+// Reads the triangles of Wavefront OBJ and PLY (ascii or binary) meshes for
+// the mesh block of the text scene format:
+//
+//     mesh { file: bunny.obj  color: r g b [a] }
+//
+// Files are streamed in blocks of whole lines, and the blocks of a batch
+// parsed on every core. A mesh stays a vertex array and index triples with
+// one material (see Mesh in scene.h) all the way to the tracer and the
+// shader. Polygons are split into fans; normals, texture coordinates, groups
+// and materials of the file are ignored.
+// ==========================================================================
+#ifndef MESH_H
+#define MESH_H
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+#include "scheduler.h"
+
+// read a mesh file into mesh, giving it the colour and material; on failure
+// error holds the cause. The text blocks of a large file are parsed on pool,
+// or on the calling thread without one.
+bool LoadMesh(const std::string &path, const glm::vec4 &color, const Material &material,
+			Mesh *mesh, std::string *error, TilePool *pool = 0);
+
+// number of the first triangle of every mesh when the meshes follow
+// objectCount objects, and one past the last triangle at the end; meshes
+// that are not placed hold none
+std::vector<int> MeshStarts(int objectCount, const std::vector<Mesh> &meshes);
+
+// entry of starts holding the triangle numbered id; with equal starts it is
+// the last, the one that is not empty
+int FindMesh(const std::vector<int> &starts, int id);
+
+// triangle t of a mesh, as an object of the mesh's colour and material
+object MeshTriangle(const Mesh &mesh, int t);
+
+// the object or mesh triangle numbered id, given the starts of the meshes
+object ScenePrimitive(const std::vector<object> &objects, const std::vector<Mesh> &meshes,
+					const std::vector<int> &starts, int id);
+
+#endif
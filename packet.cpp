@@ -0,0 +1,201 @@
+// ==========================================================================
+// Coherent ray packets
+// ==========================================================================
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "packet.h"
+#include "simd.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+// inner nodes entered by this few rays are finished one ray at a time
+#define PACKET_MIN_RAYS 4
+
+static vec3 packetRay(const RayPacket *packet, int i)
+{
+	return vec3(packet->dir[0][i], packet->dir[1][i], packet->dir[2][i]);
+}
+
+static float furthest(const RayPacket *packet)
+{
+	float m = 0;
+	for (int i = 0; i < packet->count; i++)
+		m = std::max(m, packet->t[i]);
+	return m;
+}
+
+// bit i of the result is set if ray i enters the box whose planes lie at
+// nearD and farD from the origin before its distance rayT[i]
+static uint64_t nodeTest(const float nearD[3], const float farD[3],
+						const float inv[3][PACKET_SIZE], const float *rayT)
+{
+	uint64_t mask = 0;
+#if SIMD_X86
+	__m128 nearX = _mm_set1_ps(nearD[0]), nearY = _mm_set1_ps(nearD[1]), nearZ = _mm_set1_ps(nearD[2]);
+	__m128 farX = _mm_set1_ps(farD[0]), farY = _mm_set1_ps(farD[1]), farZ = _mm_set1_ps(farD[2]);
+	for (int i = 0; i < PACKET_SIZE; i += 4)
+	{
+		__m128 ix = _mm_loadu_ps(inv[0] + i);
+		__m128 iy = _mm_loadu_ps(inv[1] + i);
+		__m128 iz = _mm_loadu_ps(inv[2] + i);
+		__m128 tMin = _mm_max_ps(_mm_max_ps(_mm_mul_ps(nearX, ix), _mm_mul_ps(nearY, iy)),
+								_mm_max_ps(_mm_mul_ps(nearZ, iz), _mm_setzero_ps()));
+		__m128 tMax = _mm_min_ps(_mm_min_ps(_mm_mul_ps(farX, ix), _mm_mul_ps(farY, iy)),
+								_mm_min_ps(_mm_mul_ps(farZ, iz), _mm_loadu_ps(rayT + i)));
+		mask |= (uint64_t)_mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << i;
+	}
+#else
+	for (int i = 0; i < PACKET_SIZE; i++)
+	{
+		float tMin = std::max(std::max(nearD[0]*inv[0][i], nearD[1]*inv[1][i]),
+							std::max(nearD[2]*inv[2][i], 0.f));
+		float tMax = std::min(std::min(farD[0]*inv[0][i], farD[1]*inv[1][i]),
+							std::min(farD[2]*inv[2][i], rayT[i]));
+		if (tMin <= tMax)
+			mask |= (uint64_t)1 << i;
+	}
+#endif
+	return mask;
+}
+
+static void traceSingly(const BVH *bvh, const vector<object> &objects, RayPacket *packet,
+						int root, uint64_t active)
+{
+	while (active)
+	{
+		int i = __builtin_ctzll(active);
+		active &= active - 1;
+		int hit = IntersectSubtree(bvh, objects, packetRay(packet, i), packet->origin, root, -1,
+									&packet->t[i]);
+		if (hit >= 0)
+			packet->hit[i] = hit;
+	}
+}
+
+void IntersectPacket(const BVH *bvh, const vector<object> &objects, const vector<vec3> &normals,
+					RayPacket *packet)
+{
+	int n = packet->count;
+	vec3 o = packet->origin;
+	for (int i = 0; i < n; i++)
+		packet->hit[i] = IntersectUnbounded(bvh, objects, normals, packetRay(packet, i), o, -1, &packet->t[i]);
+
+	if (bvh->nodes.empty() || n == 0)
+		return;
+
+	uint64_t all = n == PACKET_SIZE ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+
+	// interval of the inverse directions; only meaningful when every ray
+	// points the same way along each axis
+	float inv[3][PACKET_SIZE];
+	float invLo[3], invHi[3];
+	float rayT[PACKET_SIZE];
+	bool positive[3];
+	for (int a = 0; a < 3; a++)
+	{
+		float dMin = packet->dir[a][0], dMax = packet->dir[a][0];
+		for (int i = 0; i < n; i++)
+		{
+			float d = packet->dir[a][i];
+			dMin = std::min(dMin, d);
+			dMax = std::max(dMax, d);
+			if (std::abs(d) < 1e-30f)
+				d = d < 0 ? -1e-30f : 1e-30f;
+			inv[a][i] = 1/d;
+		}
+		if (!(dMin > 0 || dMax < 0))
+		{
+			traceSingly(bvh, objects, packet, 0, all);
+			return;
+		}
+
+		positive[a] = dMin > 0;
+		invLo[a] = 1/dMax;
+		invHi[a] = 1/dMin;
+
+		// unused lanes get a negative range so that they never enter a node
+		for (int i = n; i < PACKET_SIZE; i++)
+			inv[a][i] = 1;
+	}
+
+	// the node test always runs over the whole packet; rayT mirrors
+	// packet->t with the unused lanes filled in
+	for (int i = 0; i < PACKET_SIZE; i++)
+		rayT[i] = i < n ? packet->t[i] : -1;
+
+	float maxBest = furthest(packet);
+	int stack[BVH_MAX_DEPTH + 1];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	while (sp > 0)
+	{
+		int index = stack[--sp];
+		const BVHNode &node = bvh->nodes[index];
+
+		// conservative entry and exit over every direction of the packet; if
+		// they do not overlap, no ray of the packet can enter the node
+		float lowNear = 0, highFar = maxBest;
+		for (int a = 0; a < 3; a++)
+		{
+			float entry = (positive[a] ? node.min[a] : node.max[a]) - o[a];
+			float exit = (positive[a] ? node.max[a] : node.min[a]) - o[a];
+			lowNear = std::max(lowNear, std::min(entry*invLo[a], entry*invHi[a]));
+			highFar = std::min(highFar, std::max(exit*invLo[a], exit*invHi[a]));
+		}
+		if (lowNear > highFar)
+			continue;
+
+		// exact test of every ray against the node, fetched once for all of them
+		float nearD[3], farD[3];
+		for (int a = 0; a < 3; a++)
+		{
+			nearD[a] = (positive[a] ? node.min[a] : node.max[a]) - o[a];
+			farD[a] = (positive[a] ? node.max[a] : node.min[a]) - o[a];
+		}
+		uint64_t active = nodeTest(nearD, farD, inv, rayT);
+		if (!active)
+			continue;
+
+		if (node.count > 0)
+		{
+			for (uint64_t m = active; m; m &= m - 1)
+			{
+				int i = __builtin_ctzll(m);
+				int hit = IntersectLeaf(bvh, objects, packetRay(packet, i), o, node.first, node.count,
+										-1, &packet->t[i]);
+				if (hit >= 0)
+				{
+					rayT[i] = packet->t[i];
+					packet->hit[i] = hit;
+				}
+			}
+			maxBest = furthest(packet);
+		}
+		else if (__builtin_popcountll(active) <= PACKET_MIN_RAYS)
+		{
+			// the packet has diverged, carrying it further only costs tests
+			traceSingly(bvh, objects, packet, index, active);
+			std::copy(packet->t, packet->t + n, rayT);
+			maxBest = furthest(packet);
+		}
+		else
+		{
+			// push the far child first, judged along the packet's first ray
+			vec3 d = packetRay(packet, 0);
+			const BVHNode &a = bvh->nodes[node.first];
+			const BVHNode &b = bvh->nodes[node.first + 1];
+			float da = dot((a.min + a.max)*0.5f - o, d);
+			float db = dot((b.min + b.max)*0.5f - o, d);
+			stack[sp++] = da < db ? node.first + 1 : node.first;
+			stack[sp++] = da < db ? node.first : node.first + 1;
+		}
+	}
+}
@@ -0,0 +1,36 @@
+// ==========================================================================
+// Coherent ray packets
+//
+// Camera rays through neighbouring pixels share their origin and point in
+// nearly the same direction, so an 8x8 block of them is traversed through the
+// BVH together: every node is fetched once for the whole packet and culled
+// with interval arithmetic over the packet's directions before any single
+// ray is tested.
+// ==========================================================================
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "bvh.h"
+
+#define PACKET_WIDTH 8
+#define PACKET_SIZE (PACKET_WIDTH*PACKET_WIDTH)
+
+// rays leaving one origin, stored as arrays
+struct RayPacket
+{
+	glm::vec3 origin;
+	int count;
+	float dir[3][PACKET_SIZE];
+	float t[PACKET_SIZE];		// in: furthest distance of interest, out: closest hit
+	int hit[PACKET_SIZE];		// out: object hit, -1 if none
+};
+
+// closest hit of every ray of the packet, equivalent to IntersectClosest()
+// with nothing ignored; rays whose directions differ in sign along an axis
+// are traced one at a time
+void IntersectPacket(const BVH *bvh, const std::vector<object> &objects,
+					const std::vector<glm::vec3> &normals, RayPacket *packet);
+
+#endif
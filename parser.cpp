@@ -0,0 +1,926 @@
+// ==========================================================================
+// Text scene parser
+// ==========================================================================
+
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "glm/glm.hpp"
+#include "mesh.h"
+#include "parser.h"
+#include "scheduler.h"
+
+using namespace std;
+using namespace glm;
+
+// numbers an object block holds at most (a triangle)
+#define OBJECT_NUMBERS 13
+
+// text parsed by one task; files larger than this are parsed on every core
+#define PARSE_CHUNK_BYTES (4 << 20)
+
+// --------------------------------------------------------------------------
+// Tokenizer
+
+struct token
+{
+	const char *begin;
+	const char *end;
+	int line;
+};
+
+struct scanner
+{
+	const char *p;
+	const char *end;
+	int line;
+};
+
+// spaces, tabs, line breaks and any other control character
+static bool isSpace(char c)
+{
+	return (unsigned char)c <= ' ';
+}
+
+static bool isDelimiter(char c)
+{
+	return isSpace(c) || c == '{' || c == '}';
+}
+
+static bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// moves past spaces, line breaks and comments
+static void skipSpace(scanner *s)
+{
+	const char *p = s->p, *end = s->end;
+	for (;;)
+	{
+		while (p < end && isSpace(*p))
+			s->line += *p++ == '\n';
+		if (p < end && *p == '#')
+		{
+			const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+			p = newline ? newline : end;
+			continue;
+		}
+		break;
+	}
+	s->p = p;
+}
+
+// the token starting at the current position, without moving past it
+static token peekToken(const scanner *s)
+{
+	token t;
+	const char *p = s->p, *end = s->end;
+	t.begin = p;
+	t.line = s->line;
+	if (p < end && (*p == '{' || *p == '}'))
+		p++;
+	else
+		while (p < end && !isDelimiter(*p))
+			p++;
+	t.end = p;
+	return t;
+}
+
+// moves to the next token and returns false at the end of the text; braces
+// are tokens of their own
+static bool nextToken(scanner *s, token *t)
+{
+	skipSpace(s);
+	*t = peekToken(s);
+	s->p = t->end;
+	return t->begin < s->end;
+}
+
+static bool is(const token &t, const char *word)
+{
+	size_t length = strlen(word);
+	return (size_t)(t.end - t.begin) == length && memcmp(t.begin, word, length) == 0;
+}
+
+static string text(const token &t)
+{
+	return string(t.begin, t.end);
+}
+
+// --------------------------------------------------------------------------
+// Numbers
+
+// reads a plain decimal at p the way strtof() would, setting stop past it;
+// returns false if there is none or it needs strtof(). Mantissa and power
+// of ten are exact doubles, so d is the decimal correctly rounded to
+// double, and rounding d on to float gives what strtof() does unless d
+// sits exactly halfway between two floats.
+static bool fastFloat(const char *p, const char *end, const char **stop, float *value)
+{
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+
+	// two digits per step halve the chain of dependent multiplies
+	uint64_t mantissa = 0;
+	const char *first = p;
+	while (p + 1 < end && isDigit(p[0]) && isDigit(p[1]))
+	{
+		mantissa = mantissa*100 + (p[0] - '0')*10 + (p[1] - '0');
+		p += 2;
+	}
+	if (p < end && isDigit(*p))
+		mantissa = mantissa*10 + (*p++ - '0');
+	int digits = p - first, exponent = 0;
+
+	if (p < end && *p == '.')
+	{
+		const char *fraction = ++p;
+		while (p + 1 < end && isDigit(p[0]) && isDigit(p[1]))
+		{
+			mantissa = mantissa*100 + (p[0] - '0')*10 + (p[1] - '0');
+			p += 2;
+		}
+		if (p < end && isDigit(*p))
+			mantissa = mantissa*10 + (*p++ - '0');
+		exponent = fraction - p;
+		digits -= exponent;
+	}
+
+	if (digits > 0 && p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char *q = p + 1;
+		bool negativeExponent = q < end && *q == '-';
+		if (q < end && (*q == '-' || *q == '+'))
+			q++;
+		int e = 0;
+		const char *start = q;
+		for (; q < end && isDigit(*q) && e < 10000; q++)
+			e = e*10 + (*q - '0');
+		if (q > start)
+		{
+			exponent += negativeExponent ? -e : e;
+			p = q;
+		}
+	}
+
+	if (digits == 0 || digits > 19 || mantissa >= (1ull << 53) || exponent < -22 || exponent > 22)
+		return false;
+
+	double d = exponent < 0 ? mantissa/powers[-exponent] : mantissa*powers[exponent];
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	if (mantissa != 0 && (bits & ((1ull << 29) - 1)) == (1ull << 28))
+		return false;
+
+	*value = negative ? -(float)d : (float)d;
+	*stop = p;
+	return true;
+}
+
+// reads a whole token as a float, rounded like strtof()
+static bool parseFloat(const token &t, float *value)
+{
+	const char *stop;
+	if (fastFloat(t.begin, t.end, &stop, value) && stop == t.end)
+		return true;
+
+	// long mantissas, big exponents, inf and nan
+	char buffer[64];
+	size_t length = t.end - t.begin;
+	if (length == 0 || length >= sizeof(buffer))
+		return false;
+	memcpy(buffer, t.begin, length);
+	buffer[length] = 0;
+	char *end;
+	*value = strtof(buffer, &end);
+	return end == buffer + length;
+}
+
+// reads the next token as a number, converting it while scanning it;
+// returns false without moving past the token if it is not a number
+static bool nextNumber(scanner *s, float *value)
+{
+	skipSpace(s);
+	const char *stop;
+	if (fastFloat(s->p, s->end, &stop, value) && (stop == s->end || isDelimiter(*stop)))
+	{
+		s->p = stop;
+		return true;
+	}
+
+	token t = peekToken(s);
+	if (t.begin == t.end || !parseFloat(t, value))
+		return false;
+	s->p = t.end;
+	return true;
+}
+
+bool ParseNumber(const char *p, const char *end, const char **stop, float *value)
+{
+	if (fastFloat(p, end, stop, value))
+		return true;
+
+	token t;
+	t.begin = t.end = p;
+	while (t.end < end && !isDelimiter(*t.end))
+		t.end++;
+	if (t.begin == t.end || !parseFloat(t, value))
+		return false;
+	*stop = t.end;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Blocks
+
+// material properties a block can set
+enum MaterialProperty
+{
+	MATERIAL_SPEC,
+	MATERIAL_PHONG,
+	MATERIAL_REFLECTANCE,
+	MATERIAL_REFRACTION,
+	MATERIAL_PROPERTIES
+};
+
+// name a mesh block gives its mesh, for instance blocks to refer to
+struct meshName
+{
+	string name;
+	int mesh;		// in the chunk
+	int line;		// counted from the start of the chunk
+};
+
+// file of a mesh block, read once every chunk is parsed
+struct meshFile
+{
+	string file;
+	int line;		// counted from the start of the chunk
+};
+
+// instance block, resolved once every chunk's mesh names are known
+struct pendingInstance
+{
+	string mesh;
+	mat4x3 transform;
+	int line;		// counted from the start of the chunk, then of the file
+};
+
+// a run of whole blocks of the text and what it holds. A chunk does not
+// know the material in effect where it starts, so it notes which
+// properties its own material blocks set, and from which of its objects and
+// meshes on.
+struct parseChunk
+{
+	const char *begin;
+	const char *end;
+
+	vector<object> objects;
+	vector<Mesh> meshes;
+	vector<meshFile> meshFiles;				// of every mesh
+	vector<meshName> meshNames;
+	vector<pendingInstance> instances;
+	vector<float> lights;
+	vector<float> lightIntensities;
+	Material material;						// properties the chunk set, at its end
+	int firstObject[MATERIAL_PROPERTIES];	// first object with the chunk's value, -1 if never set
+	int firstMesh[MATERIAL_PROPERTIES];		// first mesh with it
+	int lines;								// line breaks in the chunk
+
+	bool parsed;
+	int errorLine;							// counted from the start of the chunk
+	string error;
+
+	parseChunk() : begin(0), end(0), lines(0), parsed(false), errorLine(0)
+	{
+		for (int i = 0; i < MATERIAL_PROPERTIES; i++)
+			firstObject[i] = firstMesh[i] = -1;
+	}
+};
+
+struct parseState
+{
+	scanner s;
+	parseChunk *chunk;
+	const string *directory;		// mesh files are found relative to
+};
+
+static bool fail(parseState *state, int line, const string &message)
+{
+	state->chunk->errorLine = line;
+	state->chunk->error = message;
+	return false;
+}
+
+static void setProperty(parseState *state, MaterialProperty property)
+{
+	parseChunk *chunk = state->chunk;
+	if (chunk->firstObject[property] < 0)
+	{
+		chunk->firstObject[property] = chunk->objects.size();
+		chunk->firstMesh[property] = chunk->meshes.size();
+	}
+}
+
+// the material of the defaults of the format
+static Material defaultMaterial()
+{
+	Material m;
+	m.spec = vec4(1);
+	m.phong = 1;
+	m.reflectance = 0;
+	m.refraction = 1;
+	m.transparency = 0;
+	return m;
+}
+
+// reads the '{' after a keyword
+static bool openBlock(parseState *state, const token &keyword)
+{
+	token t;
+	if (!nextToken(&state->s, &t) || !is(t, "{"))
+		return fail(state, keyword.line, "expected '{' after " + text(keyword));
+	return true;
+}
+
+// reads the number after a property name
+static bool readNumber(parseState *state, const token &property, float *value)
+{
+	if (!nextNumber(&state->s, value))
+		return fail(state, property.line, "expected a number after " + text(property));
+	return true;
+}
+
+static bool parseObject(parseState *state, const token &keyword)
+{
+	if (!openBlock(state, keyword))
+		return false;
+
+	float info[OBJECT_NUMBERS] = {};
+	int count = 0;
+	scanner *s = &state->s;
+	for (;;)
+	{
+		skipSpace(s);
+		if (s->p == s->end)
+			return fail(state, keyword.line, text(keyword) + " block is not closed");
+		if (*s->p == '}')
+		{
+			s->p++;
+			break;
+		}
+		if (count == OBJECT_NUMBERS)
+			return fail(state, s->line, "too many numbers in " + text(keyword));
+		if (!nextNumber(s, &info[count++]))
+			return fail(state, s->line, "expected a number in " + text(keyword)
+				+ ", got '" + text(peekToken(s)) + "'");
+	}
+
+	object o;
+	if (is(keyword, "sphere"))
+	{
+		o.type = SPHERE_TYPE;
+		o.x = vec3(info[0], info[1], info[2]);
+		o.y = vec3(info[3], 0, 0);
+		o.z = vec3(0);
+		o.color = vec4(info[4], info[5], info[6], info[7]);
+	}
+	else if (is(keyword, "plane"))
+	{
+		o.type = PLANE_TYPE;
+		o.x = vec3(info[0], info[1], info[2]);
+		o.y = vec3(info[3], info[4], info[5]);
+		o.z = vec3(0);
+		o.color = vec4(info[6], info[7], info[8], info[9]);
+	}
+	else
+	{
+		o.type = TRIANGLE_TYPE;
+		o.x = vec3(info[0], info[1], info[2]);
+		o.y = vec3(info[3], info[4], info[5]);
+		o.z = vec3(info[6], info[7], info[8]);
+		o.color = vec4(info[9], info[10], info[11], info[12]);
+	}
+
+	const Material &m = state->chunk->material;
+	o.specularity = m.spec;
+	o.shininess = m.phong;
+	o.reflectance = m.reflectance;
+	o.refraction = m.refraction;
+	state->chunk->objects.push_back(o);
+	return true;
+}
+
+static bool parseMaterial(parseState *state, const token &keyword)
+{
+	if (!openBlock(state, keyword))
+		return false;
+
+	Material &m = state->chunk->material;
+	token t;
+	for (;;)
+	{
+		if (!nextToken(&state->s, &t))
+			return fail(state, keyword.line, "material block is not closed");
+		if (is(t, "}"))
+			return true;
+
+		float value;
+		if (is(t, "phong:"))
+		{
+			if (!readNumber(state, t, &value))
+				return false;
+			m.phong = (int)value;
+			setProperty(state, MATERIAL_PHONG);
+		}
+		else if (is(t, "spec:"))
+		{
+			// components left out repeat the last one given
+			int i = 0;
+			for (; i < 4 && nextNumber(&state->s, &value); i++)
+				m.spec[i] = value;
+			if (i == 0)
+				return fail(state, t.line, "expected a number after spec:");
+			for (; i < 4; i++)
+				m.spec[i] = m.spec[i - 1];
+			setProperty(state, MATERIAL_SPEC);
+		}
+		else if (is(t, "reflectance:"))
+		{
+			if (!readNumber(state, t, &m.reflectance))
+				return false;
+			setProperty(state, MATERIAL_REFLECTANCE);
+		}
+		else if (is(t, "refraction:"))
+		{
+			if (!readNumber(state, t, &m.refraction))
+				return false;
+			setProperty(state, MATERIAL_REFRACTION);
+		}
+	}
+}
+
+static bool parseMesh(parseState *state, const token &keyword)
+{
+	if (!openBlock(state, keyword))
+		return false;
+
+	string file, name;
+	vec4 color(1, 1, 1, 0);
+	token t;
+	for (;;)
+	{
+		if (!nextToken(&state->s, &t))
+			return fail(state, keyword.line, "mesh block is not closed");
+		if (is(t, "}"))
+			break;
+
+		if (is(t, "file:"))
+		{
+			if (!nextToken(&state->s, &t) || is(t, "}"))
+				return fail(state, t.line, "expected a file after file:");
+			file = text(t);
+		}
+		else if (is(t, "color:"))
+		{
+			float value;
+			for (int i = 0; i < 4 && nextNumber(&state->s, &value); i++)
+				color[i] = value;
+		}
+		else if (is(t, "name:"))
+		{
+			if (!nextToken(&state->s, &t) || is(t, "}"))
+				return fail(state, t.line, "expected a name after name:");
+			name = text(t);
+		}
+	}
+	if (file.empty())
+		return fail(state, keyword.line, "mesh block has no file");
+	if (file[0] != '/' && !state->directory->empty())
+		file = *state->directory + "/" + file;
+
+	// the file is read by ParseScene(), after the chunks
+	parseChunk *chunk = state->chunk;
+	chunk->meshes.push_back(Mesh());
+	Mesh &mesh = chunk->meshes.back();
+	mesh.color = color;
+	mesh.material = chunk->material;
+	meshFile read = { file, keyword.line };
+	chunk->meshFiles.push_back(read);
+
+	// a named mesh is only shown where instances place it
+	if (!name.empty())
+	{
+		mesh.placed = false;
+		meshName named = { name, (int)chunk->meshes.size() - 1, keyword.line };
+		chunk->meshNames.push_back(named);
+	}
+	return true;
+}
+
+static bool parseInstance(parseState *state, const token &keyword)
+{
+	if (!openBlock(state, keyword))
+		return false;
+
+	pendingInstance instance;
+	instance.transform = mat4x3(1.f);
+	instance.line = keyword.line;
+	token t;
+	for (;;)
+	{
+		if (!nextToken(&state->s, &t))
+			return fail(state, keyword.line, "instance block is not closed");
+		if (is(t, "}"))
+			break;
+
+		if (is(t, "mesh:"))
+		{
+			if (!nextToken(&state->s, &t) || is(t, "}"))
+				return fail(state, t.line, "expected a mesh name after mesh:");
+			instance.mesh = text(t);
+		}
+		else if (is(t, "transform:"))
+		{
+			// three rows of four, the last column translating
+			for (int row = 0; row < 3; row++)
+				for (int column = 0; column < 4; column++)
+					if (!readNumber(state, t, &instance.transform[column][row]))
+						return false;
+			if (determinant(mat3(instance.transform)) == 0)
+				return fail(state, t.line, "transform cannot be inverted");
+		}
+	}
+	if (instance.mesh.empty())
+		return fail(state, keyword.line, "instance block has no mesh");
+
+	state->chunk->instances.push_back(instance);
+	return true;
+}
+
+static bool parseLight(parseState *state, const token &keyword)
+{
+	if (!openBlock(state, keyword))
+		return false;
+
+	vec3 position(0);
+	float intensity = 1;
+	token t;
+	for (;;)
+	{
+		if (!nextToken(&state->s, &t))
+			return fail(state, keyword.line, "light block is not closed");
+		if (is(t, "}"))
+			break;
+
+		if (is(t, "position:"))
+		{
+			for (int i = 0; i < 3; i++)
+				if (!readNumber(state, t, &position[i]))
+					return false;
+		}
+		else if (is(t, "intensity:"))
+		{
+			if (!readNumber(state, t, &intensity))
+				return false;
+		}
+	}
+
+	for (int i = 0; i < 3; i++)
+		state->chunk->lights.push_back(position[i]);
+	state->chunk->lightIntensities.push_back(intensity);
+	return true;
+}
+
+// parses the blocks of one chunk
+static void parseBlocks(parseChunk *chunk, const string &directory)
+{
+	parseState state;
+	state.s.p = chunk->begin;
+	state.s.end = chunk->end;
+	state.s.line = 1;
+	state.chunk = chunk;
+	state.directory = &directory;
+	chunk->material = defaultMaterial();
+
+	// anything outside a block that is not a keyword is skipped
+	token t;
+	while (nextToken(&state.s, &t))
+	{
+		bool parsed = true;
+		if (is(t, "sphere") || is(t, "plane") || is(t, "triangle"))
+			parsed = parseObject(&state, t);
+		else if (is(t, "material"))
+			parsed = parseMaterial(&state, t);
+		else if (is(t, "light"))
+			parsed = parseLight(&state, t);
+		else if (is(t, "mesh"))
+			parsed = parseMesh(&state, t);
+		else if (is(t, "instance"))
+			parsed = parseInstance(&state, t);
+		if (!parsed)
+			return;
+	}
+	chunk->lines = state.s.line - 1;
+	chunk->parsed = true;
+}
+
+// --------------------------------------------------------------------------
+// Chunks
+
+// true if a block keyword starts the line at p
+static bool blockStart(const char *p, const char *end)
+{
+	static const char *keywords[] = { "sphere", "plane", "triangle", "light", "material", "mesh",
+		"instance" };
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	for (int i = 0; i < 7; i++)
+	{
+		size_t length = strlen(keywords[i]);
+		if ((size_t)(end - p) >= length && memcmp(p, keywords[i], length) == 0
+			&& (p + length == end || isDelimiter(p[length])))
+			return true;
+	}
+	return false;
+}
+
+// start of the first line at or after from that begins a block, or end;
+// keywords only appear inside blocks in broken scenes, so a chunk starting
+// there starts between blocks
+static const char *nextBlockLine(const char *from, const char *begin, const char *end)
+{
+	const char *p = from;
+	if (p > begin && p[-1] != '\n')
+	{
+		p = static_cast<const char *>(memchr(p, '\n', end - p));
+		p = p ? p + 1 : end;
+	}
+	while (p < end && !blockStart(p, end))
+	{
+		p = static_cast<const char *>(memchr(p, '\n', end - p));
+		p = p ? p + 1 : end;
+	}
+	return p;
+}
+
+// true if object or mesh k of a chunk, whose firsts are given, comes before
+// the chunk sets property
+static bool incomingProperty(const int *first, int property, int k)
+{
+	return first[property] < 0 || k < first[property];
+}
+
+// gives object or mesh k of a chunk the material in effect where the chunk
+// starts, for the properties the chunk has not set by then
+static void applyIncoming(const int *first, const Material &incoming, int k, vec4 *spec,
+						int *phong, float *reflectance, float *refraction)
+{
+	if (incomingProperty(first, MATERIAL_SPEC, k))
+		*spec = incoming.spec;
+	if (incomingProperty(first, MATERIAL_PHONG, k))
+		*phong = incoming.phong;
+	if (incomingProperty(first, MATERIAL_REFLECTANCE, k))
+		*reflectance = incoming.reflectance;
+	if (incomingProperty(first, MATERIAL_REFRACTION, k))
+		*refraction = incoming.refraction;
+}
+
+// copies the objects of a parsed chunk into the scene from out on
+static void mergeChunk(const parseChunk &chunk, const Material &incoming, object *out)
+{
+	for (int k = 0; k < (int)chunk.objects.size(); k++)
+	{
+		object o = chunk.objects[k];
+		applyIncoming(chunk.firstObject, incoming, k, &o.specularity, &o.shininess,
+					&o.reflectance, &o.refraction);
+		out[k] = o;
+	}
+}
+
+// the material in effect after the chunk
+static Material outgoingMaterial(const parseChunk &chunk, Material m)
+{
+	if (chunk.firstObject[MATERIAL_SPEC] >= 0)
+		m.spec = chunk.material.spec;
+	if (chunk.firstObject[MATERIAL_PHONG] >= 0)
+		m.phong = chunk.material.phong;
+	if (chunk.firstObject[MATERIAL_REFLECTANCE] >= 0)
+		m.reflectance = chunk.material.reflectance;
+	if (chunk.firstObject[MATERIAL_REFRACTION] >= 0)
+		m.refraction = chunk.material.refraction;
+	return m;
+}
+
+bool ParseScene(const char *text, size_t length, vector<object> *objects, vector<Mesh> *meshes,
+				vector<float> *lights, vector<float> *lightIntensities, string *error,
+				const string &directory)
+{
+	// split the text into chunks of about PARSE_CHUNK_BYTES that start
+	// between blocks
+	const char *end = text + length;
+	vector<parseChunk> chunks(1);
+	chunks[0].begin = text;
+	for (size_t at = PARSE_CHUNK_BYTES; at < length; at += PARSE_CHUNK_BYTES)
+	{
+		const char *boundary = nextBlockLine(text + at, text, end);
+		if (boundary <= chunks.back().begin || boundary == end)
+			continue;
+		chunks.back().end = boundary;
+		chunks.push_back(parseChunk());
+		chunks.back().begin = boundary;
+	}
+	chunks.back().end = end;
+
+	int count = chunks.size();
+	TilePool *pool = count > 1 ? CreateTilePool(0) : 0;
+	if (pool)
+		RunTiles(pool, count, [&](int i) { parseBlocks(&chunks[i], directory); });
+	else
+		parseBlocks(&chunks[0], directory);
+
+	// mesh files are read one after another, each on the whole pool; read
+	// from the chunk tasks they would start a pool per chunk
+	bool meshFiles = false;
+	for (int i = 0; i < count; i++)
+		meshFiles |= !chunks[i].meshFiles.empty();
+	if (meshFiles && !pool)
+		pool = CreateTilePool(0);
+
+	// thread the material through the chunks in file order
+	vector<Material> incoming(count);
+	vector<size_t> offsets(count);
+	Material material = defaultMaterial();
+	size_t total = objects->size();
+	int line = 1;
+	map<string, int> named;
+	vector<pendingInstance> instances;
+	for (int i = 0; i < count; i++)
+	{
+		parseChunk &chunk = chunks[i];
+		for (size_t k = 0; k < chunk.meshFiles.size(); k++)
+		{
+			const meshFile &file = chunk.meshFiles[k];
+			if (!chunk.parsed && file.line > chunk.errorLine)
+				break;
+			Mesh &mesh = chunk.meshes[k];
+			string meshError;
+			if (!LoadMesh(file.file, mesh.color, mesh.material, &mesh, &meshError, pool))
+			{
+				chunk.parsed = false;
+				chunk.errorLine = file.line;
+				chunk.error = file.file + ", " + meshError;
+				break;
+			}
+		}
+		if (!chunk.parsed)
+		{
+			ostringstream out;
+			out << "line " << line + chunk.errorLine - 1 << ": " << chunk.error;
+			*error = out.str();
+			DestroyTilePool(pool);
+			return false;
+		}
+		incoming[i] = material;
+		offsets[i] = total;
+		material = outgoingMaterial(chunk, material);
+		total += chunk.objects.size();
+
+		for (size_t k = 0; k < chunk.meshNames.size(); k++)
+		{
+			const meshName &mesh = chunk.meshNames[k];
+			if (!named.insert(make_pair(mesh.name, (int)meshes->size() + mesh.mesh)).second)
+			{
+				ostringstream out;
+				out << "line " << line + mesh.line - 1 << ": mesh name " << mesh.name << " is taken";
+				*error = out.str();
+				DestroyTilePool(pool);
+				return false;
+			}
+		}
+		for (size_t k = 0; k < chunk.instances.size(); k++)
+		{
+			instances.push_back(chunk.instances[k]);
+			instances.back().line += line - 1;
+		}
+		line += chunk.lines;
+
+		for (int k = 0; k < (int)chunk.meshes.size(); k++)
+		{
+			Material &m = chunk.meshes[k].material;
+			applyIncoming(chunk.firstMesh, incoming[i], k, &m.spec, &m.phong, &m.reflectance, &m.refraction);
+			meshes->push_back(std::move(chunk.meshes[k]));
+		}
+		lights->insert(lights->end(), chunk.lights.begin(), chunk.lights.end());
+		lightIntensities->insert(lightIntensities->end(), chunk.lightIntensities.begin(),
+								chunk.lightIntensities.end());
+	}
+
+	// instances may name meshes further down the file
+	for (size_t k = 0; k < instances.size(); k++)
+	{
+		map<string, int>::iterator found = named.find(instances[k].mesh);
+		if (found == named.end())
+		{
+			ostringstream out;
+			out << "line " << instances[k].line << ": no mesh is named " << instances[k].mesh;
+			*error = out.str();
+			DestroyTilePool(pool);
+			return false;
+		}
+		(*meshes)[found->second].instances.push_back(instances[k].transform);
+	}
+
+	// every primitive must have a number
+	long long primitives = total;
+	for (size_t m = 0; m < meshes->size(); m++)
+	{
+		const Mesh &mesh = (*meshes)[m];
+		primitives += (long long)mesh.indices.size()/3*(mesh.placed + mesh.instances.size());
+	}
+	if (primitives > INT_MAX)
+	{
+		*error = "the scene holds more than 2^31 primitives";
+		DestroyTilePool(pool);
+		return false;
+	}
+
+	// the first chunk starts with the default material, so it is used as it
+	// is when nothing comes before it rather than copied
+	int from = 0;
+	if (objects->empty())
+	{
+		objects->swap(chunks[0].objects);
+		from = 1;
+	}
+	objects->resize(total);
+	object *out = objects->data();
+	if (pool)
+		RunTiles(pool, count - from, [&](int i)
+		{
+			mergeChunk(chunks[from + i], incoming[from + i], out + offsets[from + i]);
+			vector<object>().swap(chunks[from + i].objects);
+		});
+	else if (from == 0)
+		mergeChunk(chunks[0], incoming[0], out + offsets[0]);
+
+	DestroyTilePool(pool);
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Files
+
+bool parser(string file, vector<object> *objects, vector<Mesh> *meshes, vector<float> *lights,
+			vector<float> *lightIntensities)
+{
+	int fd = open(file.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		cerr << "unable to open input file " << file << "\n";
+		return false;
+	}
+
+	// an empty file cannot be mapped, and holds an empty scene
+	size_t size = info.st_size;
+	void *mapping = size ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		cerr << "unable to read input file " << file << "\n";
+		return false;
+	}
+
+	// meshes are found next to the scene
+	size_t slash = file.rfind('/');
+	string directory = slash == string::npos ? "" : file.substr(0, slash);
+
+	string error;
+	bool parsed = ParseScene(static_cast<const char *>(mapping), size, objects, meshes, lights,
+							lightIntensities, &error, directory);
+	if (mapping)
+		munmap(mapping, size);
+
+	if (!parsed)
+		cerr << file << ", " << error << "\n";
+	return parsed;
+}
@@ -0,0 +1,52 @@
+// ==========================================================================
+// Text scene parser
+//
+// Reads the scene format of Scenes/*.txt in one pass over the file in
+// memory. Blocks are a keyword, '{', their contents and '}', on as many or
+// as few lines as wanted; '#' starts a comment running to the end of the
+// line:
+//
+//     light    { position: x y z  intensity: i }
+//     material { phong: n  spec: r g b [a]  reflectance: f  refraction: f }
+//     sphere   { x y z  r  r g b a }
+//     plane    { xn yn zn  xq yq zq  r g b a }
+//     triangle { x1 y1 z1  x2 y2 z2  x3 y3 z3  r g b a }
+//     mesh     { file: name.obj  color: r g b [a]  name: n }
+//     instance { mesh: n  transform: m00 m01 m02 tx  m10 m11 m12 ty  m20 m21 m22 tz }
+//
+// A material applies to the objects after it and only changes the
+// properties it names; unknown properties are skipped. Missing object
+// numbers are zero. A mesh reads an OBJ or PLY file (see mesh.h), relative
+// to the scene file, into an indexed mesh; its colour defaults to opaque
+// white. A named mesh is not shown itself but placed by every instance
+// block naming it, anywhere in the file, under the instance's transform
+// (the identity if none is given; see instances.h).
+//
+// Large files are split between blocks and the pieces parsed on every core;
+// the result is the same as parsing the file in one go.
+// ==========================================================================
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <string>
+#include <vector>
+#include "scene.h"
+
+// parse a text scene held in memory, appending to the output; on failure
+// error holds the line and cause of the first problem. Mesh files are looked
+// for relative to directory.
+bool ParseScene(const char *text, size_t length, std::vector<object> *objects,
+				std::vector<Mesh> *meshes, std::vector<float> *lights,
+				std::vector<float> *lightIntensities, std::string *error,
+				const std::string &directory = "");
+
+// read the number at p the way strtof() does, setting stop past it; returns
+// false if there is none
+bool ParseNumber(const char *p, const char *end, const char **stop, float *value);
+
+// parse a text scene file, printing any error; lights holds three floats per
+// light
+bool parser(std::string file, std::vector<object> *objects, std::vector<Mesh> *meshes,
+			std::vector<float> *lights, std::vector<float> *lightIntensities);
+
+#endif
@@ -0,0 +1,646 @@
+// ==========================================================================
+// Headless CPU ray tracer
+//
+// Every function in the shading section has a counterpart of the same name
+// in fragment.glsl and follows it step by step, including its quirks, so the
+// CPU and GPU paths produce the same picture.
+// ==========================================================================
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include "raytracer.h"
+#include "intersect.h"
+#include "mesh.h"
+#include "simd.h"
+#include "packet.h"
+
+using namespace std;
+using namespace glm;
+
+static const float PI = 3.14159265359f;
+
+// per-ray state that the shader keeps in uniforms
+struct TraceContext
+{
+	const TraceScene *scene;
+	vec3 cameraPos;
+	int maxBounces;
+	RayCounts *rays;	// counts of the tile being traced, or null
+};
+
+struct lightRay
+{
+	vec4 color;
+	float distance;
+	int object;
+};
+
+struct reflection
+{
+	vec3 ray;
+	vec3 n;
+};
+
+// --------------------------------------------------------------------------
+// Scene preparation
+
+bool InitializeTraceScene(TraceScene *scene, const vector<object> &objects,
+						const vector<Mesh> &meshes, const vector<float> &lights,
+						const vector<float> &lightIntensities,
+						float ambientLight, TraversalKernel kernel)
+{
+	if (lights.size() % 3 != 0)
+	{
+		cout << "Light positions must come in groups of three" << endl;
+		return false;
+	}
+
+	scene->objects = objects;
+	scene->meshes = meshes;
+	scene->meshStarts = MeshStarts(objects.size(), meshes);
+	scene->ambientLight = ambientLight;
+
+	scene->lights.clear();
+	for (int i = 0; i + 2 < (int)lights.size(); i += 3)
+		scene->lights.push_back(vec3(lights[i], lights[i+1], lights[i+2]));
+	scene->lightIntensities = lightIntensities;
+	scene->lightIntensities.resize(scene->lights.size(), 1);
+
+	scene->normals.resize(objects.size());
+	for (int i = 0; i < (int)objects.size(); i++)
+	{
+		const object &o = objects[i];
+		vec3 n = vec3(0);
+		if (o.type == PLANE_TYPE)
+			n = o.x;
+		else if (o.type == TRIANGLE_TYPE)
+			n = cross(o.y - o.x, o.z - o.x);
+		if (o.type != SPHERE_TYPE)
+			n = n/sqrt(dot(n, n));
+		scene->normals[i] = n;
+	}
+
+	if (kernel == KERNEL_AUTO)
+		kernel = DetectSimdLevel() >= SIMD_AVX2 ? KERNEL_BVH8 : KERNEL_BVH4;
+	scene->kernel = kernel;
+
+	BuildBVH(&scene->bvh, scene->objects, scene->meshes);
+	BuildInstanceBVH(&scene->instances, scene->meshes, scene->meshStarts.back());
+	scene->bvh4.nodes.clear();
+	scene->bvh8.nodes.clear();
+	if (kernel == KERNEL_BVH4)
+		BuildWideBVH(&scene->bvh4, &scene->bvh);
+	else if (kernel == KERNEL_BVH8)
+		BuildWideBVH(&scene->bvh8, &scene->bvh);
+
+	return true;
+}
+
+bool ParseTraversalKernel(const char *name, TraversalKernel *kernel)
+{
+	static const TraversalKernel kernels[] = {KERNEL_AUTO, KERNEL_BINARY, KERNEL_BVH4, KERNEL_BVH8};
+	for (int i = 0; i < 4; i++)
+		if (string(name) == TraversalKernelName(kernels[i]))
+		{
+			*kernel = kernels[i];
+			return true;
+		}
+	return false;
+}
+
+const char *TraversalKernelName(TraversalKernel kernel)
+{
+	switch (kernel)
+	{
+	case KERNEL_BINARY:
+		return "binary";
+	case KERNEL_BVH4:
+		return "bvh4";
+	case KERNEL_BVH8:
+		return "bvh8";
+	default:
+		return "auto";
+	}
+}
+
+// --------------------------------------------------------------------------
+// Intersection routines
+
+static float getMagnitude(vec3 v)
+{
+	return sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+}
+
+static vec3 calculateRay(const TraceCamera &camera, vec2 coords)
+{
+	float theta = camera.theta;
+	float phi = camera.phi;
+	mat3 ry = mat3	(cos(theta), 0, sin(theta),
+					 0, 1, 0,
+					 -sin(theta), 0, cos(theta));
+
+	mat3 rx = mat3 (1, 0, 0,
+					0, cos(phi), -sin(phi),
+					0, sin(phi), cos(phi));
+
+	float z = -1/tan(camera.fieldOfView/2);
+	vec3 ray = vec3(coords, z);
+
+	ray = ry*ray;
+	ray = rx*ray;
+
+	return ray/sqrt(dot(ray, ray));
+}
+
+// the object, mesh triangle or instance triangle numbered id
+static object primitive(const TraceScene *scene, int id)
+{
+	if (id >= scene->meshStarts.back())
+		return InstanceTriangle(&scene->instances, scene->meshes, id);
+	return ScenePrimitive(scene->objects, scene->meshes, scene->meshStarts, id);
+}
+
+// unit normal of a plane or triangle; those of mesh triangles are not kept
+static vec3 primitiveNormal(const TraceScene *scene, int id)
+{
+	if (id < (int)scene->objects.size())
+		return scene->normals[id];
+	object o = primitive(scene, id);
+	vec3 n = cross(o.y - o.x, o.z - o.x);
+	return n/sqrt(dot(n, n));
+}
+
+// lowers a closest hit found in the scene's trees to one among its
+// instances, if there is one closer
+static int closestInstance(const TraceScene *scene, vec3 ray, vec3 origin, int ignore,
+						float maxT, int hit, float *t)
+{
+	float best = hit >= 0 ? *t : maxT;
+	int instanceHit = IntersectInstances(&scene->instances, ray, origin, ignore, false, &best);
+	if (instanceHit < 0)
+		return hit;
+	*t = best;
+	return instanceHit;
+}
+
+// closest hit through the scene's traversal kernel
+static int closestHit(const TraceScene *scene, vec3 ray, vec3 origin, int ignore, float maxT, float *t)
+{
+	int hit;
+	if (scene->kernel == KERNEL_BVH8)
+		hit = IntersectClosest(&scene->bvh8, &scene->bvh, scene->objects, scene->normals,
+								ray, origin, ignore, maxT, t);
+	else if (scene->kernel == KERNEL_BVH4)
+		hit = IntersectClosest(&scene->bvh4, &scene->bvh, scene->objects, scene->normals,
+								ray, origin, ignore, maxT, t);
+	else
+		hit = IntersectClosest(&scene->bvh, scene->objects, scene->normals, ray, origin, ignore, maxT, t);
+	return closestInstance(scene, ray, origin, ignore, maxT, hit, t);
+}
+
+// closest object hit by the ray, ignoring object ob
+static lightRay getColour(const TraceContext &ctx, vec3 ray, vec3 position, int ob)
+{
+	const TraceScene *scene = ctx.scene;
+	lightRay info;
+	info.color = vec4(0);
+	info.distance = -1;
+
+	float t;
+	info.object = closestHit(scene, ray, position, ob, INFINITY, &t);
+	if (info.object >= 0)
+	{
+		info.color = primitive(scene, info.object).color;
+		info.distance = t;
+	}
+	return info;
+}
+
+// --------------------------------------------------------------------------
+// Shading routines
+
+static vec2 calculateShadow(const TraceContext &ctx, vec3 position, int j, int objectSeen)
+{
+	const TraceScene *scene = ctx.scene;
+	float shadow = 1;
+	vec3 darkRay = scene->lights[j]-position;
+
+	float maxT = getMagnitude(darkRay);
+
+	darkRay = darkRay/sqrt(dot(darkRay, darkRay));
+
+	position += darkRay*0.001f;
+
+	// the soft shadow term takes the distance and alpha of the closest
+	// occluder, so an occlusion query that stops at any would save nothing
+	float mt = -1;
+	if (ctx.rays)
+		ctx.rays->shadow++;
+	int objectHit = closestHit(scene, darkRay, position, -1, maxT, &mt);
+
+	if (objectHit >= 0)
+	{
+		object seen = primitive(scene, objectSeen);
+		if (seen.type == SPHERE_TYPE)
+		{
+			float diameter = 2*seen.y[0];
+
+			vec3 v = darkRay*mt;
+			float length = getMagnitude(v);
+
+			shadow *= sin(pow((diameter-length)/diameter*PI/2.f, 1.2f));
+		}
+		else
+		{
+			shadow *= (atan(mt*2+primitive(scene, objectHit).color[3])/(PI/2)*0.3f+0.7f);
+		}
+	}
+
+	return vec2(shadow, maxT);
+}
+
+static vec2 calculateShadows(const TraceContext &ctx, vec3 ray, vec3 pos, float t, int objectSeen)
+{
+	const TraceScene *scene = ctx.scene;
+	vec3 position = t*ray + pos;
+	int lightNum = scene->lights.size();
+	bool sphere = primitive(scene, objectSeen).type == SPHERE_TYPE;
+
+	float nearestLight = -1;
+	float darkFactor = sphere ? 0 : 1;
+
+	for (int i = 0; i < lightNum; ++i)
+	{
+		vec2 info = calculateShadow(ctx, position, i, objectSeen);
+		if (sphere)
+			darkFactor = std::max(darkFactor, info[0]);
+		else
+			darkFactor = darkFactor*info[0];
+
+		if (nearestLight>info[1] || nearestLight<0)
+			nearestLight = info[1];
+	}
+	float luminosity = atan((float)(lightNum-1))/(PI/2);
+	return vec2(darkFactor*(1-luminosity) + luminosity, nearestLight);
+}
+
+static reflection findReflectedRay(const TraceContext &ctx, vec3 ray, vec3 position, float t, int objectSeen)
+{
+	object o = primitive(ctx.scene, objectSeen);
+	ray = ray/getMagnitude(ray);
+
+	vec3 contactPoint = ray*t + position;
+	vec3 n = vec3(3);
+	if (o.type == SPHERE_TYPE)
+	{
+		n = contactPoint-o.x;
+		n = n/getMagnitude(n);
+	}
+	else if (o.type == PLANE_TYPE || o.type == TRIANGLE_TYPE)
+		n = primitiveNormal(ctx.scene, objectSeen);
+
+	reflection ref;
+	ref.ray = normalize(ray-2*(dot(ray, n)*n));
+	ref.n = n;
+	return ref;
+}
+
+static vec4 getBrightness(const TraceContext &ctx, vec3 ray, vec3 position, float t, int objectSeen)
+{
+	const TraceScene *scene = ctx.scene;
+	object o = primitive(scene, objectSeen);
+	vec3 pos = position+ray*t;
+	int lightNum = scene->lights.size();
+
+	vec3 sight = ctx.cameraPos-pos;
+	sight = sight/getMagnitude(sight);
+
+	vec4 temp = vec4(0);
+	for (int i = 0; i < lightNum; i++)
+	{
+		vec3 brightRay = scene->lights[i]-pos;
+		brightRay = brightRay/getMagnitude(brightRay);
+
+		vec3 h = sight + brightRay;
+		h = h/getMagnitude(h);
+
+		reflection ref = findReflectedRay(ctx, brightRay, pos, 0, objectSeen);
+
+		float intensity = scene->lightIntensities[i];
+		vec4 c = o.color*(scene->ambientLight + intensity*std::max(0.f, dot(brightRay, ref.n))) +
+			intensity*o.specularity*(float)pow(std::max(0.f, dot(ref.n, h)), o.shininess);
+
+		temp += c/(float)lightNum;
+	}
+
+	return temp;
+}
+
+static reflection calculateRefractedRay(const TraceContext &ctx, vec3 ray, vec3 position, float n, int objectSeen)
+{
+	float nt = primitive(ctx.scene, objectSeen).refraction;
+	ray = normalize(ray);
+	reflection ref = findReflectedRay(ctx, ray, position, 0, objectSeen);
+	if (dot(ref.n, -ray)<0)
+		ref.n = -ref.n;
+
+	float theta = acos(dot(-ray, ref.n));
+	float phi = asin((n/nt)*sin(theta));
+	reflection r;
+	r.ray = ((n*(ray+ref.n*cos(theta))/nt) - ref.n*cos(phi));
+	r.n = ref.n;
+	return r;
+}
+
+// shade a hit the way every bounce of the shader does; like fragment.glsl the
+// light is evaluated from position rather than from the bounce origin
+static vec4 shadeHit(const TraceContext &ctx, vec3 ray, vec3 origin, vec3 position, const lightRay &lumos)
+{
+	vec2 darkness = calculateShadows(ctx, ray, origin, lumos.distance, lumos.object);
+	vec4 c = getBrightness(ctx, ray, position, lumos.distance, lumos.object);
+	return c*(darkness[0]*1.f/pow(darkness[1], 0.7f));
+}
+
+static vec4 getRefractedColour(const TraceContext &ctx, vec3 ray, vec3 position, float t, int objectSeen, vec4 colour)
+{
+	const TraceScene *scene = ctx.scene;
+	int i = ctx.maxBounces, j = 0;
+	vec4 finalc = vec4(1);
+	int obj = objectSeen;
+	vec3 n;
+	float refIndex = 1;
+	bool once = true;
+
+	vec4 newc[MAX_BOUNCES];
+
+	while (i>0)
+	{
+		i--;
+
+		reflection refRay = calculateRefractedRay(ctx, ray, position+ray*t, refIndex, obj);
+		if (ctx.rays)
+			ctx.rays->refraction++;
+		lightRay lumos = getColour(ctx, refRay.ray, position+ray*t, obj);
+		vec4 c = lumos.color;
+		finalc = c;
+		if (once)
+		{
+			once = false;
+			n = refRay.n;
+		}
+
+		if (lumos.distance < 0)
+			break;
+
+		float alpha = primitive(scene, lumos.object).color[3];
+		c = shadeHit(ctx, refRay.ray, position+ray*t, position, lumos);
+		c[3] = alpha;
+		newc[j] = c;
+		j++;
+
+		if (!(alpha>0))
+			break;
+
+		position = position+ray*t;
+		ray = refRay.ray;
+		t = lumos.distance;
+		obj = lumos.object;
+		if (refIndex==1)
+			refIndex = alpha;
+		else
+			refIndex = 1;
+	}
+
+	while (j>0)
+	{
+		j--;
+		finalc = mix(newc[j], finalc, newc[j][3]);
+	}
+
+	finalc = mix(colour, finalc, std::min(std::max(0.f, dot(n, -ray))+0.2f, 1.f));
+	vec4 seen = primitive(scene, objectSeen).color;
+	return mix(seen, finalc, seen[3]);
+}
+
+static vec4 getRelectedColour(const TraceContext &ctx, vec3 ray, vec3 position, float t, int objectSeen)
+{
+	const TraceScene *scene = ctx.scene;
+	int i = ctx.maxBounces, j = 0;
+	vec4 finalc = vec4(0);
+	int obj = objectSeen;
+
+	vec4 newc[MAX_BOUNCES];
+
+	while (i>0)
+	{
+		i--;
+
+		reflection ref = findReflectedRay(ctx, ray, position, t, obj);
+		if (ctx.rays)
+			ctx.rays->reflection++;
+		lightRay lumos = getColour(ctx, ref.ray, position+ray*t, obj);
+
+		if (lumos.distance < 0)
+			break;
+
+		object hit = primitive(scene, lumos.object);
+		vec4 c = shadeHit(ctx, ref.ray, position+ray*t, position, lumos);
+
+		if (hit.color[3]>0)
+			c = getRefractedColour(ctx, ref.ray, position+ray*t, lumos.distance, lumos.object, c);
+
+		c[3] = hit.reflectance;
+		newc[j] = c;
+		j++;
+
+		if (!(hit.reflectance>0))
+			break;
+
+		position = position+ray*t;
+		ray = ref.ray;
+		t = lumos.distance;
+		obj = lumos.object;
+	}
+
+	while (j>0)
+	{
+		j--;
+		finalc = mix(newc[j], finalc, newc[j][3]);
+	}
+
+	return finalc;
+}
+
+// --------------------------------------------------------------------------
+// Frame rendering
+
+static TraceContext makeContext(const TraceScene *scene, const TraceCamera &camera, int maxBounces,
+								RayCounts *rays = 0)
+{
+	TraceContext ctx;
+	ctx.scene = scene;
+	ctx.cameraPos = camera.position;
+	ctx.maxBounces = std::max(0, std::min(maxBounces, MAX_BOUNCES));
+	ctx.rays = rays;
+	return ctx;
+}
+
+// everything main() in fragment.glsl does once the camera ray has been cast
+static vec4 shadePrimary(const TraceContext &ctx, vec3 ray, const lightRay &photon)
+{
+	vec3 rcamPos = ctx.cameraPos;
+	float t = photon.distance;
+	vec4 colour = photon.color;
+
+	if (t>=0)
+	{
+		object seen = primitive(ctx.scene, photon.object);
+		colour = shadeHit(ctx, ray, rcamPos, rcamPos, photon);
+		vec4 r = getRelectedColour(ctx, ray, rcamPos, t, photon.object);
+		colour = mix(colour, r, seen.reflectance);
+
+		if (seen.color[3]>0)
+			colour = getRefractedColour(ctx, ray, rcamPos, t, photon.object, r);
+	}
+
+	return colour;
+}
+
+vec4 TracePixel(const TraceScene *scene, const TraceCamera &camera, vec2 coords, int maxBounces)
+{
+	TraceContext ctx = makeContext(scene, camera, maxBounces);
+	vec3 ray = calculateRay(camera, coords);
+	return shadePrimary(ctx, ray, getColour(ctx, ray, ctx.cameraPos, -1));
+}
+
+static unsigned char toByte(float c)
+{
+	// NaNs fail every comparison and end up black
+	if (!(c > 0))
+		return 0;
+	if (c >= 1)
+		return 255;
+	return (unsigned char)(c*255.f + 0.5f);
+}
+
+static void storePixel(Framebuffer *frame, int x, int y, vec4 c)
+{
+	unsigned char *p = &frame->pixels[((size_t)y*frame->width + x)*3];
+	p[0] = toByte(c[0]);
+	p[1] = toByte(c[1]);
+	p[2] = toByte(c[2]);
+}
+
+// map pixel (x, y) of a top-row-first image to textureCoords; frames that
+// are not square keep square pixels by widening the horizontal range
+static vec2 pixelCoords(int x, int y, int width, int height)
+{
+	float aspect = (float)width/height;
+	return vec2(((x+0.5f)/width*2-1)*aspect, 1-(y+0.5f)/height*2);
+}
+
+// trace the block of at most PACKET_WIDTH x PACKET_WIDTH pixels at (x0, y0)
+static void traceBlock(const TraceScene *scene, const TraceCamera &camera, Framebuffer *frame,
+					int x0, int y0, const TraceSettings &settings, RayCounts *rays)
+{
+	TraceContext ctx = makeContext(scene, camera, settings.maxBounces, rays);
+	int x1 = std::min(x0 + PACKET_WIDTH, frame->width);
+	int y1 = std::min(y0 + PACKET_WIDTH, frame->height);
+	if (rays)
+		rays->camera += (x1 - x0)*(y1 - y0);
+
+	if (!settings.packets)
+	{
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+			{
+				vec3 ray = calculateRay(camera, pixelCoords(x, y, frame->width, frame->height));
+				storePixel(frame, x, y, shadePrimary(ctx, ray, getColour(ctx, ray, ctx.cameraPos, -1)));
+			}
+		return;
+	}
+
+	RayPacket packet;
+	packet.origin = camera.position;
+	packet.count = 0;
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++)
+		{
+			vec3 ray = calculateRay(camera, pixelCoords(x, y, frame->width, frame->height));
+			for (int a = 0; a < 3; a++)
+				packet.dir[a][packet.count] = ray[a];
+			packet.t[packet.count++] = INFINITY;
+		}
+
+	IntersectPacket(&scene->bvh, scene->objects, scene->normals, &packet);
+	for (int i = 0; i < packet.count && !scene->instances.top.nodes.empty(); i++)
+	{
+		vec3 ray = vec3(packet.dir[0][i], packet.dir[1][i], packet.dir[2][i]);
+		packet.hit[i] = closestInstance(scene, ray, packet.origin, -1, INFINITY, packet.hit[i], &packet.t[i]);
+	}
+
+	int i = 0;
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++, i++)
+		{
+			lightRay photon;
+			photon.object = packet.hit[i];
+			photon.distance = photon.object >= 0 ? packet.t[i] : -1;
+			photon.color = photon.object >= 0 ? primitive(scene, photon.object).color : vec4(0);
+
+			vec3 ray = vec3(packet.dir[0][i], packet.dir[1][i], packet.dir[2][i]);
+			storePixel(frame, x, y, shadePrimary(ctx, ray, photon));
+		}
+}
+
+// tiles of TILE_SIZE x TILE_SIZE pixels are the unit of work of the threads;
+// a multiple of PACKET_WIDTH so that tiles split into whole packets
+#define TILE_SIZE 16
+
+static void traceTile(const TraceScene *scene, const TraceCamera &camera, Framebuffer *frame,
+					int tile, const TraceSettings &settings, RayCounts *rays)
+{
+	int columns = (frame->width + TILE_SIZE - 1)/TILE_SIZE;
+	int x0 = tile%columns*TILE_SIZE;
+	int y0 = tile/columns*TILE_SIZE;
+	int x1 = std::min(x0 + TILE_SIZE, frame->width);
+	int y1 = std::min(y0 + TILE_SIZE, frame->height);
+	for (int y = y0; y < y1; y += PACKET_WIDTH)
+		for (int x = x0; x < x1; x += PACKET_WIDTH)
+			traceBlock(scene, camera, frame, x, y, settings, rays);
+}
+
+void TraceFrame(const TraceScene *scene, const TraceCamera &camera, Framebuffer *frame,
+				const TraceSettings &settings, TileStats *stats)
+{
+	frame->pixels.resize((size_t)frame->width*frame->height*3);
+
+	int columns = (frame->width + TILE_SIZE - 1)/TILE_SIZE;
+	int rows = (frame->height + TILE_SIZE - 1)/TILE_SIZE;
+
+	TilePool *pool = settings.pool;
+	if (!pool)
+	{
+		int threads = settings.threads;
+		if (threads <= 0)
+			threads = std::max(1u, thread::hardware_concurrency());
+		pool = CreateTilePool(std::max(1, std::min(threads, columns*rows)));
+	}
+
+	// every tile counts its rays apart, so the workers share no counters
+	vector<RayCounts> tileRays(settings.rays ? columns*rows : 0);
+	RunTiles(pool, columns*rows, [&](int tile)
+		{ traceTile(scene, camera, frame, tile, settings, settings.rays ? &tileRays[tile] : 0); }, stats);
+	for (size_t i = 0; i < tileRays.size(); i++)
+	{
+		settings.rays->camera += tileRays[i].camera;
+		settings.rays->shadow += tileRays[i].shadow;
+		settings.rays->reflection += tileRays[i].reflection;
+		settings.rays->refraction += tileRays[i].refraction;
+	}
+
+	if (pool != settings.pool)
+		DestroyTilePool(pool);
+}
@@ -0,0 +1,128 @@
+// ==========================================================================
+// Headless CPU ray tracer
+//
+// Reproduces the shading model of fragment.glsl (getColour, calculateShadows,
+// getBrightness, getRelectedColour, getRefractedColour) so that frames can be
+// produced on machines without a GPU. The scene comes straight from parser().
+// ==========================================================================
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+#include "bvh.h"
+#include "widebvh.h"
+#include "instances.h"
+#include "scheduler.h"
+
+// fixed bounce count of the reflection and refraction loops in fragment.glsl
+#define MAX_BOUNCES 10
+
+// traversal kernel used for ray queries
+enum TraversalKernel
+{
+	KERNEL_AUTO,		// widest tree the processor has vector units for
+	KERNEL_BINARY,
+	KERNEL_BVH4,		// one SSE slab test per node
+	KERNEL_BVH8			// one AVX2 slab test per node
+};
+
+// camera state, expressed exactly like the shader uniforms
+struct TraceCamera
+{
+	glm::vec3 position;		// cameraPos
+	float theta;			// rotation about the y axis (left/right keys)
+	float phi;				// rotation about the x axis (up/down keys)
+	float fieldOfView;		// fieldOfView, in radians
+
+	// defaults are the uniform initializers of fragment.glsl
+	TraceCamera() : position(0, 0, 0.14f), theta(0), phi(0), fieldOfView(3.14159265359f/3.f)
+	{}
+};
+
+// scene data in the form the tracer consumes it
+struct TraceScene
+{
+	std::vector<object> objects;
+	std::vector<Mesh> meshes;
+	std::vector<int> meshStarts;	// see MeshStarts() in mesh.h
+	std::vector<glm::vec3> lights;
+	std::vector<float> lightIntensities;
+	float ambientLight;
+
+	// unit normals of the planes and triangles among the objects, computed
+	// once per scene
+	std::vector<glm::vec3> normals;
+
+	// acceleration structures; the wide trees are collapsed from bvh and
+	// only built for the kernel that uses them
+	TraversalKernel kernel;
+	BVH bvh;
+	WideBVH<4> bvh4;
+	WideBVH<8> bvh8;
+
+	// meshes placed by instances, searched after the trees above
+	InstanceBVH instances;
+
+	TraceScene() : ambientLight(1), kernel(KERNEL_BINARY)
+	{}
+};
+
+// 8 bit RGB image, top row first as expected by SaveImage()
+struct Framebuffer
+{
+	int width;
+	int height;
+	std::vector<unsigned char> pixels;
+
+	Framebuffer() : width(0), height(0)
+	{}
+};
+
+// copy the output of parser() into a trace scene and build its acceleration
+// structure, returning true if successful
+bool InitializeTraceScene(TraceScene *scene, const std::vector<object> &objects,
+						const std::vector<Mesh> &meshes, const std::vector<float> &lights,
+						const std::vector<float> &lightIntensities,
+						float ambientLight = 1, TraversalKernel kernel = KERNEL_AUTO);
+
+// parses a kernel name (auto, binary, bvh4, bvh8), returning true if known
+bool ParseTraversalKernel(const char *name, TraversalKernel *kernel);
+const char *TraversalKernelName(TraversalKernel kernel);
+
+// colour of a single sample; coords are in [-1,1] like textureCoords
+glm::vec4 TracePixel(const TraceScene *scene, const TraceCamera &camera,
+					glm::vec2 coords, int maxBounces = MAX_BOUNCES);
+
+// rays cast while tracing, by what they were cast for
+struct RayCounts
+{
+	long long camera;
+	long long shadow;		// one per light of every shaded hit
+	long long reflection;
+	long long refraction;
+
+	RayCounts() : camera(0), shadow(0), reflection(0), refraction(0)
+	{}
+};
+
+// how a frame is traced
+struct TraceSettings
+{
+	int threads;		// 0 uses every hardware thread
+	int maxBounces;		// length of the reflection and refraction loops
+	bool packets;		// trace camera rays in 8x8 packets
+	TilePool *pool;		// workers to render on, null starts threads for the frame
+	RayCounts *rays;	// if set, the rays of the frame are added to it
+
+	TraceSettings() : threads(0), maxBounces(MAX_BOUNCES), packets(true), pool(0), rays(0)
+	{}
+};
+
+// trace a whole frame of frame->width x frame->height pixels, optionally
+// reporting how busy each thread was
+void TraceFrame(const TraceScene *scene, const TraceCamera &camera, Framebuffer *frame,
+				const TraceSettings &settings = TraceSettings(), TileStats *stats = 0);
+
+#endif
@@ -0,0 +1,60 @@
+// ==========================================================================
+// Scene description shared by the OpenGL viewer and the CPU ray tracer
+// ==========================================================================
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include "glm/glm.hpp"
+
+// object types, as stored in the records of fragment.glsl
+#define SPHERE_TYPE 0
+#define PLANE_TYPE 1
+#define TRIANGLE_TYPE 2
+
+// one primitive of the scene
+//  - sphere:   x = centre, y[0] = radius
+//  - plane:    x = normal, y = point on the plane
+//  - triangle: x, y, z = corners in counter-clockwise order
+// colour alpha is reused as the refraction switch by the shading model
+struct object
+{
+	int type;
+	glm::vec3 x, y, z;
+	glm::vec4 color;
+	glm::vec4 specularity;
+	int shininess;
+	float reflectance;
+	float refraction;
+};
+
+struct Material
+{
+	glm::vec4 spec;
+	int phong;
+	float reflectance;
+	float refraction;
+	float transparency;
+};
+
+// triangles sharing one vertex array and one colour and material. The
+// triangles of a scene's placed meshes are numbered on from its objects,
+// mesh by mesh, wherever the tracer and the shader identify a primitive;
+// those of instances follow (see instances.h).
+struct Mesh
+{
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indices;	// three per triangle, counter-clockwise
+	glm::vec4 color;
+	Material material;
+
+	// false for meshes only shown through their instances
+	bool placed;
+	// mesh to scene space of every instance, the last column translating
+	std::vector<glm::mat4x3> instances;
+
+	Mesh() : placed(true)
+	{}
+};
+
+#endif
@@ -0,0 +1,376 @@
+// ==========================================================================
+// Cache of loaded scenes
+// ==========================================================================
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <sys/stat.h>
+#include "scenecache.h"
+#include "scenefile.h"
+
+using namespace std;
+
+struct CacheEntry
+{
+	shared_ptr<CachedScene> scene;
+	size_t bytes;
+};
+
+struct SceneCache
+{
+	size_t budget;
+	size_t used;					// bytes of the entries
+	list<CacheEntry> entries;		// most recently used first
+	set<string> loading;			// files being read
+	deque<string> queue;			// files to read ahead
+	bool stop;
+
+	mutex lock;
+	condition_variable work;		// the queue grew or the cache is going
+	condition_variable loaded;		// a file was read
+	thread worker;
+
+	SceneCache() : budget(0), used(0), stop(false)
+	{}
+};
+
+long long FileStamp(const string &file)
+{
+	struct stat info;
+	if (stat(file.c_str(), &info) != 0)
+		return 0;
+	return info.st_mtim.tv_sec*1000000000ll + info.st_mtim.tv_nsec;
+}
+
+// --------------------------------------------------------------------------
+// Memory held by a scene
+
+template <typename T>
+static size_t arrayBytes(const vector<T> &a)
+{
+	return a.capacity()*sizeof(T);
+}
+
+static size_t bvhBytes(const BVH &bvh)
+{
+	size_t bytes = arrayBytes(bvh.nodes) + arrayBytes(bvh.indices) + arrayBytes(bvh.unbounded)
+		+ arrayBytes(bvh.triangles.triangle);
+	for (int a = 0; a < 3; a++)
+		bytes += arrayBytes(bvh.triangles.p0[a]) + arrayBytes(bvh.triangles.e1[a])
+			+ arrayBytes(bvh.triangles.e2[a]);
+	return bytes;
+}
+
+static size_t sceneBytes(const CachedScene &scene)
+{
+	size_t bytes = arrayBytes(scene.objects) + arrayBytes(scene.lights) + arrayBytes(scene.lightIntensities);
+	for (size_t m = 0; m < scene.meshes.size(); m++)
+	{
+		const Mesh &mesh = scene.meshes[m];
+		bytes += sizeof(Mesh) + arrayBytes(mesh.vertices) + arrayBytes(mesh.indices)
+			+ arrayBytes(mesh.instances);
+	}
+
+	const GPUScene &gpu = scene.gpu;
+	bytes += arrayBytes(gpu.records) + arrayBytes(gpu.geometry) + arrayBytes(gpu.vertices)
+		+ arrayBytes(gpu.materials) + arrayBytes(gpu.nodes) + arrayBytes(gpu.lights)
+		+ arrayBytes(gpu.instances) + arrayBytes(gpu.order) + bvhBytes(gpu.bvh);
+
+	const InstanceBVH &instanced = gpu.instanced;
+	bytes += arrayBytes(instanced.meshes) + arrayBytes(instanced.transforms)
+		+ arrayBytes(instanced.inverses) + arrayBytes(instanced.starts) + bvhBytes(instanced.top);
+	for (size_t m = 0; m < instanced.bottom.size(); m++)
+		bytes += bvhBytes(instanced.bottom[m]);
+	return bytes;
+}
+
+// --------------------------------------------------------------------------
+// Reading and keeping scenes
+
+const char *LoadStageName(LoadStage stage)
+{
+	static const char *names[] = { "waiting", "reading", "building", "done", "failed" };
+	return names[stage];
+}
+
+static shared_ptr<CachedScene> readScene(const string &file, const function<void(LoadStage)> &progress)
+{
+	shared_ptr<CachedScene> scene = make_shared<CachedScene>();
+	scene->file = file;
+	scene->stamp = FileStamp(file);
+	if (progress)
+		progress(LOAD_READING);
+	if (!ReadScene(file, &scene->objects, &scene->meshes, &scene->lights, &scene->lightIntensities))
+		return shared_ptr<CachedScene>();
+	if (progress)
+		progress(LOAD_PACKING);
+	PackGPUScene(&scene->gpu, scene->objects, scene->meshes, scene->lights, scene->lightIntensities);
+	return scene;
+}
+
+static list<CacheEntry>::iterator findEntry(SceneCache *cache, const string &file)
+{
+	list<CacheEntry>::iterator entry = cache->entries.begin();
+	while (entry != cache->entries.end() && entry->scene->file != file)
+		++entry;
+	return entry;
+}
+
+// adds a scene as the most recently used one and drops the least recently
+// used ones that are not in use until the cache is within its budget; the
+// lock must be held
+static void keep(SceneCache *cache, const shared_ptr<CachedScene> &scene)
+{
+	CacheEntry entry = { scene, sceneBytes(*scene) };
+	cache->entries.push_front(entry);
+	cache->used += entry.bytes;
+
+	list<CacheEntry>::iterator last = cache->entries.end();
+	while (cache->used > cache->budget && last != cache->entries.begin())
+	{
+		--last;
+		if (last->scene.use_count() > 1)
+			continue;
+		cache->used -= last->bytes;
+		last = cache->entries.erase(last);
+	}
+}
+
+static void prefetch(SceneCache *cache)
+{
+	unique_lock<mutex> guard(cache->lock);
+	for (;;)
+	{
+		while (!cache->stop && cache->queue.empty())
+			cache->work.wait(guard);
+		if (cache->stop)
+			return;
+
+		string file = cache->queue.front();
+		cache->queue.pop_front();
+		if (cache->loading.count(file) || findEntry(cache, file) != cache->entries.end())
+			continue;
+
+		cache->loading.insert(file);
+		guard.unlock();
+		shared_ptr<CachedScene> scene = readScene(file, function<void(LoadStage)>());
+		guard.lock();
+		cache->loading.erase(file);
+		if (scene)
+			keep(cache, scene);
+		cache->loaded.notify_all();
+	}
+}
+
+SceneCache *CreateSceneCache(size_t budget)
+{
+	SceneCache *cache = new SceneCache;
+	cache->budget = budget;
+	cache->worker = thread(prefetch, cache);
+	return cache;
+}
+
+void DestroySceneCache(SceneCache *cache)
+{
+	if (!cache)
+		return;
+	{
+		lock_guard<mutex> guard(cache->lock);
+		cache->stop = true;
+	}
+	cache->work.notify_all();
+	cache->worker.join();
+	delete cache;
+}
+
+shared_ptr<CachedScene> GetScene(SceneCache *cache, const string &file)
+{
+	return GetScene(cache, file, function<void(LoadStage)>());
+}
+
+shared_ptr<CachedScene> GetScene(SceneCache *cache, const string &file,
+								const function<void(LoadStage)> &progress)
+{
+	unique_lock<mutex> guard(cache->lock);
+
+	// a scene being read ahead is waited for rather than read twice
+	while (cache->loading.count(file))
+		cache->loaded.wait(guard);
+
+	list<CacheEntry>::iterator entry = findEntry(cache, file);
+	if (entry != cache->entries.end())
+	{
+		if (entry->scene->stamp == FileStamp(file))
+		{
+			cache->entries.splice(cache->entries.begin(), cache->entries, entry);
+			return entry->scene;
+		}
+		cache->used -= entry->bytes;
+		cache->entries.erase(entry);
+	}
+
+	cache->loading.insert(file);
+	guard.unlock();
+	shared_ptr<CachedScene> scene = readScene(file, progress);
+	guard.lock();
+	cache->loading.erase(file);
+	if (scene)
+		keep(cache, scene);
+	cache->loaded.notify_all();
+	return scene;
+}
+
+void PrefetchScene(SceneCache *cache, const string &file)
+{
+	{
+		lock_guard<mutex> guard(cache->lock);
+		for (size_t i = 0; i < cache->queue.size(); i++)
+			if (cache->queue[i] == file)
+				return;
+		cache->queue.push_back(file);
+	}
+	cache->work.notify_one();
+}
+
+void UpdateCachedScene(SceneCache *cache, const shared_ptr<CachedScene> &scene)
+{
+	// the stamp is only read under the lock
+	lock_guard<mutex> guard(cache->lock);
+	scene->stamp = FileStamp(scene->file);
+	for (list<CacheEntry>::iterator entry = cache->entries.begin(); entry != cache->entries.end(); ++entry)
+		if (entry->scene == scene)
+		{
+			cache->used -= entry->bytes;
+			entry->bytes = sceneBytes(*scene);
+			cache->used += entry->bytes;
+		}
+}
+
+// --------------------------------------------------------------------------
+// Loading in the background
+
+// a load that finished, waiting for the thread that asked for it
+struct LoadResult
+{
+	int request;
+	shared_ptr<CachedScene> scene;
+};
+
+struct SceneLoader
+{
+	SceneCache *cache;
+	function<void()> changed;
+
+	atomic<int> requested;			// number of the latest request
+	atomic<int> stage;				// LoadStage of the latest request
+	atomic<LoadResult *> done;		// the handoff to the requesting thread
+
+	// request not yet taken up by the worker, guarded by lock
+	mutex lock;
+	condition_variable work;
+	string file;
+	int pending;					// its number, 0 if there is none
+	bool stop;
+	thread worker;
+
+	SceneLoader() : cache(0), requested(0), stage(LOAD_DONE), done(0), pending(0), stop(false)
+	{}
+};
+
+// reports the stage of request if it is still the latest one
+static void reportStage(SceneLoader *loader, int request, LoadStage stage)
+{
+	if (request != loader->requested.load())
+		return;
+	loader->stage.store(stage);
+	loader->changed();
+}
+
+static void load(SceneLoader *loader)
+{
+	unique_lock<mutex> guard(loader->lock);
+	for (;;)
+	{
+		while (!loader->stop && !loader->pending)
+			loader->work.wait(guard);
+		if (loader->stop)
+			return;
+
+		string file = loader->file;
+		int request = loader->pending;
+		loader->pending = 0;
+		guard.unlock();
+
+		shared_ptr<CachedScene> scene = GetScene(loader->cache, file,
+			[loader, request](LoadStage stage) { reportStage(loader, request, stage); });
+
+		// a newer request wants another scene; this one stays in the cache
+		if (request == loader->requested.load())
+		{
+			LoadResult *result = new LoadResult;
+			result->request = request;
+			result->scene = scene;
+			delete loader->done.exchange(result);
+			reportStage(loader, request, scene ? LOAD_DONE : LOAD_FAILED);
+		}
+		guard.lock();
+	}
+}
+
+SceneLoader *CreateSceneLoader(SceneCache *cache, const function<void()> &changed)
+{
+	SceneLoader *loader = new SceneLoader;
+	loader->cache = cache;
+	loader->changed = changed;
+	loader->worker = thread(load, loader);
+	return loader;
+}
+
+void DestroySceneLoader(SceneLoader *loader)
+{
+	if (!loader)
+		return;
+	{
+		lock_guard<mutex> guard(loader->lock);
+		loader->stop = true;
+	}
+	loader->work.notify_all();
+	loader->worker.join();
+	delete loader->done.exchange(0);
+	delete loader;
+}
+
+void RequestScene(SceneLoader *loader, const string &file)
+{
+	{
+		lock_guard<mutex> guard(loader->lock);
+		loader->file = file;
+		loader->pending = loader->requested.load() + 1;
+		loader->requested.store(loader->pending);
+		loader->stage.store(LOAD_WAITING);
+	}
+	loader->work.notify_one();
+}
+
+LoadStage SceneLoadStage(const SceneLoader *loader)
+{
+	return (LoadStage)loader->stage.load();
+}
+
+bool TakeLoadedScene(SceneLoader *loader, shared_ptr<CachedScene> *scene)
+{
+	LoadResult *result = loader->done.exchange(0);
+	if (!result)
+		return false;
+
+	bool latest = result->request == loader->requested.load();
+	if (latest)
+		*scene = result->scene;
+	delete result;
+	return latest;
+}
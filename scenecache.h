@@ -0,0 +1,100 @@
+// ==========================================================================
+// Cache of loaded scenes
+//
+// Keeps scenes read and laid out for the shader (see gpuscene.h), trees
+// included, so that showing one again takes a pointer swap and an upload.
+// Once the cache holds more than its budget the least recently used scenes
+// are dropped, except those still in use. Scenes likely to be shown next are
+// read ahead on a worker thread, and a cached scene whose file has changed
+// since it was read is read again. A loader (below) gets scenes from the
+// cache without blocking the thread that asks for them.
+// ==========================================================================
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "gpuscene.h"
+
+struct CachedScene
+{
+	std::string file;
+	long long stamp;		// FileStamp() of the file when it was read
+
+	std::vector<object> objects;
+	std::vector<Mesh> meshes;
+	std::vector<float> lights;
+	std::vector<float> lightIntensities;
+	GPUScene gpu;			// packed from the above
+
+	CachedScene() : stamp(0)
+	{}
+};
+
+struct SceneCache;
+
+// start a cache that keeps up to budget bytes of scenes
+SceneCache *CreateSceneCache(size_t budget);
+void DestroySceneCache(SceneCache *cache);
+
+// the scene in file, read and packed now unless it is cached or being read
+// ahead, or null if it does not load
+std::shared_ptr<CachedScene> GetScene(SceneCache *cache, const std::string &file);
+
+// read and pack the scene in file on the worker thread unless it is cached
+void PrefetchScene(SceneCache *cache, const std::string &file);
+
+// takes a cached scene whose contents were replaced in place by the current
+// version of its file, as a reload does, for that version: its stamp is
+// taken anew and its memory counted again
+void UpdateCachedScene(SceneCache *cache, const std::shared_ptr<CachedScene> &scene);
+
+// how far the load of a scene has got
+enum LoadStage
+{
+	LOAD_WAITING,		// for the worker, or for a read ahead of the same file
+	LOAD_READING,		// parsing the file
+	LOAD_PACKING,		// building its trees and laying it out for the shader
+	LOAD_DONE,
+	LOAD_FAILED
+};
+
+const char *LoadStageName(LoadStage stage);
+
+// as above, calling progress as the scene goes through the stages of loading
+std::shared_ptr<CachedScene> GetScene(SceneCache *cache, const std::string &file,
+									const std::function<void(LoadStage)> &progress);
+
+// time of the last change to a file, in nanoseconds, or 0 if it is missing
+long long FileStamp(const std::string &file);
+
+// --------------------------------------------------------------------------
+// Loading in the background
+//
+// A loader gets scenes from a cache on a thread of its own, so that the
+// thread drawing the old scene never waits for a new one. A finished load is
+// handed back through a single atomic pointer, and only the latest request
+// is: one overtaken by a newer request still ends up in the cache but is
+// not handed back.
+
+struct SceneLoader;
+
+// start a loader on cache; changed is called on the loader's thread whenever
+// the latest load moves on a stage
+SceneLoader *CreateSceneLoader(SceneCache *cache, const std::function<void()> &changed);
+void DestroySceneLoader(SceneLoader *loader);
+
+// load the scene in file, superseding any earlier request
+void RequestScene(SceneLoader *loader, const std::string &file);
+
+// stage of the latest request
+LoadStage SceneLoadStage(const SceneLoader *loader);
+
+// hands over the scene of the latest request once it is loaded, or null if
+// it failed to load; returns false while there is nothing to hand over
+bool TakeLoadedScene(SceneLoader *loader, std::shared_ptr<CachedScene> *scene);
+
+#endif
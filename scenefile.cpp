@@ -0,0 +1,324 @@
+// ==========================================================================
+// Binary scene files
+// ==========================================================================
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "scenefile.h"
+#include "parser.h"
+
+using namespace std;
+using namespace glm;
+
+#define SCENE_ALIGNMENT 16
+
+// start of every file; offsets count from the start of the file
+struct sceneHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t objectCount;
+	uint32_t lightCount;
+	uint32_t meshCount;
+	uint32_t instanceCount;
+	uint64_t vertexCount;
+	uint64_t indexCount;
+	uint64_t offsets[SCENE_ARRAY_COUNT];
+};
+
+// bytes per element of every array
+static const size_t elementSizes[SCENE_ARRAY_COUNT] = {
+	sizeof(int), sizeof(vec3), sizeof(vec3), sizeof(vec3), sizeof(vec4), sizeof(vec4),
+	sizeof(int), sizeof(float), sizeof(float), sizeof(vec3), sizeof(float),
+	sizeof(uint32_t), sizeof(uint32_t), sizeof(vec4), sizeof(vec4), sizeof(int), sizeof(float),
+	sizeof(float), sizeof(int), sizeof(uint32_t), sizeof(vec3), sizeof(uint32_t), sizeof(mat4x3)
+};
+
+static uint64_t arrayLength(int array, const sceneHeader &header)
+{
+	if (array < SCENE_LIGHTS)
+		return header.objectCount;
+	if (array < SCENE_MESH_VERTEX_COUNTS)
+		return header.lightCount;
+	if (array < SCENE_VERTICES)
+		return header.meshCount;
+	if (array == SCENE_VERTICES)
+		return header.vertexCount;
+	return array == SCENE_INDICES ? header.indexCount : header.instanceCount;
+}
+
+static uint64_t align(uint64_t offset)
+{
+	return (offset + SCENE_ALIGNMENT - 1)/SCENE_ALIGNMENT*SCENE_ALIGNMENT;
+}
+
+bool IsSceneFile(const string &path)
+{
+	char magic[4];
+	ifstream in(path.c_str(), ios::binary);
+	in.read(magic, sizeof(magic));
+	return in && memcmp(magic, SCENE_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool OpenSceneFile(SceneFile *scene, const string &path)
+{
+	CloseSceneFile(scene);
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(sceneHeader))
+	{
+		close(fd);
+		return false;
+	}
+	size_t size = info.st_size;
+	void *mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	const char *bytes = static_cast<const char *>(mapping);
+	const sceneHeader *header = reinterpret_cast<const sceneHeader *>(bytes);
+	bool valid = memcmp(header->magic, SCENE_FILE_MAGIC, 4) == 0
+		&& header->version == SCENE_FILE_VERSION;
+	for (int a = 0; a < SCENE_ARRAY_COUNT && valid; a++)
+	{
+		uint64_t offset = header->offsets[a];
+		valid = offset % SCENE_ALIGNMENT == 0 && offset <= size
+			&& arrayLength(a, *header) <= (size - offset)/elementSizes[a];
+	}
+
+	// the meshes must share out the vertices and whole triangles exactly
+	if (valid)
+	{
+		const uint32_t *vertexCounts = reinterpret_cast<const uint32_t *>(bytes + header->offsets[SCENE_MESH_VERTEX_COUNTS]);
+		const uint32_t *indexCounts = reinterpret_cast<const uint32_t *>(bytes + header->offsets[SCENE_MESH_INDEX_COUNTS]);
+		const uint32_t *instanceCounts = reinterpret_cast<const uint32_t *>(bytes + header->offsets[SCENE_MESH_INSTANCE_COUNTS]);
+		uint64_t vertices = 0, indices = 0, instances = 0;
+		for (uint32_t m = 0; m < header->meshCount; m++)
+		{
+			vertices += vertexCounts[m];
+			indices += indexCounts[m];
+			instances += instanceCounts[m];
+			valid &= indexCounts[m] % 3 == 0;
+		}
+		valid &= vertices == header->vertexCount && indices == header->indexCount
+			&& instances == header->instanceCount;
+	}
+	if (!valid)
+	{
+		munmap(mapping, size);
+		return false;
+	}
+
+	scene->mapping = mapping;
+	scene->size = size;
+	scene->objectCount = header->objectCount;
+	scene->lightCount = header->lightCount;
+	scene->meshCount = header->meshCount;
+	scene->vertexCount = header->vertexCount;
+	scene->indexCount = header->indexCount;
+	scene->instanceCount = header->instanceCount;
+
+	const uint64_t *offsets = header->offsets;
+	scene->types = reinterpret_cast<const int *>(bytes + offsets[SCENE_TYPES]);
+	scene->x = reinterpret_cast<const vec3 *>(bytes + offsets[SCENE_X]);
+	scene->y = reinterpret_cast<const vec3 *>(bytes + offsets[SCENE_Y]);
+	scene->z = reinterpret_cast<const vec3 *>(bytes + offsets[SCENE_Z]);
+	scene->colors = reinterpret_cast<const vec4 *>(bytes + offsets[SCENE_COLORS]);
+	scene->specularities = reinterpret_cast<const vec4 *>(bytes + offsets[SCENE_SPECULARITIES]);
+	scene->shininesses = reinterpret_cast<const int *>(bytes + offsets[SCENE_SHININESSES]);
+	scene->reflectances = reinterpret_cast<const float *>(bytes + offsets[SCENE_REFLECTANCES]);
+	scene->refractions = reinterpret_cast<const float *>(bytes + offsets[SCENE_REFRACTIONS]);
+	scene->lights = reinterpret_cast<const vec3 *>(bytes + offsets[SCENE_LIGHTS]);
+	scene->lightIntensities = reinterpret_cast<const float *>(bytes + offsets[SCENE_LIGHT_INTENSITIES]);
+	scene->meshVertexCounts = reinterpret_cast<const uint32_t *>(bytes + offsets[SCENE_MESH_VERTEX_COUNTS]);
+	scene->meshIndexCounts = reinterpret_cast<const uint32_t *>(bytes + offsets[SCENE_MESH_INDEX_COUNTS]);
+	scene->meshColors = reinterpret_cast<const vec4 *>(bytes + offsets[SCENE_MESH_COLORS]);
+	scene->meshSpecularities = reinterpret_cast<const vec4 *>(bytes + offsets[SCENE_MESH_SPECULARITIES]);
+	scene->meshShininesses = reinterpret_cast<const int *>(bytes + offsets[SCENE_MESH_SHININESSES]);
+	scene->meshReflectances = reinterpret_cast<const float *>(bytes + offsets[SCENE_MESH_REFLECTANCES]);
+	scene->meshRefractions = reinterpret_cast<const float *>(bytes + offsets[SCENE_MESH_REFRACTIONS]);
+	scene->meshPlaced = reinterpret_cast<const int *>(bytes + offsets[SCENE_MESH_PLACED]);
+	scene->meshInstanceCounts = reinterpret_cast<const uint32_t *>(bytes + offsets[SCENE_MESH_INSTANCE_COUNTS]);
+	scene->vertices = reinterpret_cast<const vec3 *>(bytes + offsets[SCENE_VERTICES]);
+	scene->indices = reinterpret_cast<const uint32_t *>(bytes + offsets[SCENE_INDICES]);
+	scene->instances = reinterpret_cast<const mat4x3 *>(bytes + offsets[SCENE_INSTANCES]);
+	return true;
+}
+
+void CloseSceneFile(SceneFile *scene)
+{
+	if (scene->mapping)
+		munmap(scene->mapping, scene->size);
+	*scene = SceneFile();
+}
+
+bool UnpackSceneFile(const SceneFile &scene, vector<object> *objects, vector<Mesh> *meshes,
+					vector<float> *lights, vector<float> *lightIntensities)
+{
+	objects->resize(scene.objectCount);
+	for (uint32_t i = 0; i < scene.objectCount; i++)
+	{
+		object &o = (*objects)[i];
+		o.type = scene.types[i];
+		o.x = scene.x[i];
+		o.y = scene.y[i];
+		o.z = scene.z[i];
+		o.color = scene.colors[i];
+		o.specularity = scene.specularities[i];
+		o.shininess = scene.shininesses[i];
+		o.reflectance = scene.reflectances[i];
+		o.refraction = scene.refractions[i];
+	}
+
+	const float *light = reinterpret_cast<const float *>(scene.lights);
+	lights->assign(light, light + 3*(size_t)scene.lightCount);
+	lightIntensities->assign(scene.lightIntensities, scene.lightIntensities + scene.lightCount);
+
+	meshes->resize(scene.meshCount);
+	const vec3 *vertices = scene.vertices;
+	const uint32_t *indices = scene.indices;
+	const mat4x3 *instances = scene.instances;
+	for (uint32_t m = 0; m < scene.meshCount; m++)
+	{
+		Mesh &mesh = (*meshes)[m];
+		uint32_t vertexCount = scene.meshVertexCounts[m];
+		uint32_t indexCount = scene.meshIndexCounts[m];
+		mesh.vertices.assign(vertices, vertices + vertexCount);
+		mesh.indices.assign(indices, indices + indexCount);
+		for (uint32_t k = 0; k < indexCount; k++)
+			if (indices[k] >= vertexCount)
+				return false;
+		vertices += vertexCount;
+		indices += indexCount;
+
+		mesh.color = scene.meshColors[m];
+		mesh.material.spec = scene.meshSpecularities[m];
+		mesh.material.phong = scene.meshShininesses[m];
+		mesh.material.reflectance = scene.meshReflectances[m];
+		mesh.material.refraction = scene.meshRefractions[m];
+		mesh.material.transparency = 0;
+		mesh.placed = scene.meshPlaced[m] != 0;
+		mesh.instances.assign(instances, instances + scene.meshInstanceCounts[m]);
+		instances += scene.meshInstanceCounts[m];
+	}
+	return true;
+}
+
+bool ReadScene(const string &file, vector<object> *objects, vector<Mesh> *meshes,
+			vector<float> *lights, vector<float> *lightIntensities)
+{
+	if (!IsSceneFile(file))
+		return parser(file, objects, meshes, lights, lightIntensities);
+
+	SceneFile scene;
+	bool valid = OpenSceneFile(&scene, file)
+		&& UnpackSceneFile(scene, objects, meshes, lights, lightIntensities);
+	CloseSceneFile(&scene);
+	if (!valid)
+		cerr << "invalid binary scene " << file << "\n";
+	return valid;
+}
+
+bool WriteSceneFile(const string &path, const vector<object> &objects, const vector<Mesh> &meshes,
+					const vector<float> &lights, const vector<float> &lightIntensities)
+{
+	size_t objectCount = objects.size();
+	size_t lightCount = lights.size()/3;
+	size_t meshCount = meshes.size();
+
+	// gather the fields into their arrays
+	vector<int> types(objectCount), shininesses(objectCount);
+	vector<vec3> x(objectCount), y(objectCount), z(objectCount);
+	vector<vec4> colors(objectCount), specularities(objectCount);
+	vector<float> reflectances(objectCount), refractions(objectCount);
+	for (size_t i = 0; i < objectCount; i++)
+	{
+		const object &o = objects[i];
+		types[i] = o.type;
+		x[i] = o.x;
+		y[i] = o.y;
+		z[i] = o.z;
+		colors[i] = o.color;
+		specularities[i] = o.specularity;
+		shininesses[i] = o.shininess;
+		reflectances[i] = o.reflectance;
+		refractions[i] = o.refraction;
+	}
+	vector<float> intensities(lightCount, 1);
+	for (size_t i = 0; i < lightCount && i < lightIntensities.size(); i++)
+		intensities[i] = lightIntensities[i];
+
+
+	vector<uint32_t> vertexCounts(meshCount), indexCounts(meshCount);
+	vector<vec4> meshColors(meshCount), meshSpecularities(meshCount);
+	vector<int> meshShininesses(meshCount), placed(meshCount);
+	vector<uint32_t> instanceCounts(meshCount);
+	vector<float> meshReflectances(meshCount), meshRefractions(meshCount);
+	vector<vec3> vertices;
+	vector<uint32_t> indices;
+	vector<mat4x3> instances;
+	for (size_t m = 0; m < meshCount; m++)
+	{
+		const Mesh &mesh = meshes[m];
+		vertexCounts[m] = mesh.vertices.size();
+		indexCounts[m] = mesh.indices.size();
+		meshColors[m] = mesh.color;
+		meshSpecularities[m] = mesh.material.spec;
+		meshShininesses[m] = mesh.material.phong;
+		meshReflectances[m] = mesh.material.reflectance;
+		meshRefractions[m] = mesh.material.refraction;
+		vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+		indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+		placed[m] = mesh.placed;
+		instanceCounts[m] = mesh.instances.size();
+		instances.insert(instances.end(), mesh.instances.begin(), mesh.instances.end());
+	}
+
+	const void *arrays[SCENE_ARRAY_COUNT] = {
+		types.data(), x.data(), y.data(), z.data(), colors.data(), specularities.data(),
+		shininesses.data(), reflectances.data(), refractions.data(), lights.data(), intensities.data(),
+		vertexCounts.data(), indexCounts.data(), meshColors.data(), meshSpecularities.data(),
+		meshShininesses.data(), meshReflectances.data(), meshRefractions.data(), placed.data(),
+		instanceCounts.data(), vertices.data(), indices.data(), instances.data()
+	};
+
+	sceneHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.objectCount = objectCount;
+	header.lightCount = lightCount;
+	header.meshCount = meshCount;
+	header.vertexCount = vertices.size();
+	header.indexCount = indices.size();
+	header.instanceCount = instances.size();
+	uint64_t offset = align(sizeof(header));
+	for (int a = 0; a < SCENE_ARRAY_COUNT; a++)
+	{
+		header.offsets[a] = offset;
+		offset = align(offset + arrayLength(a, header)*elementSizes[a]);
+	}
+
+	ofstream out(path.c_str(), ios::binary);
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	uint64_t written = sizeof(header);
+	static const char padding[SCENE_ALIGNMENT] = {};
+	for (int a = 0; a < SCENE_ARRAY_COUNT; a++)
+	{
+		out.write(padding, header.offsets[a] - written);
+		size_t bytes = arrayLength(a, header)*elementSizes[a];
+		out.write(static_cast<const char *>(arrays[a]), bytes);
+		written = header.offsets[a] + bytes;
+	}
+	return bool(out);
+}
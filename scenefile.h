@@ -0,0 +1,125 @@
+// ==========================================================================
+// Binary scene files
+//
+// A binary scene holds what parser() reads from a text scene, one array per
+// object field as in the texture buffers of gpuscene.h, behind a header that
+// gives the offset of every array. Meshes keep their shared vertices and
+// index triples, all meshes' ones in an array each, and the transforms of
+// their instances. Arrays start on 16 byte boundaries, so a mapped file is
+// read in place: opening one costs the same whatever the size of the scene,
+// and loading it is one copy into the form parser() returns rather than
+// tokenizing. The trees and GPU records are built from that form after, as
+// for a text scene; they are not stored. Convert a text scene with
+//
+//     ./boilerplate --convert Scenes/scene1.txt scene1.rtsc
+// ==========================================================================
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+
+#define SCENE_FILE_MAGIC "RTSC"
+#define SCENE_FILE_VERSION 3
+
+// arrays of a binary scene, in file order
+enum SceneArray
+{
+	SCENE_TYPES,			// int per object
+	SCENE_X,				// vec3 per object
+	SCENE_Y,
+	SCENE_Z,
+	SCENE_COLORS,			// vec4 per object
+	SCENE_SPECULARITIES,
+	SCENE_SHININESSES,		// int per object
+	SCENE_REFLECTANCES,		// float per object
+	SCENE_REFRACTIONS,
+	SCENE_LIGHTS,			// vec3 per light
+	SCENE_LIGHT_INTENSITIES,	// float per light
+	SCENE_MESH_VERTEX_COUNTS,	// uint32 per mesh
+	SCENE_MESH_INDEX_COUNTS,
+	SCENE_MESH_COLORS,		// vec4 per mesh
+	SCENE_MESH_SPECULARITIES,
+	SCENE_MESH_SHININESSES,	// int per mesh
+	SCENE_MESH_REFLECTANCES,	// float per mesh
+	SCENE_MESH_REFRACTIONS,
+	SCENE_MESH_PLACED,		// int per mesh
+	SCENE_MESH_INSTANCE_COUNTS,	// uint32 per mesh
+	SCENE_VERTICES,			// vec3 per vertex, mesh after mesh
+	SCENE_INDICES,			// uint32 per corner, mesh after mesh
+	SCENE_INSTANCES,		// mat4x3 per instance, mesh after mesh
+	SCENE_ARRAY_COUNT
+};
+
+// a binary scene mapped into memory; the pointers address the mapping
+struct SceneFile
+{
+	uint32_t objectCount;
+	uint32_t lightCount;
+	uint32_t meshCount;
+	uint64_t vertexCount;
+	uint64_t indexCount;
+	uint32_t instanceCount;
+
+	const int *types;
+	const glm::vec3 *x;
+	const glm::vec3 *y;
+	const glm::vec3 *z;
+	const glm::vec4 *colors;
+	const glm::vec4 *specularities;
+	const int *shininesses;
+	const float *reflectances;
+	const float *refractions;
+	const glm::vec3 *lights;
+	const float *lightIntensities;
+	const uint32_t *meshVertexCounts;
+	const uint32_t *meshIndexCounts;
+	const glm::vec4 *meshColors;
+	const glm::vec4 *meshSpecularities;
+	const int *meshShininesses;
+	const float *meshReflectances;
+	const float *meshRefractions;
+	const int *meshPlaced;
+	const uint32_t *meshInstanceCounts;
+	const glm::vec3 *vertices;
+	const uint32_t *indices;
+	const glm::mat4x3 *instances;
+
+	void *mapping;
+	size_t size;
+
+	SceneFile() : objectCount(0), lightCount(0), meshCount(0), vertexCount(0), indexCount(0),
+		instanceCount(0), types(0), x(0), y(0), z(0), colors(0), specularities(0), shininesses(0),
+		reflectances(0), refractions(0), lights(0), lightIntensities(0), meshVertexCounts(0),
+		meshIndexCounts(0), meshColors(0), meshSpecularities(0), meshShininesses(0),
+		meshReflectances(0), meshRefractions(0), meshPlaced(0), meshInstanceCounts(0), vertices(0),
+		indices(0), instances(0), mapping(0), size(0)
+	{}
+};
+
+// true if the file starts like a binary scene
+bool IsSceneFile(const std::string &path);
+
+// map a binary scene, returning true if it is complete and of this version
+bool OpenSceneFile(SceneFile *scene, const std::string &path);
+void CloseSceneFile(SceneFile *scene);
+
+// copy a mapped scene into the form parser() returns, returning false if a
+// mesh index is out of range
+bool UnpackSceneFile(const SceneFile &scene, std::vector<object> *objects, std::vector<Mesh> *meshes,
+					std::vector<float> *lights, std::vector<float> *lightIntensities);
+
+// read a binary scene, or a text one through parser() if file is not one,
+// returning true if successful
+bool ReadScene(const std::string &file, std::vector<object> *objects, std::vector<Mesh> *meshes,
+			std::vector<float> *lights, std::vector<float> *lightIntensities);
+
+// write a scene as parsed by parser(), returning true if successful
+bool WriteSceneFile(const std::string &path, const std::vector<object> &objects,
+					const std::vector<Mesh> &meshes, const std::vector<float> &lights,
+					const std::vector<float> &lightIntensities);
+
+#endif
@@ -0,0 +1,187 @@
+// ==========================================================================
+// Work-stealing tile scheduler
+// ==========================================================================
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "scheduler.h"
+
+using namespace std;
+
+// tiles [front, back) still to be rendered; all tiles exist before a run
+// starts, so a deque never grows and a range is all it needs
+struct TileDeque
+{
+	mutex lock;
+	int front;
+	int back;
+
+	TileDeque() : front(0), back(0)
+	{}
+};
+
+struct TilePool
+{
+	vector<thread> threads;
+	vector<TileDeque> deques;		// one per worker, worker 0 is the caller
+	vector<WorkerStats> stats;
+
+	// a run is published by bumping generation under lock
+	mutex lock;
+	condition_variable wake;
+	condition_variable finished;
+	const function<void(int)> *task;
+	chrono::steady_clock::time_point start;	// of the run
+	int generation;
+	int running;					// helper threads still working on the run
+	bool quit;
+
+	explicit TilePool(int workers)
+		: deques(workers), stats(workers), task(0), generation(0), running(0), quit(false)
+	{}
+};
+
+static bool popFront(TileDeque *deque, int *tile)
+{
+	lock_guard<mutex> guard(deque->lock);
+	if (deque->front >= deque->back)
+		return false;
+	*tile = deque->front++;
+	return true;
+}
+
+static bool popBack(TileDeque *deque, int *tile)
+{
+	lock_guard<mutex> guard(deque->lock);
+	if (deque->front >= deque->back)
+		return false;
+	*tile = --deque->back;
+	return true;
+}
+
+// render tiles until every deque is empty; nothing is added during a run,
+// so a worker that finds them all empty is done
+static void work(TilePool *pool, int worker)
+{
+	int workers = pool->deques.size();
+	WorkerStats &stats = pool->stats[worker];
+	stats = WorkerStats();
+
+	for (;;)
+	{
+		int tile;
+		bool stolen = false;
+		if (!popFront(&pool->deques[worker], &tile))
+		{
+			int victim = -1;
+			for (int i = 1; i < workers && victim < 0; i++)
+				if (popBack(&pool->deques[(worker + i) % workers], &tile))
+					victim = i;
+			if (victim < 0)
+				break;
+			stolen = true;
+		}
+
+		auto start = chrono::steady_clock::now();
+		(*pool->task)(tile);
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+		if (stats.tiles == 0)
+			stats.first = chrono::duration<double>(chrono::steady_clock::now() - pool->start).count();
+		stats.busy += elapsed.count();
+		stats.tiles++;
+		stats.stolen += stolen;
+	}
+}
+
+static void helper(TilePool *pool, int worker)
+{
+	int seen = 0;
+	for (;;)
+	{
+		{
+			unique_lock<mutex> guard(pool->lock);
+			pool->wake.wait(guard, [&]{ return pool->quit || pool->generation != seen; });
+			if (pool->quit)
+				return;
+			seen = pool->generation;
+		}
+
+		work(pool, worker);
+
+		lock_guard<mutex> guard(pool->lock);
+		if (--pool->running == 0)
+			pool->finished.notify_one();
+	}
+}
+
+TilePool *CreateTilePool(int threads)
+{
+	if (threads <= 0)
+		threads = std::max(1u, thread::hardware_concurrency());
+
+	TilePool *pool = new TilePool(threads);
+	for (int i = 1; i < threads; i++)
+		pool->threads.push_back(thread(helper, pool, i));
+	return pool;
+}
+
+void DestroyTilePool(TilePool *pool)
+{
+	if (!pool)
+		return;
+	{
+		lock_guard<mutex> guard(pool->lock);
+		pool->quit = true;
+	}
+	pool->wake.notify_all();
+	for (int i = 0; i < (int)pool->threads.size(); i++)
+		pool->threads[i].join();
+	delete pool;
+}
+
+void RunTiles(TilePool *pool, int count, const function<void(int)> &task, TileStats *stats)
+{
+	auto start = chrono::steady_clock::now();
+	int workers = pool->deques.size();
+
+	// deal out one contiguous run of tiles per worker
+	for (int i = 0; i < workers; i++)
+	{
+		TileDeque &deque = pool->deques[i];
+		lock_guard<mutex> guard(deque.lock);
+		deque.front = (long long)count*i/workers;
+		deque.back = (long long)count*(i + 1)/workers;
+	}
+
+	{
+		lock_guard<mutex> guard(pool->lock);
+		pool->task = &task;
+		pool->start = start;
+		pool->running = workers - 1;
+		pool->generation++;
+	}
+	pool->wake.notify_all();
+
+	work(pool, 0);
+
+	{
+		unique_lock<mutex> guard(pool->lock);
+		pool->finished.wait(guard, [&]{ return pool->running == 0; });
+		pool->task = 0;
+	}
+
+	if (stats)
+	{
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		stats->elapsed = elapsed.count();
+		stats->workers = pool->stats;
+		stats->first = stats->elapsed;
+		for (int i = 0; i < workers; i++)
+			if (pool->stats[i].tiles > 0)
+				stats->first = std::min(stats->first, pool->stats[i].first);
+	}
+}
@@ -0,0 +1,51 @@
+// ==========================================================================
+// Work-stealing tile scheduler
+//
+// A pool of worker threads that renders the tiles of a frame. Every worker
+// owns a deque of tiles, dealt out as one contiguous run per worker so that
+// neighbouring tiles stay on the same core. A worker takes tiles from the
+// front of its own deque and, once that is empty, steals from the back of the
+// others', which keeps every core busy when some tiles (mirrors, glass) cost
+// far more than others.
+// ==========================================================================
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <functional>
+#include <vector>
+
+// what one worker did during a run
+struct WorkerStats
+{
+	int tiles;			// tiles rendered
+	int stolen;			// of which taken from another worker's deque
+	double busy;		// seconds spent rendering tiles
+	double first;		// seconds from the start of the run to its first tile done
+
+	WorkerStats() : tiles(0), stolen(0), busy(0), first(0)
+	{}
+};
+
+struct TileStats
+{
+	double elapsed;		// seconds from the start to the end of the run
+	double first;		// seconds from the start to the first tile done
+	std::vector<WorkerStats> workers;
+
+	TileStats() : elapsed(0), first(0)
+	{}
+};
+
+struct TilePool;
+
+// start a pool of the given number of workers (0 uses every hardware thread);
+// the thread calling RunTiles() counts as one of them
+TilePool *CreateTilePool(int threads);
+void DestroyTilePool(TilePool *pool);
+
+// call task(tile) for every tile in [0, count) on the workers of the pool and
+// return once all of them are done; runs on one pool must not overlap
+void RunTiles(TilePool *pool, int count, const std::function<void(int)> &task,
+			TileStats *stats = 0);
+
+#endif
@@ -0,0 +1,34 @@
+// ==========================================================================
+// Runtime detection of the vector instruction sets the tracer can use
+// ==========================================================================
+
+#include "simd.h"
+
+SimdLevel DetectSimdLevel()
+{
+#if SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return SIMD_SSE42;
+#endif
+	return SIMD_SCALAR;
+}
+
+const char *SimdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_SSE42:
+		return "SSE4.2";
+	case SIMD_AVX2:
+		return "AVX2";
+	case SIMD_AVX512:
+		return "AVX-512";
+	default:
+		return "scalar";
+	}
+}
@@ -0,0 +1,32 @@
+// ==========================================================================
+// Runtime detection of the vector instruction sets the tracer can use
+//
+// Kernels for wider instruction sets are compiled with per-function target
+// attributes, so one binary runs everywhere and picks the best kernel when
+// it starts.
+// ==========================================================================
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_X86 0
+#define SIMD_TARGET(isa)
+#endif
+
+enum SimdLevel
+{
+	SIMD_SCALAR,
+	SIMD_SSE42,
+	SIMD_AVX2,
+	SIMD_AVX512
+};
+
+// highest level supported by both the processor and the operating system
+SimdLevel DetectSimdLevel();
+
+const char *SimdLevelName(SimdLevel level);
+
+#endif
@@ -0,0 +1,313 @@
+// ==========================================================================
+// Triangles laid out for vector intersection tests
+// ==========================================================================
+
+#include <algorithm>
+#include "mesh.h"
+#include "triangles.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+// the kernels must round exactly like the scalar code, so multiplies and
+// adds are not fused even where the instruction set has FMA
+#pragma GCC optimize("fp-contract=off")
+
+using namespace std;
+using namespace glm;
+
+// floats loaded past the last slot by the widest kernel
+#define SOA_PADDING 16
+
+static void allocate(TriangleSoA *soa, int n)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		soa->p0[a].assign(n + SOA_PADDING, 0);
+		soa->e1[a].assign(n + SOA_PADDING, 0);
+		soa->e2[a].assign(n + SOA_PADDING, 0);
+	}
+	soa->triangle.assign(n, 0);
+}
+
+static void setTriangle(TriangleSoA *soa, int k, const object &o)
+{
+	vec3 e1 = o.y - o.x;
+	vec3 e2 = o.z - o.x;
+	for (int a = 0; a < 3; a++)
+	{
+		soa->p0[a][k] = o.x[a];
+		soa->e1[a][k] = e1[a];
+		soa->e2[a][k] = e2[a];
+	}
+	soa->triangle[k] = 1;
+}
+
+void BuildTriangleSoA(TriangleSoA *soa, const vector<object> &objects,
+					const vector<Mesh> &meshes, const vector<int> &slots)
+{
+	vector<int> starts = MeshStarts(objects.size(), meshes);
+	int n = slots.size();
+	allocate(soa, n);
+	for (int k = 0; k < n; k++)
+	{
+		object o = ScenePrimitive(objects, meshes, starts, slots[k]);
+		if (o.type == TRIANGLE_TYPE)
+			setTriangle(soa, k, o);
+	}
+}
+
+void BuildTriangleSoA(TriangleSoA *soa, const Mesh &mesh, const vector<int> &slots)
+{
+	int n = slots.size();
+	allocate(soa, n);
+	for (int k = 0; k < n; k++)
+		setTriangle(soa, k, MeshTriangle(mesh, slots[k]));
+}
+
+// --------------------------------------------------------------------------
+// Kernels
+//
+// Moller-Trumbore solves the same system as triangleIntersection() of the
+// shader, [-ray e1 e2] (t u v) = origin - p0, and keeps its strict bounds on
+// t, u, v and u + v. A zero determinant yields NaN and therefore no hit.
+//
+// Each kernel finds the lanes that hit in front of best and resolves them in
+// slot order, so ties go to the earlier slot just like a scalar loop.
+
+static int scalarTriangles(const TriangleSoA *soa, const int *slots, int first, int count,
+						vec3 ray, vec3 origin, int ignore, float *best)
+{
+	int hit = -1;
+	for (int k = first; k < first + count; k++)
+	{
+		vec3 p0(soa->p0[0][k], soa->p0[1][k], soa->p0[2][k]);
+		vec3 e1(soa->e1[0][k], soa->e1[1][k], soa->e1[2][k]);
+		vec3 e2(soa->e2[0][k], soa->e2[1][k], soa->e2[2][k]);
+
+		vec3 p = cross(ray, e2);
+		float inv = 1/dot(e1, p);
+		vec3 s = origin - p0;
+		float u = dot(s, p)*inv;
+		vec3 q = cross(s, e1);
+		float v = dot(ray, q)*inv;
+		float t = dot(e2, q)*inv;
+
+		if (t > 0 && t < *best && (u+v)<1 && (u+v)>0 && u<1 && u>0 && v<1 && v>0 && slots[k] != ignore)
+		{
+			*best = t;
+			hit = slots[k];
+		}
+	}
+	return hit;
+}
+
+#if SIMD_X86
+SIMD_TARGET("sse4.2")
+static int sseTriangles(const TriangleSoA *soa, const int *slots, int first, int count,
+						vec3 ray, vec3 origin, int ignore, float *best)
+{
+	__m128 dx = _mm_set1_ps(ray[0]), dy = _mm_set1_ps(ray[1]), dz = _mm_set1_ps(ray[2]);
+	__m128 ox = _mm_set1_ps(origin[0]), oy = _mm_set1_ps(origin[1]), oz = _mm_set1_ps(origin[2]);
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+
+	int hit = -1;
+	for (int k = first; k < first + count; k += 4)
+	{
+		__m128 e1x = _mm_loadu_ps(&soa->e1[0][k]), e1y = _mm_loadu_ps(&soa->e1[1][k]), e1z = _mm_loadu_ps(&soa->e1[2][k]);
+		__m128 e2x = _mm_loadu_ps(&soa->e2[0][k]), e2y = _mm_loadu_ps(&soa->e2[1][k]), e2z = _mm_loadu_ps(&soa->e2[2][k]);
+		__m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&soa->p0[0][k]));
+		__m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&soa->p0[1][k]));
+		__m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&soa->p0[2][k]));
+
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 inv = _mm_div_ps(one, det);
+
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+		__m128 uv = _mm_add_ps(u, v);
+
+		__m128 valid = _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, _mm_set1_ps(*best)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(v, one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(uv, zero), _mm_cmplt_ps(uv, one)));
+
+		int mask = _mm_movemask_ps(valid) & ((1 << std::min(4, first + count - k)) - 1);
+		if (!mask)
+			continue;
+		float ts[4];
+		_mm_storeu_ps(ts, t);
+		while (mask)
+		{
+			int lane = __builtin_ctz(mask);
+			mask &= mask - 1;
+			if (ts[lane] < *best && slots[k + lane] != ignore)
+			{
+				*best = ts[lane];
+				hit = slots[k + lane];
+			}
+		}
+	}
+	return hit;
+}
+
+SIMD_TARGET("avx2,fma")
+static int avx2Triangles(const TriangleSoA *soa, const int *slots, int first, int count,
+						vec3 ray, vec3 origin, int ignore, float *best)
+{
+	__m256 dx = _mm256_set1_ps(ray[0]), dy = _mm256_set1_ps(ray[1]), dz = _mm256_set1_ps(ray[2]);
+	__m256 ox = _mm256_set1_ps(origin[0]), oy = _mm256_set1_ps(origin[1]), oz = _mm256_set1_ps(origin[2]);
+	__m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+
+	int hit = -1;
+	for (int k = first; k < first + count; k += 8)
+	{
+		__m256 e1x = _mm256_loadu_ps(&soa->e1[0][k]), e1y = _mm256_loadu_ps(&soa->e1[1][k]), e1z = _mm256_loadu_ps(&soa->e1[2][k]);
+		__m256 e2x = _mm256_loadu_ps(&soa->e2[0][k]), e2y = _mm256_loadu_ps(&soa->e2[1][k]), e2z = _mm256_loadu_ps(&soa->e2[2][k]);
+		__m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&soa->p0[0][k]));
+		__m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&soa->p0[1][k]));
+		__m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&soa->p0[2][k]));
+
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 inv = _mm256_div_ps(one, det);
+
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+
+		__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv);
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv);
+		__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+		__m256 uv = _mm256_add_ps(u, v);
+
+		__m256 valid = _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(*best), _CMP_LT_OQ));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(u, one, _CMP_LT_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, one, _CMP_LT_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(uv, zero, _CMP_GT_OQ), _mm256_cmp_ps(uv, one, _CMP_LT_OQ)));
+
+		int mask = _mm256_movemask_ps(valid) & ((1 << std::min(8, first + count - k)) - 1);
+		if (!mask)
+			continue;
+		float ts[8];
+		_mm256_storeu_ps(ts, t);
+		while (mask)
+		{
+			int lane = __builtin_ctz(mask);
+			mask &= mask - 1;
+			if (ts[lane] < *best && slots[k + lane] != ignore)
+			{
+				*best = ts[lane];
+				hit = slots[k + lane];
+			}
+		}
+	}
+	return hit;
+}
+
+SIMD_TARGET("avx512f")
+static int avx512Triangles(const TriangleSoA *soa, const int *slots, int first, int count,
+						vec3 ray, vec3 origin, int ignore, float *best)
+{
+	__m512 dx = _mm512_set1_ps(ray[0]), dy = _mm512_set1_ps(ray[1]), dz = _mm512_set1_ps(ray[2]);
+	__m512 ox = _mm512_set1_ps(origin[0]), oy = _mm512_set1_ps(origin[1]), oz = _mm512_set1_ps(origin[2]);
+	__m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1);
+
+	int hit = -1;
+	for (int k = first; k < first + count; k += 16)
+	{
+		__m512 e1x = _mm512_loadu_ps(&soa->e1[0][k]), e1y = _mm512_loadu_ps(&soa->e1[1][k]), e1z = _mm512_loadu_ps(&soa->e1[2][k]);
+		__m512 e2x = _mm512_loadu_ps(&soa->e2[0][k]), e2y = _mm512_loadu_ps(&soa->e2[1][k]), e2z = _mm512_loadu_ps(&soa->e2[2][k]);
+		__m512 sx = _mm512_sub_ps(ox, _mm512_loadu_ps(&soa->p0[0][k]));
+		__m512 sy = _mm512_sub_ps(oy, _mm512_loadu_ps(&soa->p0[1][k]));
+		__m512 sz = _mm512_sub_ps(oz, _mm512_loadu_ps(&soa->p0[2][k]));
+
+		__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+		__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+		__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+		__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+		__m512 inv = _mm512_div_ps(one, det);
+
+		__m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(sz, e1y));
+		__m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(sx, e1z));
+		__m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(sy, e1x));
+
+		__m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(sx, px), _mm512_mul_ps(sy, py)), _mm512_mul_ps(sz, pz)), inv);
+		__m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)), inv);
+		__m512 t = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)), inv);
+		__m512 uv = _mm512_add_ps(u, v);
+
+		__mmask16 valid = _mm512_cmp_ps_mask(t, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, _mm512_set1_ps(*best), _CMP_LT_OQ);
+		valid &= _mm512_cmp_ps_mask(u, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(u, one, _CMP_LT_OQ);
+		valid &= _mm512_cmp_ps_mask(v, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(v, one, _CMP_LT_OQ);
+		valid &= _mm512_cmp_ps_mask(uv, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(uv, one, _CMP_LT_OQ);
+
+		int mask = valid & ((1 << std::min(16, first + count - k)) - 1);
+		if (!mask)
+			continue;
+		float ts[16];
+		_mm512_storeu_ps(ts, t);
+		while (mask)
+		{
+			int lane = __builtin_ctz(mask);
+			mask &= mask - 1;
+			if (ts[lane] < *best && slots[k + lane] != ignore)
+			{
+				*best = ts[lane];
+				hit = slots[k + lane];
+			}
+		}
+	}
+	return hit;
+}
+#endif
+
+// --------------------------------------------------------------------------
+// Dispatch
+
+typedef int (*TriangleKernel)(const TriangleSoA *soa, const int *slots, int first, int count,
+							vec3 ray, vec3 origin, int ignore, float *best);
+
+static SimdLevel kernelLevel = DetectSimdLevel();
+
+static TriangleKernel selectKernel(SimdLevel level)
+{
+#if SIMD_X86
+	switch (level)
+	{
+	case SIMD_AVX512:
+		return avx512Triangles;
+	case SIMD_AVX2:
+		return avx2Triangles;
+	case SIMD_SSE42:
+		return sseTriangles;
+	default:
+		break;
+	}
+#endif
+	return scalarTriangles;
+}
+
+static TriangleKernel kernel = selectKernel(kernelLevel);
+
+int IntersectTriangles(const TriangleSoA *soa, const int *slots, int first, int count,
+					vec3 ray, vec3 origin, int ignore, float *best)
+{
+	return kernel(soa, slots, first, count, ray, origin, ignore, best);
+}
+
+SimdLevel TriangleKernelLevel()
+{
+	return kernelLevel;
+}
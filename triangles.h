@@ -0,0 +1,44 @@
+// ==========================================================================
+// Triangles laid out for vector intersection tests
+//
+// A BVH keeps a copy of its triangles in leaf slot order, with the first
+// vertex and both edges of every triangle in separate arrays. A leaf is then
+// tested against a ray 4, 8 or 16 triangles at a time with Moller-Trumbore,
+// using SSE4.2, AVX2 or AVX-512 depending on what the processor supports.
+// ==========================================================================
+#ifndef TRIANGLES_H
+#define TRIANGLES_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+#include "simd.h"
+
+// slots holding other objects have zero edges and never hit; the arrays are
+// padded past the last slot so that a full vector can be loaded from any slot
+struct TriangleSoA
+{
+	std::vector<float> p0[3];
+	std::vector<float> e1[3];
+	std::vector<float> e2[3];
+	std::vector<unsigned char> triangle;	// nonzero if the slot holds a triangle
+};
+
+// lay out the triangles among the objects and mesh triangles of slots, one
+// entry per slot
+void BuildTriangleSoA(TriangleSoA *soa, const std::vector<object> &objects,
+					const std::vector<Mesh> &meshes, const std::vector<int> &slots);
+
+// the same for slots holding triangles of a single mesh
+void BuildTriangleSoA(TriangleSoA *soa, const Mesh &mesh, const std::vector<int> &slots);
+
+// closest triangle of slots [first, first + count) hit at a ray parameter in
+// (0, *best), skipping object ignore; returns the object index taken from
+// slots and lowers best, or returns -1
+int IntersectTriangles(const TriangleSoA *soa, const int *slots, int first, int count,
+					glm::vec3 ray, glm::vec3 origin, int ignore, float *best);
+
+// instruction set the triangle kernel was picked for
+SimdLevel TriangleKernelLevel();
+
+#endif
@@ -0,0 +1,202 @@
+// ==========================================================================
+// Scene file watcher
+// ==========================================================================
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "watcher.h"
+#include "scenefile.h"
+
+using namespace std;
+using namespace glm;
+
+// a save is read once the directory has been quiet for this long
+#define WATCH_SETTLE_MS 100
+
+struct SceneWatcher
+{
+	string file;
+	string name;				// file name within the watched directory
+	int inotify;
+	int wake[2];				// written to on destruction
+	function<void()> changed;
+	thread worker;
+
+	// newest version read, guarded by lock
+	mutex lock;
+	bool ready;
+	vector<object> objects;
+	vector<Mesh> meshes;
+	vector<float> lights;
+	vector<float> lightIntensities;
+
+	SceneWatcher() : inotify(-1), ready(false)
+	{
+		wake[0] = wake[1] = -1;
+	}
+};
+
+// waits up to timeout milliseconds, or for ever if it is negative, for the
+// file to be saved; returns 1 if it was, 0 if not and -1 once the watcher is
+// being destroyed
+static int waitForSave(SceneWatcher *watcher, int timeout)
+{
+	pollfd fds[2] = { { watcher->inotify, POLLIN, 0 }, { watcher->wake[0], POLLIN, 0 } };
+	if (poll(fds, 2, timeout) < 0)
+		return errno == EINTR ? 0 : -1;
+	if (fds[1].revents)
+		return -1;
+	if (!(fds[0].revents & POLLIN))
+		return 0;
+
+	alignas(inotify_event) char buffer[4096];
+	ssize_t bytes = read(watcher->inotify, buffer, sizeof(buffer));
+	int saved = 0;
+	for (ssize_t at = 0; at < bytes; )
+	{
+		const inotify_event *event = (const inotify_event *)&buffer[at];
+		if (event->len > 0 && watcher->name == event->name)
+			saved = 1;
+		at += sizeof(inotify_event) + event->len;
+	}
+	return saved;
+}
+
+static void watch(SceneWatcher *watcher)
+{
+	for (;;)
+	{
+		int saved = waitForSave(watcher, -1);
+		if (saved == 0)
+			continue;
+		while (saved > 0)
+			saved = waitForSave(watcher, WATCH_SETTLE_MS);
+		if (saved < 0)
+			return;
+
+		vector<object> objects;
+		vector<Mesh> meshes;
+		vector<float> lights;
+		vector<float> lightIntensities;
+		if (!ReadScene(watcher->file, &objects, &meshes, &lights, &lightIntensities))
+		{
+			cerr << watcher->file << " changed but does not load, keeping the last version" << endl;
+			continue;
+		}
+
+		{
+			lock_guard<mutex> guard(watcher->lock);
+			watcher->objects.swap(objects);
+			watcher->meshes.swap(meshes);
+			watcher->lights.swap(lights);
+			watcher->lightIntensities.swap(lightIntensities);
+			watcher->ready = true;
+		}
+		watcher->changed();
+	}
+}
+
+SceneWatcher *CreateSceneWatcher(const string &file, const function<void()> &changed)
+{
+	SceneWatcher *watcher = new SceneWatcher;
+	watcher->file = file;
+	watcher->changed = changed;
+
+	size_t slash = file.rfind('/');
+	string directory = slash == string::npos ? "." : file.substr(0, slash + 1);
+	watcher->name = slash == string::npos ? file : file.substr(slash + 1);
+
+	watcher->inotify = inotify_init1(IN_CLOEXEC);
+	if (watcher->inotify < 0
+		|| inotify_add_watch(watcher->inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0
+		|| pipe(watcher->wake) < 0)
+	{
+		cerr << "cannot watch " << file << ": " << strerror(errno) << endl;
+		DestroySceneWatcher(watcher);
+		return 0;
+	}
+
+	watcher->worker = thread(watch, watcher);
+	return watcher;
+}
+
+void DestroySceneWatcher(SceneWatcher *watcher)
+{
+	if (!watcher)
+		return;
+
+	if (watcher->worker.joinable())
+	{
+		char stop = 0;
+		while (write(watcher->wake[1], &stop, 1) < 0 && errno == EINTR)
+			;
+		watcher->worker.join();
+	}
+	for (int i = 0; i < 2; i++)
+		if (watcher->wake[i] >= 0)
+			close(watcher->wake[i]);
+	if (watcher->inotify >= 0)
+		close(watcher->inotify);
+	delete watcher;
+}
+
+bool TakeSceneVersion(SceneWatcher *watcher, vector<object> *objects, vector<Mesh> *meshes,
+					vector<float> *lights, vector<float> *lightIntensities)
+{
+	lock_guard<mutex> guard(watcher->lock);
+	if (!watcher->ready)
+		return false;
+
+	objects->swap(watcher->objects);
+	meshes->swap(watcher->meshes);
+	lights->swap(watcher->lights);
+	lightIntensities->swap(watcher->lightIntensities);
+	watcher->objects.clear();
+	watcher->meshes.clear();
+	watcher->lights.clear();
+	watcher->lightIntensities.clear();
+	watcher->ready = false;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Comparing versions
+
+template <typename T>
+static bool sameArray(const vector<T> &a, const vector<T> &b)
+{
+	return a.size() == b.size() && (a.empty() || !memcmp(a.data(), b.data(), a.size()*sizeof(T)));
+}
+
+bool ChangedInPlace(const vector<object> &objects, const vector<Mesh> &meshes,
+					const vector<object> &newObjects, const vector<Mesh> &newMeshes,
+					vector<int> *moved)
+{
+	moved->clear();
+	if (objects.size() != newObjects.size() || meshes.size() != newMeshes.size())
+		return false;
+
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		const Mesh &a = meshes[m], &b = newMeshes[m];
+		if (a.placed != b.placed || !sameArray(a.vertices, b.vertices)
+			|| !sameArray(a.indices, b.indices) || !sameArray(a.instances, b.instances))
+			return false;
+	}
+
+	for (int i = 0; i < (int)objects.size(); i++)
+	{
+		const object &a = objects[i], &b = newObjects[i];
+		if (a.type != b.type)
+			return false;
+		if (a.x != b.x || a.y != b.y || a.z != b.z)
+			moved->push_back(i);
+	}
+	return true;
+}
@@ -0,0 +1,40 @@
+// ==========================================================================
+// Scene file watcher
+//
+// Watches the file of the scene on show with inotify and reads it again on a
+// thread of its own whenever it is saved, so the viewer can swap the new
+// version in between frames. The directory is watched rather than the file,
+// as editors often save by writing a new file and renaming it over the old
+// one. Saves in quick succession are read once, and a version that does not
+// parse is reported and skipped, leaving the last good one on show.
+// ==========================================================================
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "scene.h"
+
+struct SceneWatcher;
+
+// start watching file, binary or text; changed is called on the watcher's
+// thread whenever a new version has been read. Returns null if the file
+// cannot be watched.
+SceneWatcher *CreateSceneWatcher(const std::string &file, const std::function<void()> &changed);
+void DestroySceneWatcher(SceneWatcher *watcher);
+
+// hand over the newest version read since the last call, returning false if
+// there is none
+bool TakeSceneVersion(SceneWatcher *watcher, std::vector<object> *objects, std::vector<Mesh> *meshes,
+					std::vector<float> *lights, std::vector<float> *lightIntensities);
+
+// true if the new version of a scene only changed its objects in place, with
+// the same number of objects of the same types and meshes that differ at
+// most in colour and material; moved then lists the objects whose shape or
+// place changed
+bool ChangedInPlace(const std::vector<object> &objects, const std::vector<Mesh> &meshes,
+					const std::vector<object> &newObjects, const std::vector<Mesh> &newMeshes,
+					std::vector<int> *moved);
+
+#endif
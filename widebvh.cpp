@@ -0,0 +1,359 @@
+// ==========================================================================
+// Multi-branch bounding volume hierarchies
+// ==========================================================================
+
+#include <algorithm>
+#include "widebvh.h"
+#include "simd.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+// --------------------------------------------------------------------------
+// Construction
+
+static float nodeArea(const BVHNode &node)
+{
+	AABB b;
+	b.min = node.min;
+	b.max = node.max;
+	return b.area();
+}
+
+// turn binary node binIndex into a wide node, opening the largest inner child
+// until all W slots are used, and return the index of the wide node
+template <int W>
+static int collapse(WideBVH<W> *wide, const BVH *bvh, int binIndex)
+{
+	int children[W];
+	int n = 0;
+
+	const BVHNode &root = bvh->nodes[binIndex];
+	if (root.count > 0)
+		children[n++] = binIndex;
+	else
+	{
+		children[n++] = root.first;
+		children[n++] = root.first + 1;
+	}
+
+	while (n < W)
+	{
+		int open = -1;
+		float largest = -1;
+		for (int i = 0; i < n; i++)
+		{
+			const BVHNode &c = bvh->nodes[children[i]];
+			if (c.count == 0 && nodeArea(c) > largest)
+			{
+				largest = nodeArea(c);
+				open = i;
+			}
+		}
+		if (open < 0)
+			break;
+
+		int first = bvh->nodes[children[open]].first;
+		children[open] = first;
+		children[n++] = first + 1;
+	}
+
+	int index = wide->nodes.size();
+	wide->nodes.push_back(WideBVHNode<W>());
+
+	for (int i = 0; i < W; i++)
+	{
+		int child = -1, count = 0;
+		vec3 lo = vec3(1e30f), hi = vec3(-1e30f);
+		if (i < n)
+		{
+			const BVHNode &c = bvh->nodes[children[i]];
+			lo = c.min;
+			hi = c.max;
+			count = c.count;
+			// the recursion grows the node array, so write through the index
+			child = count > 0 ? c.first : collapse(wide, bvh, children[i]);
+		}
+
+		WideBVHNode<W> &node = wide->nodes[index];
+		for (int a = 0; a < 3; a++)
+		{
+			node.lo[a][i] = lo[a];
+			node.hi[a][i] = hi[a];
+		}
+		node.child[i] = child;
+		node.count[i] = count;
+	}
+	return index;
+}
+
+template <int W>
+static void buildWide(WideBVH<W> *wide, const BVH *bvh)
+{
+	wide->nodes.clear();
+	if (bvh->nodes.empty())
+		return;
+	wide->nodes.reserve(bvh->nodes.size()/(W - 1) + 1);
+	collapse(wide, bvh, 0);
+}
+
+void BuildWideBVH(WideBVH<4> *wide, const BVH *bvh)
+{
+	buildWide(wide, bvh);
+}
+
+void BuildWideBVH(WideBVH<8> *wide, const BVH *bvh)
+{
+	buildWide(wide, bvh);
+}
+
+// --------------------------------------------------------------------------
+// Node tests
+//
+// Each test returns a bit mask of the children the ray enters before best and
+// stores the entry distances in tNear. The slab planes are picked by the sign
+// of the direction, which keeps empty slots from ever passing.
+
+struct WideRay
+{
+	vec3 origin;
+	vec3 inv;
+	int sign[3];
+};
+
+template <int W>
+struct ScalarNodeTest
+{
+	int operator()(const WideBVHNode<W> &node, const WideRay &r, float best, float *tNear) const
+	{
+		int mask = 0;
+		for (int i = 0; i < W; i++)
+		{
+			float tMin = 0, tMax = best;
+			for (int a = 0; a < 3; a++)
+			{
+				float nearPlane = r.sign[a] ? node.hi[a][i] : node.lo[a][i];
+				float farPlane = r.sign[a] ? node.lo[a][i] : node.hi[a][i];
+				tMin = std::max(tMin, (nearPlane - r.origin[a])*r.inv[a]);
+				tMax = std::min(tMax, (farPlane - r.origin[a])*r.inv[a]);
+			}
+			tNear[i] = tMin;
+			if (tMin <= tMax)
+				mask |= 1 << i;
+		}
+		return mask;
+	}
+};
+
+#if SIMD_X86
+struct SSENodeTest
+{
+	int operator()(const WideBVHNode<4> &node, const WideRay &r, float best, float *tNear) const
+	{
+		__m128 tMin = _mm_setzero_ps();
+		__m128 tMax = _mm_set1_ps(best);
+		for (int a = 0; a < 3; a++)
+		{
+			__m128 lo = _mm_loadu_ps(node.lo[a]);
+			__m128 hi = _mm_loadu_ps(node.hi[a]);
+			__m128 o = _mm_set1_ps(r.origin[a]);
+			__m128 inv = _mm_set1_ps(r.inv[a]);
+			__m128 nearPlane = r.sign[a] ? hi : lo;
+			__m128 farPlane = r.sign[a] ? lo : hi;
+			tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(nearPlane, o), inv));
+			tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(farPlane, o), inv));
+		}
+		_mm_storeu_ps(tNear, tMin);
+		return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+	}
+};
+
+struct AVX2NodeTest
+{
+	SIMD_TARGET("avx2,fma")
+	int operator()(const WideBVHNode<8> &node, const WideRay &r, float best, float *tNear) const
+	{
+		__m256 tMin = _mm256_setzero_ps();
+		__m256 tMax = _mm256_set1_ps(best);
+		for (int a = 0; a < 3; a++)
+		{
+			__m256 lo = _mm256_loadu_ps(node.lo[a]);
+			__m256 hi = _mm256_loadu_ps(node.hi[a]);
+			__m256 o = _mm256_set1_ps(r.origin[a]);
+			__m256 inv = _mm256_set1_ps(r.inv[a]);
+			__m256 nearPlane = r.sign[a] ? hi : lo;
+			__m256 farPlane = r.sign[a] ? lo : hi;
+			tMin = _mm256_max_ps(tMin, _mm256_mul_ps(_mm256_sub_ps(nearPlane, o), inv));
+			tMax = _mm256_min_ps(tMax, _mm256_mul_ps(_mm256_sub_ps(farPlane, o), inv));
+		}
+		_mm256_storeu_ps(tNear, tMin);
+		return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+	}
+};
+#endif
+
+// --------------------------------------------------------------------------
+// Traversal
+
+struct WideStackEntry
+{
+	int node;		// wide node, or first slot of a leaf
+	int count;		// objects of a leaf, 0 for wide nodes
+	float tNear;
+};
+
+// closest hit, or with AnyHit the first hit found; forced inline so that
+// kernels compiled for wider instruction sets get their own copy of the loop
+// around the node test
+template <int W, bool AnyHit, typename NodeTest>
+static inline __attribute__((always_inline))
+int traverse(const WideBVH<W> *wide, const BVH *bvh, const vector<object> &objects,
+			const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore,
+			float maxT, float *t, NodeTest test)
+{
+	float best = maxT;
+	int hit = -1;
+	// occlusion queries test the planes last, like IntersectAny() on the
+	// binary tree
+	if (!AnyHit)
+		hit = IntersectUnbounded(bvh, objects, normals, ray, origin, ignore, &best);
+
+	WideRay r;
+	r.origin = origin;
+	for (int a = 0; a < 3; a++)
+	{
+		float d = ray[a];
+		if (std::abs(d) < 1e-30f)
+			d = d < 0 ? -1e-30f : 1e-30f;
+		r.inv[a] = 1/d;
+		r.sign[a] = r.inv[a] < 0;
+	}
+
+	// every visit pops one entry and pushes at most W
+	WideStackEntry stack[BVH_MAX_DEPTH*W];
+	int sp = 0;
+	if (!wide->nodes.empty())
+	{
+		stack[sp].node = 0;
+		stack[sp].count = 0;
+		stack[sp++].tNear = 0;
+	}
+
+	while (sp > 0)
+	{
+		WideStackEntry e = stack[--sp];
+		if (e.tNear >= best)
+			continue;
+
+		if (e.count > 0)
+		{
+			int leafHit = IntersectLeaf(bvh, objects, ray, origin, e.node, e.count, ignore, &best);
+			if (leafHit >= 0)
+			{
+				hit = leafHit;
+				if (AnyHit)
+					break;
+			}
+			continue;
+		}
+
+		const WideBVHNode<W> &node = wide->nodes[e.node];
+		float tNear[W];
+		int mask = test(node, r, best, tNear);
+
+		// sort the hit children from far to near so the nearest is popped first
+		int order[W];
+		int n = 0;
+		while (mask)
+		{
+			int i = __builtin_ctz(mask);
+			mask &= mask - 1;
+			int j = n++;
+			while (j > 0 && tNear[order[j - 1]] < tNear[i])
+			{
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+
+		for (int k = 0; k < n; k++)
+		{
+			int i = order[k];
+			stack[sp].node = node.child[i];
+			stack[sp].count = node.count[i];
+			stack[sp++].tNear = tNear[i];
+		}
+	}
+
+	if (AnyHit && hit < 0)
+		hit = IntersectUnbounded(bvh, objects, normals, ray, origin, ignore, &best);
+
+	if (hit >= 0 && t)
+		*t = best;
+	return hit;
+}
+
+#if SIMD_X86
+template <bool AnyHit>
+SIMD_TARGET("avx2,fma")
+static int traverseAVX2(const WideBVH<8> *wide, const BVH *bvh, const vector<object> &objects,
+						const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore,
+						float maxT, float *t)
+{
+	return traverse<8, AnyHit>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t, AVX2NodeTest());
+}
+#endif
+
+template <bool AnyHit>
+static int traverseWide(const WideBVH<4> *wide, const BVH *bvh, const vector<object> &objects,
+						const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore,
+						float maxT, float *t)
+{
+#if SIMD_X86
+	return traverse<4, AnyHit>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t, SSENodeTest());
+#else
+	return traverse<4, AnyHit>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t, ScalarNodeTest<4>());
+#endif
+}
+
+template <bool AnyHit>
+static int traverseWide(const WideBVH<8> *wide, const BVH *bvh, const vector<object> &objects,
+						const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore,
+						float maxT, float *t)
+{
+#if SIMD_X86
+	static const bool avx2 = DetectSimdLevel() >= SIMD_AVX2;
+	if (avx2)
+		return traverseAVX2<AnyHit>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t);
+#endif
+	return traverse<8, AnyHit>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t, ScalarNodeTest<8>());
+}
+
+int IntersectClosest(const WideBVH<4> *wide, const BVH *bvh, const vector<object> &objects,
+					const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore, float maxT, float *t)
+{
+	return traverseWide<false>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t);
+}
+
+int IntersectClosest(const WideBVH<8> *wide, const BVH *bvh, const vector<object> &objects,
+					const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore, float maxT, float *t)
+{
+	return traverseWide<false>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t);
+}
+
+int IntersectAny(const WideBVH<4> *wide, const BVH *bvh, const vector<object> &objects,
+				const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore, float maxT, float *t)
+{
+	return traverseWide<true>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t);
+}
+
+int IntersectAny(const WideBVH<8> *wide, const BVH *bvh, const vector<object> &objects,
+				const vector<vec3> &normals, vec3 ray, vec3 origin, int ignore, float maxT, float *t)
+{
+	return traverseWide<true>(wide, bvh, objects, normals, ray, origin, ignore, maxT, t);
+}
@@ -0,0 +1,54 @@
+// ==========================================================================
+// Multi-branch bounding volume hierarchies
+//
+// The binary tree of bvh.h collapsed into 4 or 8 wide nodes. Child bounds
+// are stored as structures of arrays so that a ray is tested against every
+// child of a node with one vector slab test (SSE for 4 children, AVX2 for 8),
+// and hit children are visited from near to far.
+// ==========================================================================
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "bvh.h"
+
+// empty child slots have inverted bounds and therefore never hit
+template <int W>
+struct WideBVHNode
+{
+	float lo[3][W];
+	float hi[3][W];
+	int child[W];	// inner node index, or first slot in BVH::indices of a leaf
+	int count[W];	// objects in a leaf child, 0 for inner children
+};
+
+// leaves keep referring to BVH::indices and BVH::unbounded of the tree they
+// were collapsed from, so that tree has to stay alive next to this one
+template <int W>
+struct WideBVH
+{
+	std::vector<WideBVHNode<W> > nodes;
+};
+
+// collapse a built binary tree
+void BuildWideBVH(WideBVH<4> *wide, const BVH *bvh);
+void BuildWideBVH(WideBVH<8> *wide, const BVH *bvh);
+
+// same query as IntersectClosest() on the binary tree
+int IntersectClosest(const WideBVH<4> *wide, const BVH *bvh, const std::vector<object> &objects,
+					const std::vector<glm::vec3> &normals,
+					glm::vec3 ray, glm::vec3 origin, int ignore, float maxT, float *t);
+int IntersectClosest(const WideBVH<8> *wide, const BVH *bvh, const std::vector<object> &objects,
+					const std::vector<glm::vec3> &normals,
+					glm::vec3 ray, glm::vec3 origin, int ignore, float maxT, float *t);
+
+// same query as IntersectAny() on the binary tree
+int IntersectAny(const WideBVH<4> *wide, const BVH *bvh, const std::vector<object> &objects,
+				const std::vector<glm::vec3> &normals,
+				glm::vec3 ray, glm::vec3 origin, int ignore, float maxT, float *t);
+int IntersectAny(const WideBVH<8> *wide, const BVH *bvh, const std::vector<object> &objects,
+				const std::vector<glm::vec3> &normals,
+				glm::vec3 ray, glm::vec3 origin, int ignore, float maxT, float *t);
+
+#endif